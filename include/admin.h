@@ -0,0 +1,29 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <stdint.h>
+#include "network.h"
+
+// a local endpoint for scraping the server. it answers HTTP GET requests:
+//   /metrics  the metrics registry in the Prometheus text format
+//   /state    a JSON dump of the sizes of the chat state, the send queues
+//             of the links and the memory used per subsystem
+// admin connections are non-blocking and handled by the event loop like
+// the others, and their number and lifetime are limited
+
+// sets where the endpoint listens: a port number for localhost, or the
+// path of a unix socket. the endpoint is off unless this is called
+void admin_set_listen(const char *listen);
+
+// opens the endpoint and adds it to the epoll set
+// returns 1 if successful or the endpoint is off, -1 on failure
+int admin_start(int epollfd);
+
+// handles epoll events of the endpoint and its connections
+void admin_handle_event(conn_t *conn, uint32_t events);
+
+// closes connections that have been open too long. must not be called
+// while there are unhandled epoll events
+void admin_timer();
+
+#endif
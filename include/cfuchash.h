@@ -0,0 +1,99 @@
+/*
+ * cfuchash.h - This file is part of the libcfu library
+ *
+ * This code is released under the BSD license, see cfuhash.h.
+ */
+
+#ifndef CFUCHASH_H_
+#define CFUCHASH_H_
+
+#include <cfu.h>
+#include <cfuhash.h>
+
+#include <stddef.h>
+
+CFU_BEGIN_DECLS
+
+/* cfuchash is a hash table that can be shared between threads.  The
+ * table is split into stripes by the hash value of the key, and each
+ * stripe has its own lock, so writers only contend when they touch the
+ * same stripe.  Lookups take no locks at all.  Entries that are
+ * deleted, or moved when a stripe grows, are freed only once every
+ * thread that might still be reading them has finished its lookup
+ * (epoch based reclamation).
+ *
+ * Keys are always copied.  Values are not owned by the table: a value
+ * that is replaced or deleted may still be in use by a reader in
+ * another thread, so free it with cfuchash_retire() instead of free().
+ */
+
+typedef struct cfuchash_table cfuchash_table_t;
+
+/* Creates a new table with the default number of stripes.  The only
+ * flag supported is CFUHASH_IGNORE_CASE.  Returns NULL if out of memory.
+ */
+cfuchash_table_t * cfuchash_new(unsigned int flags);
+
+/* Same as cfuchash_new(), with the number of stripes given.  It is
+ * rounded up to a power of two.
+ */
+cfuchash_table_t * cfuchash_new_with_stripes(size_t num_stripes, unsigned int flags);
+
+/* Frees the table and everything waiting to be retired.  No other
+ * thread may be using the table anymore.
+ */
+void cfuchash_destroy(cfuchash_table_t *ht);
+
+/* Returns one if the key is in the table and sets data to its value,
+ * zero otherwise.  If key_size is -1, key is assumed to be a
+ * null-terminated string.
+ */
+int cfuchash_get_data(cfuchash_table_t *ht, const void *key, size_t key_size, void **data);
+
+/* Adds the entry, or replaces the value of an existing one.  Returns
+ * one if a new entry was added, -1 if there was no memory for it.
+ * Otherwise the old value is stored in r and zero is returned.
+ */
+int cfuchash_put_data(cfuchash_table_t *ht, const void *key, size_t key_size, void *data,
+	void **r);
+
+/* Removes the entry and returns its value, or NULL if there was none.
+ * NULL is also returned, and the entry left in the table, if there was
+ * no memory to retire the entry.
+ */
+void * cfuchash_delete_data(cfuchash_table_t *ht, const void *key, size_t key_size);
+
+/* Same as the _data versions, with the key a null-terminated string. */
+void * cfuchash_get(cfuchash_table_t *ht, const char *key);
+void * cfuchash_put(cfuchash_table_t *ht, const char *key, void *data);
+void * cfuchash_delete(cfuchash_table_t *ht, const char *key);
+
+/* Returns the number of entries.  With concurrent writers, this is
+ * only a snapshot.
+ */
+size_t cfuchash_num_entries(cfuchash_table_t *ht);
+
+/* Calls fe_fn for each entry until it returns non-zero, without
+ * blocking writers.  Entries added or deleted during the walk may or
+ * may not be seen.  Returns the number of entries visited.
+ */
+size_t cfuchash_foreach(cfuchash_table_t *ht, cfuhash_foreach_fn_t fe_fn, void *arg);
+
+/* Calls ff(ptr) once no thread can be reading ptr anymore, i.e. after
+ * every read section that was active when this was called has ended.
+ * Returns zero, without ever calling ff, if there was no memory to
+ * remember ptr.
+ */
+int cfuchash_retire(cfuchash_table_t *ht, void *ptr, cfuhash_free_fn_t ff);
+
+/* Marks a read section of the calling thread.  Values looked up inside
+ * one stay valid until cfuchash_read_unlock(), even if another thread
+ * deletes and retires them meanwhile.  Lookups are read sections on
+ * their own, and read sections can be nested.
+ */
+void cfuchash_read_lock(void);
+void cfuchash_read_unlock(void);
+
+CFU_END_DECLS
+
+#endif
@@ -40,12 +40,26 @@
 
 #include <cfu.h>
 #include <stdio.h>
+#include <stdint.h>
 
 CFU_BEGIN_DECLS
 
 /* The hash table itself. */
 typedef struct cfuhash_table cfuhash_table_t;
 
+/* An iterator over the key/value pairs in a hash.  Unlike with
+ * cfuhash_each() and cfuhash_next(), the position is kept in the
+ * iterator instead of the hash, so any number of iterations over the
+ * same hash can be going on at once.  Declare it on the stack and
+ * start it with cfuhash_iter_init().  The fields are private.
+ */
+typedef struct cfuhash_iter {
+	cfuhash_table_t *ht;
+	size_t index;
+	void *entry;
+	int old; /* still in the storage an incremental rehash is moving from */
+} cfuhash_iter_t;
+
 /* Prototype for a pointer to a hashing function. */
 typedef unsigned int (*cfuhash_function_t)(const void *key, size_t length);
 
@@ -92,7 +106,7 @@ cfuhash_table_t * cfuhash_merge(cfuhash_table_t *ht1, cfuhash_table_t *ht2,
 
 /* Sets the hashing function to use when computing which bucket to add
  * entries to.  It should return a 32-bit unsigned integer.  By
- * default, Perl's hashing algorithm is used.
+ * default, wyhash with a random seed chosen once per process is used.
  */
 int cfuhash_set_hash_function(cfuhash_table_t *ht, cfuhash_function_t hf);
 
@@ -134,11 +148,23 @@ int cfuhash_exists_data(cfuhash_table_t *ht, const void *key, size_t key_size);
  *  string.  If data_size is -1, it is assumed to be a null-terminated
  *  string (it's length will be calculated using strlen).  If
  *  data_size is zero, it will be returned as zero when the value is
- *  requested.
+ *  requested.  If an open addressing table is full and memory for
+ *  growing it runs out, nothing is stored and zero is returned.
  */
 int cfuhash_put_data(cfuhash_table_t *ht, const void *key, size_t key_size, void *data,
 	size_t data_size, void **r);
 
+/* Finds the entry for key, or inserts one with NULL data if there is
+ * none, with a single lookup.  If key_size is -1, key is assumed to
+ * be a null-terminated string.  Returns a pointer to the value of the
+ * entry, which the caller can read or set.  The pointer is only valid
+ * until the hash is changed.  If inserted is not NULL, it is set to 1
+ * if the entry was added and 0 if it already existed.  Returns NULL if
+ * an open addressing table is full and memory for growing it runs out.
+ */
+void **cfuhash_find_or_insert(cfuhash_table_t *ht, const void *key, size_t key_size,
+	int *inserted);
+
 /* Clears the hash table (deletes all entries). */
 void cfuhash_clear(cfuhash_table_t *ht);
 
@@ -172,6 +198,19 @@ int cfuhash_each_data(cfuhash_table_t *ht, void **key, size_t *key_size, void **
 int cfuhash_next_data(cfuhash_table_t *ht, void **key, size_t *key_size, void **data,
 	size_t *data_size);
 
+/* Starts an iteration over the hash.  The hash must not be changed
+ * until the iteration is over, use cfuhash_foreach_remove() to
+ * remove entries while iterating.
+ */
+void cfuhash_iter_init(cfuhash_iter_t *iter, cfuhash_table_t *ht);
+
+/* Gets the next key/value pair from the iterator and prefetches the
+ * one after it.  Returns 1 if an entry was returned, 0 if there are
+ * no more entries.  Any of the out parameters may be NULL.
+ */
+int cfuhash_iter_next(cfuhash_iter_t *iter, void **key, size_t *key_size, void **data,
+	size_t *data_size);
+
 /* Iterates over the key/value pairs in the hash, passing each one
  * to r_fn, and removes all entries for which r_fn returns true.
  * If ff is not NULL, it is the passed the data to be freed.  arg
@@ -184,7 +223,8 @@ size_t cfuhash_foreach_remove(cfuhash_table_t *ht, cfuhash_remove_fn_t r_fn,
  * to fe_fn, along with arg. This locks the hash, so do not call
  * any operations on the hash from within fe_fn unless you really
  * know what you're doing.  A non-zero return value from fe_fn()
- * stops the iteration.
+ * stops the iteration.  The next entry is prefetched while fe_fn()
+ * runs.
  */
 size_t cfuhash_foreach(cfuhash_table_t *ht, cfuhash_foreach_fn_t fe_fn, void *arg);
 
@@ -213,6 +253,44 @@ size_t cfuhash_num_buckets(cfuhash_table_t *ht);
  */
 size_t cfuhash_num_buckets_used(cfuhash_table_t *ht);
 
+/* Statistics for spotting a degenerating hash, see cfuhash_get_stats().
+ * For chained buckets, a probe is a key comparison, so max_probe is
+ * the length of the longest chain and histogram[i] is the number of
+ * buckets holding i entries.  With CFUHASH_OPEN_ADDRESSING, a probe is
+ * a group of slots looked at, and histogram[i] is the number of
+ * entries found in the group i + 1 steps along their probe sequence.
+ * In both, the last histogram element also counts everything past it.
+ * During an incremental rehash, the entries in both the old and the new
+ * buckets are counted, each in the buckets it's in.
+ */
+#define CFUHASH_STATS_HISTOGRAM_SIZE 8
+
+typedef struct cfuhash_stats {
+	size_t entries;
+	size_t buckets;      /* buckets, or slots with open addressing */
+	size_t old_buckets;  /* the old buckets an incremental rehash is still moving
+	                        entries from, 0 if there's none going on */
+	size_t buckets_used;
+	double load_factor;  /* entries / buckets */
+	size_t max_probe;    /* most probes needed to find an entry */
+	double avg_probe;    /* average probes needed to find an entry */
+	size_t histogram[CFUHASH_STATS_HISTOGRAM_SIZE];
+	unsigned int rehash_count;
+	uint64_t rehash_ns;  /* total time spent rehashing, in nanoseconds */
+	size_t memory;       /* bytes allocated for buckets, entries and copied keys */
+} cfuhash_stats_t;
+
+/* Returns the same as the memory field of the stats, without walking
+ * the hash.
+ */
+size_t cfuhash_memory(cfuhash_table_t *ht);
+
+/* Fills in stats for the hash.  This walks the whole hash, so it's
+ * meant to be called now and then rather than on every operation.
+ * Returns 0 if ht is NULL.
+ */
+int cfuhash_get_stats(cfuhash_table_t *ht, cfuhash_stats_t *stats);
+
 /* Assumes all the keys and values are null-terminated strings and
  * returns a bencoded string representing the hash (see
  * http://www.bittorrent.com/protocol.html)
@@ -245,6 +323,7 @@ int cfuhash_pretty_print(cfuhash_table_t *ht, FILE *fp);
  *   3) Returned keys or values are the return value of the function.
  */
 void * cfuhash_get(cfuhash_table_t *ht, const char *key);
+int cfuhash_try_get(cfuhash_table_t *ht, const char *key, void **data);
 int cfuhash_exists(cfuhash_table_t *ht, const char *key);
 void * cfuhash_put(cfuhash_table_t *ht, const char *key, void *data);
 void * cfuhash_delete(cfuhash_table_t *ht, const char *key);
@@ -252,6 +331,14 @@ int cfuhash_each(cfuhash_table_t *ht, char **key, void **data);
 int cfuhash_next(cfuhash_table_t *ht, char **key, void **data);
 void **cfuhash_keys(cfuhash_table_t *ht, size_t *num_keys, int fast);
 
+/* The default hash function and key comparison, for benchmarks and for
+ * other containers that want to hash keys the same way.
+ * cfuhash_hash_key() lower cases the key first if ignore_case is set.
+ * cfuhash_key_cmp() returns zero if the keys are equal, like memcmp().
+ */
+unsigned int cfuhash_hash_key(const void *key, size_t key_size, int ignore_case);
+int cfuhash_key_cmp(const void *key, size_t key_size, const void *other, size_t other_size,
+	int ignore_case);
 
 /* hash table flags */
 #define CFUHASH_NOCOPY_KEYS 1        /* do not copy the key when inserting a hash entry */
@@ -260,6 +347,14 @@ void **cfuhash_keys(cfuhash_table_t *ht, size_t *num_keys, int fast);
 #define CFUHASH_FROZEN_UNTIL_GROWS (1 << 3) /* do not shrink the hash until it has grown */
 #define CFUHASH_FREE_DATA (1 << 4)   /* call free() on each value when the hash is destroyed */
 #define CFUHASH_IGNORE_CASE (1 << 5) /* treat keys case-insensitively */
+#define CFUHASH_OPEN_ADDRESSING (1 << 6) /* store the entries in an open addressing table instead
+											of chained buckets. Can only be changed while the hash
+											is empty, and isn't set if memory for the new storage
+											runs out. These tables always grow when they fill up,
+											CFUHASH_FROZEN only stops them from shrinking */
+#define CFUHASH_INCREMENTAL_REHASH (1 << 7) /* when resizing, move the entries a few buckets at a
+											   time on each put instead of all at once. Iterating
+											   and getting the stats look at both storages */
 
 
 CFU_END_DECLS
@@ -1,17 +1,29 @@
 #ifndef CHAT_H
 #define CHAT_H
 
+#include <string.h>
 #include "network.h"
 #include "cfuhash.h"
+#include "symbols.h"
+#include "typed_hash.h"
 
 #define NICKNAME_LENGTH 10
 #define CHANNEL_LENGTH 10
 #define CHANNEL_MIN_LENGTH 2 // don't allow just "#" as channel name
 #define USER_MAX_CHANNELS 10
 
+struct packet_builder_struct;
 typedef struct {
     char name[CHANNEL_LENGTH];
-    cfuhash_table_t *nicknames; // nickname -> nickname_t
+    size_t name_len;
+    symbol_t id;
+    cfuhash_table_t *nicknames; // nickname id -> nickname_t
+    // ready to send NAMES packets for the channel. joins are appended to the
+    // last packet, leaves mark the packets invalid so they're rebuilt on the next NAMES
+    struct packet_builder_struct *names;
+    size_t names_count;
+    size_t names_capacity;
+    int names_valid;
 } channel_t;
 
 typedef enum {
@@ -20,10 +32,50 @@ typedef enum {
 
 typedef struct {
     char nickname[NICKNAME_LENGTH];
+    size_t nickname_len;
+    symbol_t id; // SYMBOL_NONE until registered
     nickname_type type;
     channel_t *channels[USER_MAX_CHANNELS];
 } nickname_t;
 
+// nicknames as hash keys: folded to lower case and zero padded to a fixed
+// size, so they can be hashed and compared as two 64-bit words. names
+// longer than NICK_KEY_LENGTH are cut short
+#define NICK_KEY_LENGTH 15
+typedef union {
+    char name[NICK_KEY_LENGTH + 1];
+    uint64_t words[2];
+} nick_key_t;
+
+// lower cases the ASCII letters in all 8 bytes of v at once
+static inline uint64_t nick_key_fold(uint64_t v) {
+    uint64_t low = v & 0x7f7f7f7f7f7f7f7full;
+    uint64_t from_a = low + 0x3f3f3f3f3f3f3f3full; // high bit set for bytes >= 'A'
+    uint64_t past_z = low + 0x2525252525252525ull; // high bit set for bytes > 'Z'
+    uint64_t upper = from_a & ~past_z & ~v & 0x8080808080808080ull;
+    return v | (upper >> 2);
+}
+
+static inline nick_key_t nick_key(const char *name, size_t name_len) {
+    nick_key_t key;
+    memset(&key, 0, sizeof(key));
+    if (name_len > NICK_KEY_LENGTH) {
+        name_len = NICK_KEY_LENGTH;
+    }
+    memcpy(key.name, name, name_len);
+    key.words[0] = nick_key_fold(key.words[0]);
+    key.words[1] = nick_key_fold(key.words[1]);
+    return key;
+}
+
+static inline uint64_t nick_key_hash(nick_key_t key, uint64_t seed) {
+    return typed_hash_mix(key.words[0] ^ seed, key.words[1] ^ seed ^ 0xe7037ed1a0b428dbull);
+}
+
+static inline int nick_key_equal(nick_key_t a, nick_key_t b) {
+    return a.words[0] == b.words[0] && a.words[1] == b.words[1];
+}
+
 struct client_struct;
 typedef struct {
     nickname_t nick;
@@ -1,8 +1,13 @@
 #ifndef DAEMON_H
 #define DAEMON_H
 
+#include <signal.h>
+
 #define PID_FILE_PATH "/tmp/nwprog8.pid"
 
+// set by SIGTERM, the event loop returns when it sees it
+extern volatile sig_atomic_t daemon_stop;
+
 void init_daemon();
 int pid_file_exists();
 
@@ -0,0 +1,86 @@
+#ifndef FLIGHTREC_H
+#define FLIGHTREC_H
+
+#include <stdint.h>
+
+// the flight recorder keeps the last FLIGHTREC_SIZE network and protocol
+// events in memory. adding one is a few stores, so it's always on. if a dump
+// file is set, the ring is written to it on SIGUSR1 and when the server
+// crashes. read it with: src/logdecode -f file.log.flight
+// only the event loop thread may add events
+
+#define FLIGHTREC_SIZE 8192 // a power of two
+#define FLIGHTREC_PATH_LENGTH 512
+
+// the dump file is a flightrec_header_t and then the records from the
+// oldest to the newest, in host byte order
+#define FLIGHTREC_MAGIC "NWPFLT2\n"
+#define FLIGHTREC_MAGIC_LENGTH 8
+
+typedef enum {
+    FLIGHTREC_ACCEPT,
+    FLIGHTREC_READ,        // size: bytes
+    FLIGHTREC_PACKET,      // size: packet length, value: handler us
+    FLIGHTREC_SEND,        // size: bytes, value: write calls, the newline included
+    FLIGHTREC_SEND_FAILED, // size: bytes, value: errno
+    FLIGHTREC_CLOSE,
+    FLIGHTREC_STALL,       // size: events, value: busy us
+    FLIGHTREC_EVENTS
+} flightrec_event;
+
+typedef struct {
+    uint64_t time;     // monotonic ns of the event loop wakeup it happened in
+    int32_t fd;
+    uint8_t event;     // flightrec_event
+    uint8_t conn_type; // connection_type
+    uint8_t command;   // metrics_command, for packets
+    uint8_t unused;
+    uint32_t size;
+    uint32_t value;
+} flightrec_record_t;
+
+typedef struct {
+    char magic[FLIGHTREC_MAGIC_LENGTH];
+    uint32_t record_size;
+    uint32_t records;  // in the file
+    uint64_t total;    // events ever recorded
+    uint64_t time;     // monotonic ns of the dump
+    int32_t signal;    // the signal that caused the dump
+    uint32_t unused;
+} flightrec_header_t;
+
+extern flightrec_record_t flightrec_ring[FLIGHTREC_SIZE];
+extern uint64_t flightrec_next;
+extern uint64_t flightrec_time;
+
+// sets the time stamped on the events from now on. the event loop calls it
+// once per wakeup, so adding an event doesn't read the clock
+static inline void flightrec_set_time(uint64_t ns) {
+    flightrec_time = ns;
+}
+
+static inline void flightrec_add(flightrec_event event, int fd, int conn_type, int command,
+                                 uint32_t size, uint32_t value) {
+    flightrec_record_t *record = &flightrec_ring[flightrec_next++ & (FLIGHTREC_SIZE - 1)];
+    record->time = flightrec_time;
+    record->fd = fd;
+    record->event = event;
+    record->conn_type = conn_type;
+    record->command = command;
+    record->size = size;
+    record->value = value;
+}
+
+// sets the file to dump to and installs the handlers for SIGUSR1 and the
+// fatal signals. a relative path is made absolute, as a daemon runs in /.
+// returns 0 if the path is too long or a handler can't be installed
+int flightrec_install(const char *path);
+
+// writes the ring to the dump file, safe to call from a signal handler.
+// returns 0 on failure
+int flightrec_dump(int signum);
+
+// the name of an event, e.g. "packet"
+const char *flightrec_event_name(flightrec_event event);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef FLOOD_H
+#define FLOOD_H
+
+#include <stdint.h>
+
+// flood control for client packets using token buckets. every client has a
+// bucket for all of its packets and one bucket per expensive command.
+// a packet is only let through if all the buckets it draws from have a token
+typedef enum {
+    FLOOD_ALL, FLOOD_MSG, FLOOD_JOIN, FLOOD_NAMES, FLOOD_CLASSES
+} flood_class;
+
+typedef struct {
+    int64_t tokens[FLOOD_CLASSES]; // in thousandths of a token
+    int64_t refilled_ms;           // when the buckets were last refilled
+    uint64_t dropped;              // packets dropped from this client
+    int throttled;                 // 1 if the last packet was dropped
+} flood_bucket_t;
+
+// sets the limit for a class: rate tokens are added per second, up to burst tokens.
+// a rate of 0 disables the limit
+void flood_set_limit(flood_class class, uint32_t rate, uint32_t burst);
+
+// fills the buckets of a new client
+void flood_init(flood_bucket_t *bucket);
+
+// takes a token for a packet of the given class
+// returns 1 if the packet may be handled, 0 if it should be dropped
+int flood_allow(flood_bucket_t *bucket, flood_class class);
+
+// returns the number of packets dropped for a class across all the clients
+uint64_t flood_dropped(flood_class class);
+
+#endif
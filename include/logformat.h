@@ -0,0 +1,52 @@
+#ifndef LOGFORMAT_H
+#define LOGFORMAT_H
+
+#include <stddef.h>
+
+// the binary log file is a stream of records, each starting with a type
+// byte. integers are in host byte order.
+//
+//   LOGFORMAT_SESSION   magic (8 bytes). written whenever the file is
+//                       (re)opened, format ids start over after it
+//   LOGFORMAT_DEFINE    u32 id, u16 length, the format string
+//   LOGFORMAT_RECORD    u32 format id, u8 level, i64 seconds, u16 length,
+//                       the arguments
+//   LOGFORMAT_DROPPED   i64 seconds, u64 number of records dropped
+//
+// the arguments of a record are packed in the order of the conversions in
+// its format string, * widths and precisions included. integers, pointers
+// and doubles take 8 bytes, strings a u16 length and the bytes. a record
+// may end before all the arguments if they didn't fit
+#define LOGFORMAT_MAGIC "NWPLOG1\n"
+#define LOGFORMAT_MAGIC_LENGTH 8
+
+#define LOGFORMAT_SESSION 'S'
+#define LOGFORMAT_DEFINE 'F'
+#define LOGFORMAT_RECORD 'R'
+#define LOGFORMAT_DROPPED 'D'
+
+typedef enum {
+    LOGFORMAT_END,       // end of the format string
+    LOGFORMAT_LITERAL,   // plain text or %%
+    LOGFORMAT_INT,       // int and anything promoted to it, %d %u %x %c
+    LOGFORMAT_LONG,      // %ld
+    LOGFORMAT_LONG_LONG, // %lld, %jd
+    LOGFORMAT_SIZE,      // %zu, %td
+    LOGFORMAT_DOUBLE,    // %f %e %g %a
+    LOGFORMAT_STRING,    // %s
+    LOGFORMAT_POINTER,   // %p
+    LOGFORMAT_INVALID    // anything else, e.g. %n or %Lf
+} logformat_type;
+
+typedef struct {
+    logformat_type type;
+    const char *start; // of the piece in the format string
+    size_t length;
+    int stars;         // int arguments taken by * before the argument itself
+    int precision;     // -1 if there is none, -2 if it's given by *
+} logformat_piece_t;
+
+// reads the next piece of a printf format string, returns the rest of it
+const char *logformat_next(const char *format, logformat_piece_t *piece);
+
+#endif
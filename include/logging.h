@@ -2,6 +2,7 @@
 #define LOGGING_H
 
 #include <stdarg.h>
+#include <stddef.h>
 
 typedef enum {
     DEBUG, INFO, WARN, ERROR
@@ -11,11 +12,42 @@ typedef enum {
 int init_logger(log_level level, char *log_filename);
 // closes the log file and opens it again
 void log_reopen();
+// switches the log file to the binary format described in logformat.h,
+// src/logdecode turns it back into text. must be called before the writer
+// thread is started. returns 0 if there is no log file
+int log_use_binary();
+// moves writing the log to a background thread, records are queued in a
+// lock-free ring. when the ring is full, debug and info records are dropped
+// (and their count logged later), warnings and errors wait for room.
+// must be called after daemonizing as threads don't survive fork
+int log_start_writer();
+// writes out everything queued and stops the writer thread. called at exit
+void log_stop_writer();
+// returns the bytes used for the queue of the writer thread
+size_t log_memory();
 
-// log functions for different log levels
-void log_debug(char *format_string, ...);
-void log_info(char *format_string, ...);
-void log_warn(char *format_string, ...);
-void log_error(char *format_string, ...);
+// levels below LOG_MIN_LEVEL are compiled out, e.g. -DLOG_MIN_LEVEL=INFO
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL DEBUG
+#endif
+
+// the level given to init_logger
+extern log_level logging_level;
+
+// writes a record at the given level, use the macros below instead
+void log_write(log_level level, char *format_string, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// 1 if records at the level are written. use it to skip work that's only
+// needed for logging
+#define log_enabled(level) \
+    ((level) >= LOG_MIN_LEVEL && __builtin_expect((level) >= logging_level, (level) != DEBUG))
+
+// log macros for different log levels. the arguments are only evaluated
+// if the level is enabled
+#define log_debug(...) do { if (log_enabled(DEBUG)) log_write(DEBUG, __VA_ARGS__); } while (0)
+#define log_info(...) do { if (log_enabled(INFO)) log_write(INFO, __VA_ARGS__); } while (0)
+#define log_warn(...) do { if (log_enabled(WARN)) log_write(WARN, __VA_ARGS__); } while (0)
+#define log_error(...) do { if (log_enabled(ERROR)) log_write(ERROR, __VA_ARGS__); } while (0)
 
 #endif
@@ -0,0 +1,159 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+// counters, gauges and histograms of the server. every thread updates its
+// own copy of the counters and histograms with plain stores, so an update
+// is a few instructions. readers add the copies of all the threads up.
+// gauges are single values shared by all the threads
+
+// the commands packets are counted and timed by
+typedef enum {
+    METRICS_CMD_NICK,
+    METRICS_CMD_MSG,
+    METRICS_CMD_JOIN,
+    METRICS_CMD_LEAVE,
+    METRICS_CMD_NAMES,
+    METRICS_CMD_KILL,
+    METRICS_CMD_CMDREPLY,
+    METRICS_CMD_OTHER,
+    METRICS_COMMANDS
+} metrics_command;
+
+typedef enum {
+    METRIC_BYTES_READ,
+    METRIC_BYTES_WRITTEN,
+    METRIC_PARTIAL_WRITES,  // writes the kernel took only a part of
+    METRIC_LOOP_STALLS,     // event loop iterations over the stall threshold
+    METRIC_TCP_RETRANSMITS, // segments the kernel retransmitted, seen by the sampler
+    METRIC_PACKETS_IN,      // + metrics_command
+    METRIC_PACKETS_OUT = METRIC_PACKETS_IN + METRICS_COMMANDS, // + metrics_command
+    METRIC_COUNTERS = METRIC_PACKETS_OUT + METRICS_COMMANDS
+} metric_counter;
+
+typedef enum {
+    METRIC_CLIENTS,
+    METRIC_SERVERS,
+    METRIC_CHANNELS,
+    METRIC_GAUGES
+} metric_gauge;
+
+typedef enum {
+    METRIC_FANOUT,         // connections a broadcast or relay was sent to
+    METRIC_SEND_BYTES,     // size of a single send
+    METRIC_LOOP_BUSY_NS,   // time from epoll_wait returning to calling it again
+    METRIC_LOOP_EVENTS,    // events returned by a single epoll_wait
+    METRIC_TCP_RTT_US,     // round trip time of a sampled connection
+    METRIC_TCP_SEND_QUEUE, // unacknowledged bytes of a sampled connection
+    METRIC_HANDLER_NS,     // + metrics_command, time spent handling a packet
+    METRIC_HISTOGRAMS = METRIC_HANDLER_NS + METRICS_COMMANDS
+} metric_histogram;
+
+// histograms have HDR style buckets: the values 0-7 have their own bucket,
+// after that every power of two is split into 8 buckets, so a bucket is
+// never more than 12.5% wide
+#define METRICS_SUB_BUCKETS 8
+#define METRICS_BUCKETS ((64 - 2) * METRICS_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[METRICS_BUCKETS];
+} metrics_histogram_t;
+
+typedef struct metrics_shard_struct {
+    uint64_t counters[METRIC_COUNTERS];
+    metrics_histogram_t histograms[METRIC_HISTOGRAMS];
+    struct metrics_shard_struct *next;
+} metrics_shard_t;
+
+typedef struct {
+    uint64_t counters[METRIC_COUNTERS];
+    int64_t gauges[METRIC_GAUGES];
+    metrics_histogram_t histograms[METRIC_HISTOGRAMS];
+} metrics_snapshot_t;
+
+extern __thread metrics_shard_t *metrics_local_shard;
+extern int64_t metrics_gauges[METRIC_GAUGES];
+
+// allocates the shard of the calling thread. never returns NULL, if there
+// is no memory the updates of the thread go to a shared dummy shard
+metrics_shard_t *metrics_shard_create();
+
+static inline metrics_shard_t *metrics_shard() {
+    metrics_shard_t *shard = metrics_local_shard;
+    if (__builtin_expect(shard == NULL, 0)) {
+        shard = metrics_shard_create();
+    }
+    return shard;
+}
+
+// only the owning thread writes its shard, so a relaxed load and store is
+// enough and compiles to a plain add, but readers never see torn values
+static inline void metrics_add(uint64_t *value, uint64_t n) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_count(metric_counter counter, uint64_t n) {
+    metrics_add(&metrics_shard()->counters[counter], n);
+}
+
+static inline int metrics_bucket(uint64_t value) {
+    if (value < METRICS_SUB_BUCKETS) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    return (msb - 2) * METRICS_SUB_BUCKETS + ((value >> (msb - 3)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+static inline void metrics_record(metric_histogram histogram, uint64_t value) {
+    metrics_histogram_t *h = &metrics_shard()->histograms[histogram];
+    metrics_add(&h->count, 1);
+    metrics_add(&h->sum, value);
+    metrics_add(&h->buckets[metrics_bucket(value)], 1);
+}
+
+static inline void metrics_gauge_add(metric_gauge gauge, int64_t n) {
+    __atomic_add_fetch(&metrics_gauges[gauge], n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_gauge_set(metric_gauge gauge, int64_t value) {
+    __atomic_store_n(&metrics_gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+// monotonic time for measuring latencies
+static inline uint64_t metrics_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// returns the command a packet starts with
+metrics_command metrics_command_of(const char *packet, size_t packet_len);
+
+// adds up the metrics of all the threads
+void metrics_snapshot(metrics_snapshot_t *snapshot);
+
+// returns the bytes allocated for the shards of all the threads
+size_t metrics_memory();
+
+// names for exporting, e.g. "bytes_read", "packets_in", "handler_ns"
+const char *metrics_counter_name(metric_counter counter);
+const char *metrics_gauge_name(metric_gauge gauge);
+const char *metrics_histogram_name(metric_histogram histogram);
+// returns the command of a per command metric, or METRICS_COMMANDS if the
+// metric isn't one
+metrics_command metrics_counter_command(metric_counter counter);
+metrics_command metrics_histogram_command(metric_histogram histogram);
+const char *metrics_command_name(metrics_command command);
+
+// the smallest value that goes into a bucket
+uint64_t metrics_bucket_lower_bound(int bucket);
+// returns the value below which the given fraction (0-1) of the values fall,
+// as the upper end of the bucket it's in
+uint64_t metrics_percentile(const metrics_histogram_t *histogram, double fraction);
+
+#endif
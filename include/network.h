@@ -4,9 +4,12 @@
 #include <sys/socket.h>
 #include <stdint.h>
 #include "chat.h"
+#include "flood.h"
+#include "tcpstats.h"
+#include "metrics.h"
 
 typedef enum {
-    SERVER, CLIENT
+    SERVER, CLIENT, ADMIN
 } connection_type;
 
 #define NETWORK_MAX_EVENTS 10
@@ -17,6 +20,7 @@ typedef enum {
 #define NETWORK_CLIENT_BUF 2048
 #define NETWORK_SERVER_BUF 65536
 #define NETWORK_MAX_PACKET_SIZE 256
+#define NETWORK_DEFAULT_STALL_MS 100
 
 typedef struct {
     int fd;
@@ -28,12 +32,15 @@ typedef struct client_struct {
     int buf_used;
     char buf[NETWORK_CLIENT_BUF];    
     localnick_t *nick;
+    flood_bucket_t flood;
+    tcp_sample_t tcp;
 } client_t;
 
 typedef struct server_struct {
     conn_t conn;
     int buf_used;
     char buf[NETWORK_SERVER_BUF];    
+    tcp_sample_t tcp;
 } server_t;
 
 // inits the network socket and starts running the event loop
@@ -44,6 +51,17 @@ int network_start(uint16_t client_port, int socket_domain, int socket_protocol,
 // (+ closes the connection if failure)
 int network_send(conn_t *conn, const void *data, const size_t size);
 
+// logs the event loop iterations that take at least ms milliseconds,
+// 0 disables the log
+void network_set_stall_threshold(int ms);
+
+// tells the event loop how long handling a packet took, so a stall can be
+// blamed on the slowest one
+void network_note_packet(metrics_command command, uint64_t ns);
+
+// sets O_NONBLOCK on a socket, returns -1 on failure
+int make_nonblock(int sockfd);
+
 // handles a disconnect, frees data associated with a client_t and closes the related fd
 void client_free(client_t *client);
 // frees data associated with a client_t and closes the related fd
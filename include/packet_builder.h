@@ -0,0 +1,47 @@
+#ifndef PACKET_BUILDER_H
+#define PACKET_BUILDER_H
+
+#include <string.h>
+#include "network.h"
+
+// builds an outgoing packet straight into its send buffer from pieces whose
+// lengths are already known, so no format string needs to be parsed and the
+// finished packet doesn't need to be measured again with strlen.
+// like snprintf before, anything that doesn't fit in NETWORK_MAX_PACKET_SIZE
+// (including the terminating '\0') is truncated
+typedef struct packet_builder_struct {
+    size_t len;
+    char buf[NETWORK_MAX_PACKET_SIZE];
+} packet_builder_t;
+
+static inline void packet_builder_init(packet_builder_t *packet) {
+    packet->len = 0;
+}
+
+// appends len bytes of data to the packet
+static inline void packet_append(packet_builder_t *packet, const char *data, size_t len) {
+    size_t room = NETWORK_MAX_PACKET_SIZE - 1 - packet->len;
+    if (len > room) {
+        len = room;
+    }
+    memcpy(&packet->buf[packet->len], data, len);
+    packet->len += len;
+}
+
+static inline void packet_append_char(packet_builder_t *packet, char c) {
+    if (packet->len < NETWORK_MAX_PACKET_SIZE - 1) {
+        packet->buf[packet->len++] = c;
+    }
+}
+
+// appends a string literal, its length is computed at compile time
+#define packet_append_literal(packet, literal) \
+    packet_append((packet), (literal), sizeof(literal) - 1)
+
+// terminates the packet with '\0' and returns its length
+static inline size_t packet_finish(packet_builder_t *packet) {
+    packet->buf[packet->len] = '\0';
+    return packet->len;
+}
+
+#endif
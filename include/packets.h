@@ -7,20 +7,59 @@
 
 void init_packets();
 
+// logs statistics of the hash tables every interval seconds, 0 disables them
+void set_stats_interval(int interval);
+
+// called by the event loop at least once a second
+void handle_timer();
+
+// sizes of the chat state, memory in bytes
+typedef struct {
+    size_t nicknames;
+    size_t local_nicknames;
+    size_t channels;
+    size_t servers;
+    size_t nick_table_memory;
+    size_t channel_table_memory;
+    size_t channel_memory;  // channel_t, member tables and NAMES packets
+    size_t symbol_memory;
+    size_t nickname_memory; // nickname structs of local and remote nicknames
+    size_t server_memory;   // server_t, including the read buffers
+} packets_state_t;
+
+// fills in the state from counters kept as the tables change, without walking them
+void packets_get_state(packets_state_t *state);
+
+// calls fn for every server link
+void packets_foreach_server(void (*fn)(conn_t *conn, void *arg), void *arg);
+
+// a position in a walk over the links that is done a part at a time
+typedef struct {
+    int clients;    // 1 once the servers have been walked
+    size_t pos;
+} packets_link_cursor_t;
+
+// calls fn for at most max links, starting where the cursor is. returns 0
+// once the walk has reached the end. links added or tables grown between
+// the calls may be skipped or visited twice
+int packets_walk_links(packets_link_cursor_t *cursor, size_t max, void (*fn)(conn_t *conn, void *arg), void *arg);
+
 // handles a packet for the given client
 // handle_packet MUST NOT assume that any data pointed by
 // packet will be valid after the function call
+// packet_len is the length of the packet without the terminating null
 // return value: returns STOP_HANDLING if the network layer should stop handling this client
-int handle_client_packet(client_t *client, char *packet);
+int handle_client_packet(client_t *client, char *packet, size_t packet_len);
 
 // called before client_t is freed from memory
 void handle_client_disconnect(client_t *client);
 
 // handles a packet for the given server
+// packet_len is the length of the framed packet without the terminating '\0'
 // handle_packet MUST NOT assume that any data pointed by
 // packet will be valid after the function call
 // return value: returns STOP_HANDLING if the network layer should stop handling this server
-int handle_server_packet(server_t *server, char *packet);
+int handle_server_packet(server_t *server, char *packet, size_t packet_len);
 
 // called when a new server connection happens
 void handle_server_connect(server_t *server);
@@ -0,0 +1,39 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// static tracepoints (USDT) of the "chat" provider. when sys/sdt.h is
+// installed (systemtap-sdt-dev) a probe is a single nop in the code plus a
+// note in the binary, so they can stay in production builds. attach with e.g.
+//   bpftrace -e 'usdt:src/server:chat:dispatch_end { @[str(arg2)] = hist(arg3); }'
+//   perf probe -x src/server sdt_chat:send_flushed
+// without sys/sdt.h, or when built with -DNO_PROBES, they compile to nothing
+//
+// the probes and their arguments:
+//   accept        fd, connection_type
+//   read          fd, connection_type, bytes
+//   packet        fd, connection_type, length        (a packet was framed)
+//   dispatch      fd, command, command name           (a handler starts)
+//   dispatch_end  fd, command, command name, ns       (the fd may be closed by now)
+//   send_queued   fd, connection_type, bytes
+//   send_flushed  fd, connection_type, bytes          (the kernel took all of it)
+//   conn_free     fd, connection_type
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PROBES_ENABLED
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+#include <sys/sdt.h>
+#define PROBE2(name, a, b) DTRACE_PROBE2(chat, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(chat, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(chat, name, a, b, c, d)
+#else
+// the arguments are never evaluated, but still count as used
+#define PROBE2(name, a, b) do { if (0) { (void)(a); (void)(b); } } while (0)
+#define PROBE3(name, a, b, c) do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+#define PROBE4(name, a, b, c, d) do { if (0) { (void)(a); (void)(b); (void)(c); (void)(d); } } while (0)
+#endif
+
+#endif
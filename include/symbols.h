@@ -0,0 +1,36 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cfuhash.h"
+
+// interned nickname and channel names. every distinct name (compared
+// case-insensitively) gets a 32-bit id, so that data structures can compare
+// and hash integers instead of strings. nicknames and channels share the
+// table as channel names always start with '#' and nicknames never do
+typedef uint32_t symbol_t;
+
+#define SYMBOL_NONE 0
+#define SYMBOL_MAX_LENGTH 256
+
+void init_symbols();
+
+// returns the id for name, creating it if the name isn't known yet.
+// every call takes a reference that must be given back with symbol_release
+symbol_t symbol_intern(const char *name, size_t name_len);
+
+// returns the id for an already interned name or SYMBOL_NONE. no reference is taken
+symbol_t symbol_lookup(const char *name, size_t name_len);
+
+// releases a reference taken by symbol_intern, the id can be reused
+// once the last reference is gone
+void symbol_release(symbol_t symbol);
+
+// fills in the statistics of the symbol table
+void symbols_get_stats(cfuhash_stats_t *stats);
+
+// returns the bytes allocated for the symbol table, without walking it
+size_t symbols_memory();
+
+#endif
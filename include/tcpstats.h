@@ -0,0 +1,59 @@
+#ifndef TCPSTATS_H
+#define TCPSTATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// samples the kernel's view (TCP_INFO and SIOCOUTQ) of every server link and
+// registered client on a timer, to tell a slow consumer from a slow server.
+// each connection keeps a rolling summary of its samples, and the connections
+// with the most data queued are kept as the worst offenders
+
+#define TCPSTATS_DEFAULT_INTERVAL 10
+#define TCPSTATS_WORST 5
+#define TCPSTATS_BATCH 256 // the most links sampled per event loop wakeup
+#define TCPSTATS_NICKNAME_LENGTH 16 // longer nicknames are cut
+
+typedef struct {
+    uint32_t samples;
+    uint32_t send_queue;      // bytes not yet acknowledged by the peer
+    uint32_t send_queue_avg;  // moving average, each sample weighs 1/4
+    uint32_t send_queue_max;
+    uint32_t rtt_us;          // the kernel's smoothed round trip time
+    uint32_t cwnd;            // congestion window, in segments
+    uint32_t unacked;         // segments sent but not acknowledged
+    uint32_t retransmits;     // total retransmitted segments
+    uint32_t retransmits_new; // since the previous sample
+} tcp_sample_t;
+
+typedef struct {
+    int fd;
+    int type;                                // connection_type
+    char nickname[TCPSTATS_NICKNAME_LENGTH]; // empty for servers
+    tcp_sample_t sample;
+} tcpstats_link_t;
+
+// the send queues of the clients sampled by a round
+typedef struct {
+    size_t clients;
+    size_t send_queue_total;
+    size_t send_queue_max;
+} tcpstats_queues_t;
+
+// sets how often the connections are sampled, 0 disables sampling
+void tcpstats_set_interval(int seconds);
+
+// samples the next batch of connections. a round over all of them starts
+// when the interval has passed since the last one ended
+void tcpstats_timer();
+
+// returns the worst offenders of the last round, the most queued first
+int tcpstats_worst(const tcpstats_link_t **links);
+
+// returns the client send queues of the last round
+const tcpstats_queues_t *tcpstats_client_queues();
+
+// logs the worst offenders
+void log_tcpstats();
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef TIMECACHE_H
+#define TIMECACHE_H
+
+#include <time.h>
+
+// length of the "HH:MM:SS" string returned by timecache_hms, without the null
+#define TIMECACHE_HMS_LENGTH 8
+
+// returns the current wall clock second from the coarse clock, which is
+// read without a system call and without touching the timezone
+time_t timecache_seconds();
+
+// returns the given second as "HH:MM:SS" in local time. every thread keeps
+// the last string it formatted, so it's only patched when the second changes
+// and localtime only runs when the minute changes
+const char *timecache_hms(time_t seconds);
+
+#endif
@@ -0,0 +1,379 @@
+#ifndef TYPED_HASH_H
+#define TYPED_HASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/random.h>
+
+// hash tables specialized for one key and value type at compile time.
+// TYPED_HASH_DEFINE(name, key_type, value_type, hash_fn, equal_fn) defines
+// name_t and static inline functions working on it:
+//
+//   int name_init(name_t *t, size_t capacity)
+//       returns 0 if the storage couldn't be allocated
+//   void name_destroy(name_t *t)
+//   size_t name_count(const name_t *t)
+//   size_t name_memory(const name_t *t)
+//       returns the bytes allocated for the slots
+//   value_type *name_get(const name_t *t, key_type key)
+//       returns the value stored for key, or NULL if there is none
+//   value_type *name_insert(name_t *t, key_type key, int *inserted)
+//       returns the value stored for key, adding an entry for it first if
+//       there is none (*inserted tells which). the value of a new entry is
+//       zeroed. returns NULL if the table couldn't grow
+//   int name_remove(name_t *t, key_type key, value_type *value)
+//       removes the entry for key and returns 1, or 0 if there was none
+//   int name_next(const name_t *t, size_t *pos, key_type *key, value_type *value)
+//       iterates the table starting from *pos = 0, returns 0 at the end.
+//       key and value may be NULL. entries may be removed while iterating,
+//       but inserting may move them around
+//   void name_get_stats(const name_t *t, typed_hash_stats_t *stats)
+//       walks the table to fill in stats
+//
+// hash_fn(key, seed) returns a 64-bit hash of the key, and equal_fn(a, b)
+// is true for equal keys. both are called directly, so the compiler can
+// inline them into the table operations.
+//
+// the entries are kept in one array with open addressing and linear
+// probing. a separate control byte per slot tells whether the slot is
+// empty, deleted or full, and for full slots holds 7 bits of the hash so
+// most mismatching slots are skipped without comparing the keys.
+// removing leaves a tombstone, which is reused by inserts and cleared the
+// next time the table is rebuilt.
+//
+// rebuilding only allocates the new storage, and the following inserts
+// move TYPED_HASH_MIGRATE_STEP old slots each, so no insert stalls on
+// moving the whole table. until the move is over, lookups look in the new
+// storage and then the old one, and iterating and the stats cover both.
+// removing doesn't move anything, so removing while iterating is still safe
+
+#define TYPED_HASH_EMPTY 0
+#define TYPED_HASH_DELETED 1
+#define TYPED_HASH_FULL 0x80
+
+#define TYPED_HASH_MIN_CAPACITY 16
+// how many old slots each insert moves while the table is being rebuilt
+#define TYPED_HASH_MIGRATE_STEP 32
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    size_t old_capacity; // slots of the storage still being moved from, or 0
+    size_t tombstones;
+    size_t max_probe;  // most slots looked at to find an entry
+    double avg_probe;  // average slots looked at to find an entry
+    unsigned int rebuilds;
+    size_t memory;     // bytes allocated for the slots of both storages
+} typed_hash_stats_t;
+
+// 64x64 -> 128 bit multiply, folding the halves together
+static inline uint64_t typed_hash_mix(uint64_t a, uint64_t b) {
+    __extension__ unsigned __int128 r = (unsigned __int128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// a random seed for a table, so the slots of keys can't be predicted
+static inline uint64_t typed_hash_random_seed(void) {
+    uint64_t seed;
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+        seed = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)&seed;
+    }
+    return seed;
+}
+
+static inline uint64_t typed_hash_pointer(const void *p, uint64_t seed) {
+    return typed_hash_mix((uint64_t)(uintptr_t)p ^ seed, 0x9e3779b97f4a7c15ull);
+}
+
+#define TYPED_HASH_DEFINE(name, K, V, hash_fn, equal_fn)                                \
+                                                                                        \
+typedef struct {                                                                        \
+    K key;                                                                              \
+    V value;                                                                            \
+} name##_slot_t;                                                                        \
+                                                                                        \
+typedef struct {                                                                        \
+    size_t capacity; /* always a power of two */                                        \
+    size_t count;    /* entries in both storages */                                     \
+    size_t used;     /* full and deleted slots */                                       \
+    uint64_t seed;                                                                      \
+    unsigned int rebuilds;                                                              \
+    uint8_t *ctrl;                                                                      \
+    name##_slot_t *slots;                                                               \
+    /* the storage being moved from, old_capacity is 0 if there's none.                 \
+       the slots before migrate_pos have been moved and are deleted */                  \
+    size_t old_capacity;                                                                \
+    size_t old_count;                                                                   \
+    size_t migrate_pos;                                                                 \
+    uint8_t *old_ctrl;                                                                  \
+    name##_slot_t *old_slots;                                                           \
+} name##_t;                                                                             \
+                                                                                        \
+static inline int name##_rebuild(name##_t *t, size_t capacity);                         \
+                                                                                        \
+static inline int name##_init(name##_t *t, size_t capacity) {                           \
+    size_t size = TYPED_HASH_MIN_CAPACITY;                                              \
+    memset(t, 0, sizeof(name##_t));                                                     \
+    t->seed = typed_hash_random_seed();                                                 \
+    while (size < capacity) {                                                           \
+        size <<= 1;                                                                     \
+    }                                                                                   \
+    if (!name##_rebuild(t, size)) {                                                     \
+        return 0;                                                                       \
+    }                                                                                   \
+    t->rebuilds = 0;                                                                    \
+    return 1;                                                                           \
+}                                                                                       \
+                                                                                        \
+static inline void name##_destroy(name##_t *t) {                                        \
+    free(t->ctrl);                                                                      \
+    free(t->slots);                                                                     \
+    free(t->old_ctrl);                                                                  \
+    free(t->old_slots);                                                                 \
+    memset(t, 0, sizeof(name##_t));                                                     \
+}                                                                                       \
+                                                                                        \
+static inline size_t name##_count(const name##_t *t) {                                  \
+    return t->count;                                                                    \
+}                                                                                       \
+                                                                                        \
+static inline size_t name##_memory(const name##_t *t) {                                 \
+    return (t->capacity + t->old_capacity) * (sizeof(name##_slot_t) + 1);               \
+}                                                                                       \
+                                                                                        \
+static inline uint8_t name##_tag(uint64_t hash) {                                       \
+    return TYPED_HASH_FULL | (uint8_t)(hash >> 57);                                     \
+}                                                                                       \
+                                                                                        \
+/* returns the slot of key, or capacity if it's not in the storage */                   \
+static inline size_t name##_find(const uint8_t *ctrl, const name##_slot_t *slots,       \
+                                 size_t capacity, K key, uint64_t hash) {               \
+    size_t mask = capacity - 1;                                                         \
+    uint8_t tag = name##_tag(hash);                                                     \
+    size_t i;                                                                           \
+    for (i = hash & mask; ctrl[i] != TYPED_HASH_EMPTY; i = (i + 1) & mask) {            \
+        if (ctrl[i] == tag && equal_fn(slots[i].key, key)) {                            \
+            return i;                                                                   \
+        }                                                                               \
+    }                                                                                   \
+    return capacity;                                                                    \
+}                                                                                       \
+                                                                                        \
+/* returns the first free slot for a key known not to be in the table */                \
+static inline size_t name##_find_free(const name##_t *t, uint64_t hash) {               \
+    size_t mask = t->capacity - 1;                                                      \
+    size_t i;                                                                           \
+    for (i = hash & mask; t->ctrl[i] & TYPED_HASH_FULL; i = (i + 1) & mask);            \
+    return i;                                                                           \
+}                                                                                       \
+                                                                                        \
+/* returns the value of key and the slot it's in, looking in the new                    \
+   storage first, or NULL if it's in neither */                                         \
+static inline V *name##_lookup(const name##_t *t, K key, uint64_t hash,                 \
+                               size_t *slot, int *old) {                                \
+    size_t i = name##_find(t->ctrl, t->slots, t->capacity, key, hash);                  \
+    if (i != t->capacity) {                                                             \
+        *slot = i;                                                                      \
+        *old = 0;                                                                       \
+        return &t->slots[i].value;                                                      \
+    }                                                                                   \
+    if (t->old_count) {                                                                 \
+        i = name##_find(t->old_ctrl, t->old_slots, t->old_capacity, key, hash);         \
+        if (i != t->old_capacity) {                                                     \
+            *slot = i;                                                                  \
+            *old = 1;                                                                   \
+            return &t->old_slots[i].value;                                              \
+        }                                                                               \
+    }                                                                                   \
+    return NULL;                                                                        \
+}                                                                                       \
+                                                                                        \
+/* moves the entries of up to count old slots to the new storage, and                   \
+   frees the old storage once they're all moved */                                      \
+static inline void name##_migrate(name##_t *t, size_t count) {                          \
+    size_t end = t->migrate_pos + count < t->old_capacity ? t->migrate_pos + count      \
+                                                           : t->old_capacity;           \
+    size_t i;                                                                           \
+    for (i = t->migrate_pos; i < end; i++) {                                            \
+        if (t->old_ctrl[i] & TYPED_HASH_FULL) {                                         \
+            uint64_t hash = hash_fn(t->old_slots[i].key, t->seed);                      \
+            size_t j = name##_find_free(t, hash);                                       \
+            t->ctrl[j] = name##_tag(hash);                                              \
+            t->slots[j] = t->old_slots[i];                                              \
+            t->old_ctrl[i] = TYPED_HASH_DELETED;                                        \
+            t->old_count--;                                                             \
+            t->used++;                                                                  \
+        }                                                                               \
+    }                                                                                   \
+    t->migrate_pos = end;                                                               \
+    if (end == t->old_capacity) {                                                       \
+        free(t->old_ctrl);                                                              \
+        free(t->old_slots);                                                             \
+        t->old_ctrl = NULL;                                                             \
+        t->old_slots = NULL;                                                            \
+        t->old_capacity = t->old_count = t->migrate_pos = 0;                            \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+/* starts moving the entries to new storage of the given capacity,                      \
+   dropping tombstones. the entries are moved by the following inserts */               \
+static inline int name##_rebuild(name##_t *t, size_t capacity) {                        \
+    uint8_t *ctrl = calloc(capacity, 1);                                                \
+    name##_slot_t *slots = malloc(capacity * sizeof(name##_slot_t));                    \
+    if (ctrl == NULL || slots == NULL) {                                                \
+        free(ctrl);                                                                     \
+        free(slots);                                                                    \
+        return 0;                                                                       \
+    }                                                                                   \
+    /* the previous move must be over, normally it's long done */                       \
+    name##_migrate(t, t->old_capacity);                                                 \
+    t->old_ctrl = t->ctrl;                                                              \
+    t->old_slots = t->slots;                                                            \
+    t->old_capacity = t->capacity;                                                      \
+    t->old_count = t->count;                                                            \
+    t->migrate_pos = 0;                                                                 \
+    t->ctrl = ctrl;                                                                     \
+    t->slots = slots;                                                                   \
+    t->capacity = capacity;                                                             \
+    t->used = 0;                                                                        \
+    t->rebuilds++;                                                                      \
+    if (t->old_count == 0) {                                                            \
+        name##_migrate(t, t->old_capacity);                                             \
+    }                                                                                   \
+    return 1;                                                                           \
+}                                                                                       \
+                                                                                        \
+static inline V *name##_get(const name##_t *t, K key) {                                 \
+    size_t slot;                                                                        \
+    int old;                                                                            \
+    if (t->count == 0) {                                                                \
+        return NULL;                                                                    \
+    }                                                                                   \
+    return name##_lookup(t, key, hash_fn(key, t->seed), &slot, &old);                   \
+}                                                                                       \
+                                                                                        \
+static inline V *name##_insert(name##_t *t, K key, int *inserted) {                     \
+    uint64_t hash = hash_fn(key, t->seed);                                              \
+    V *value;                                                                           \
+    size_t i;                                                                           \
+    int old;                                                                            \
+    if (t->old_capacity) {                                                              \
+        name##_migrate(t, TYPED_HASH_MIGRATE_STEP);                                     \
+    }                                                                                   \
+    if ((value = name##_lookup(t, key, hash, &i, &old)) != NULL) {                      \
+        *inserted = 0;                                                                  \
+        return value;                                                                   \
+    }                                                                                   \
+    i = name##_find_free(t, hash);                                                      \
+    if (t->ctrl[i] == TYPED_HASH_EMPTY) {                                               \
+        /* keep at least a quarter of the slots empty so probes stay short.             \
+           grow if the table is really filling up, otherwise just get rid of            \
+           the tombstones. the new storage is at most half full, so the                 \
+           move is over long before it fills up */                                      \
+        if ((t->used + 1) * 4 > t->capacity * 3) {                                      \
+            size_t capacity = (t->count + 1) * 2 > t->capacity ? t->capacity * 2        \
+                                                               : t->capacity;           \
+            if (!name##_rebuild(t, capacity)) {                                         \
+                return NULL;                                                            \
+            }                                                                           \
+            i = name##_find_free(t, hash);                                              \
+        }                                                                               \
+        t->used++;                                                                      \
+    }                                                                                   \
+    t->ctrl[i] = name##_tag(hash);                                                      \
+    t->slots[i].key = key;                                                              \
+    memset(&t->slots[i].value, 0, sizeof(V));                                           \
+    t->count++;                                                                         \
+    *inserted = 1;                                                                      \
+    return &t->slots[i].value;                                                          \
+}                                                                                       \
+                                                                                        \
+static inline int name##_remove(name##_t *t, K key, V *value) {                         \
+    size_t i;                                                                           \
+    int old;                                                                            \
+    V *found;                                                                           \
+    if (t->count == 0) {                                                                \
+        return 0;                                                                       \
+    }                                                                                   \
+    found = name##_lookup(t, key, hash_fn(key, t->seed), &i, &old);                     \
+    if (found == NULL) {                                                                \
+        return 0;                                                                       \
+    }                                                                                   \
+    if (value != NULL) {                                                                \
+        *value = *found;                                                                \
+    }                                                                                   \
+    if (old) {                                                                          \
+        /* nothing is added to the old storage, a tombstone will do */                  \
+        t->old_ctrl[i] = TYPED_HASH_DELETED;                                            \
+        t->old_count--;                                                                 \
+    } else if (t->ctrl[(i + 1) & (t->capacity - 1)] == TYPED_HASH_EMPTY) {              \
+        /* the slot can be emptied if the probe sequences don't continue past it */     \
+        t->ctrl[i] = TYPED_HASH_EMPTY;                                                  \
+        t->used--;                                                                      \
+    } else {                                                                            \
+        t->ctrl[i] = TYPED_HASH_DELETED;                                                \
+    }                                                                                   \
+    t->count--;                                                                         \
+    return 1;                                                                           \
+}                                                                                       \
+                                                                                        \
+/* positions below old_capacity are in the old storage */                               \
+static inline int name##_next(const name##_t *t, size_t *pos, K *key, V *value) {       \
+    size_t i;                                                                           \
+    for (i = *pos; i < t->old_capacity + t->capacity; i++) {                            \
+        int old = i < t->old_capacity;                                                  \
+        const uint8_t *ctrl = old ? &t->old_ctrl[i] : &t->ctrl[i - t->old_capacity];    \
+        const name##_slot_t *slot = old ? &t->old_slots[i]                              \
+                                        : &t->slots[i - t->old_capacity];               \
+        if (*ctrl & TYPED_HASH_FULL) {                                                  \
+            if (key != NULL) {                                                          \
+                *key = slot->key;                                                       \
+            }                                                                           \
+            if (value != NULL) {                                                        \
+                *value = slot->value;                                                   \
+            }                                                                           \
+            *pos = i + 1;                                                               \
+            return 1;                                                                   \
+        }                                                                               \
+    }                                                                                   \
+    *pos = i;                                                                           \
+    return 0;                                                                           \
+}                                                                                       \
+                                                                                        \
+/* adds the probe lengths of the entries in one storage to total_probes */              \
+static inline void name##_probe_stats(const name##_t *t, const uint8_t *ctrl,           \
+                                      const name##_slot_t *slots, size_t capacity,      \
+                                      typed_hash_stats_t *stats, size_t *total_probes) {\
+    size_t i;                                                                           \
+    for (i = 0; i < capacity; i++) {                                                    \
+        if (ctrl[i] & TYPED_HASH_FULL) {                                                \
+            uint64_t hash = hash_fn(slots[i].key, t->seed);                             \
+            size_t probe = ((i - hash) & (capacity - 1)) + 1;                           \
+            *total_probes += probe;                                                     \
+            if (probe > stats->max_probe) {                                             \
+                stats->max_probe = probe;                                               \
+            }                                                                           \
+        }                                                                               \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+static inline void name##_get_stats(const name##_t *t, typed_hash_stats_t *stats) {     \
+    size_t total_probes = 0;                                                            \
+    memset(stats, 0, sizeof(typed_hash_stats_t));                                       \
+    stats->count = t->count;                                                            \
+    stats->capacity = t->capacity;                                                      \
+    stats->old_capacity = t->old_capacity;                                              \
+    stats->tombstones = t->used - (t->count - t->old_count);                            \
+    stats->rebuilds = t->rebuilds;                                                      \
+    stats->memory = name##_memory(t);                                                   \
+    name##_probe_stats(t, t->ctrl, t->slots, t->capacity, stats, &total_probes);        \
+    name##_probe_stats(t, t->old_ctrl, t->old_slots, t->old_capacity, stats,            \
+                       &total_probes);                                                  \
+    if (t->count) {                                                                     \
+        stats->avg_probe = (double)total_probes / (double)t->count;                     \
+    }                                                                                   \
+}
+
+#endif
@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "admin.h"
+#include "packets.h"
+#include "metrics.h"
+#include "flood.h"
+#include "logging.h"
+#include "tcpstats.h"
+
+#define ADMIN_MAX_CONNS 8
+#define ADMIN_REQUEST_SIZE 2048
+#define ADMIN_TIMEOUT 5 // seconds a connection may stay open
+
+typedef struct {
+    conn_t conn;
+    time_t opened;
+    char request[ADMIN_REQUEST_SIZE];
+    size_t request_len;
+    // the response, built at once and written as the socket takes it
+    char *response;
+    size_t response_len;
+    size_t response_sent;
+} admin_conn_t;
+
+// a growing buffer for building responses
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int failed;
+} admin_buf_t;
+
+static char *admin_listen_spec = NULL;
+static conn_t admin_listener = { -1, ADMIN };
+static admin_conn_t *admin_conns[ADMIN_MAX_CONNS];
+static int admin_epollfd = -1;
+
+static const char *flood_class_names[] = {
+    [FLOOD_ALL] = "all",
+    [FLOOD_MSG] = "msg",
+    [FLOOD_JOIN] = "join",
+    [FLOOD_NAMES] = "names",
+};
+
+void admin_set_listen(const char *listen) {
+    free(admin_listen_spec);
+    admin_listen_spec = strdup(listen);
+}
+
+static int admin_open_socket() {
+    int fd;
+    if (admin_listen_spec[0] == '/') {
+        struct sockaddr_un addr;
+        if (strlen(admin_listen_spec) >= sizeof(addr.sun_path)) {
+            log_error("Admin socket path %s is too long!\n", admin_listen_spec);
+            return -1;
+        }
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            log_error("Failed to create admin socket! Error: %s\n", strerror(errno));
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, admin_listen_spec);
+        // a socket left behind by an earlier run
+        unlink(admin_listen_spec);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            log_error("Failed to bind admin socket %s! Error: %s\n", admin_listen_spec, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in addr;
+        char *endptr;
+        long port = strtol(admin_listen_spec, &endptr, 10);
+        if (endptr == admin_listen_spec || *endptr != '\0' || port <= 0 || port > 65535) {
+            log_error("Invalid admin port %s!\n", admin_listen_spec);
+            return -1;
+        }
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            log_error("Failed to create admin socket! Error: %s\n", strerror(errno));
+            return -1;
+        }
+        int yes = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+            log_error("Failed to set SO_REUSEADDR! Error: %s\n", strerror(errno));
+        }
+        // only reachable from the same host
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            log_error("Failed to bind admin port %ld! Error: %s\n", port, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, NETWORK_LISTEN_Q) < 0 || make_nonblock(fd) < 0) {
+        log_error("Failed to listen to admin socket! Error: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int admin_start(int epollfd) {
+    if (admin_listen_spec == NULL) {
+        return 1;
+    }
+    admin_epollfd = epollfd;
+    admin_listener.fd = admin_open_socket();
+    if (admin_listener.fd < 0) {
+        return -1;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &admin_listener;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, admin_listener.fd, &ev) == -1) {
+        log_error("Failed to call epoll_ctl for the admin socket! Error: %s\n", strerror(errno));
+        return -1;
+    }
+    log_info("Admin endpoint listening on %s\n", admin_listen_spec);
+    return 1;
+}
+
+static void admin_close(admin_conn_t *admin) {
+    for (int i = 0; i < ADMIN_MAX_CONNS; i++) {
+        if (admin_conns[i] == admin) {
+            admin_conns[i] = NULL;
+        }
+    }
+    // closing the fd removes it from the epoll set
+    close(admin->conn.fd);
+    free(admin->response);
+    free(admin);
+}
+
+static void admin_accept() {
+    for (;;) {
+        int fd = accept(admin_listener.fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_warn("Failed to accept an admin connection! Error: %s\n", strerror(errno));
+            }
+            return;
+        }
+        int slot;
+        for (slot = 0; slot < ADMIN_MAX_CONNS && admin_conns[slot]; slot++);
+        admin_conn_t *admin = slot < ADMIN_MAX_CONNS ? calloc(1, sizeof(admin_conn_t)) : NULL;
+        if (admin == NULL || make_nonblock(fd) < 0) {
+            // too many scrapers at once, they can retry
+            free(admin);
+            close(fd);
+            continue;
+        }
+        admin->conn.fd = fd;
+        admin->conn.type = ADMIN;
+        admin->opened = time(NULL);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(struct epoll_event));
+        ev.events = EPOLLIN;
+        ev.data.ptr = admin;
+        if (epoll_ctl(admin_epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            log_warn("Failed to call epoll_ctl for an admin connection! Error: %s\n", strerror(errno));
+            close(fd);
+            free(admin);
+            continue;
+        }
+        admin_conns[slot] = admin;
+    }
+}
+
+static void buf_printf(admin_buf_t *buf, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void buf_printf(admin_buf_t *buf, const char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        size_t room = buf->capacity - buf->len;
+        int n = vsnprintf(buf->data ? buf->data + buf->len : NULL, room, format, args);
+        va_end(args);
+        if (n < 0 || buf->failed) {
+            buf->failed = 1;
+            return;
+        }
+        if ((size_t)n < room) {
+            buf->len += n;
+            return;
+        }
+        size_t capacity = buf->capacity ? buf->capacity * 2 : 4096;
+        while (capacity - buf->len <= (size_t)n) {
+            capacity *= 2;
+        }
+        char *data = realloc(buf->data, capacity);
+        if (data == NULL) {
+            buf->failed = 1;
+            return;
+        }
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+}
+
+// writes a quoted JSON string, nicknames may contain anything but spaces
+static void buf_json_string(admin_buf_t *buf, const char *str) {
+    buf_printf(buf, "\"");
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            buf_printf(buf, "\\%c", *p);
+        } else if (*p < 0x20 || *p >= 0x7f) {
+            buf_printf(buf, "\\u%04x", *p);
+        } else {
+            buf_printf(buf, "%c", *p);
+        }
+    }
+    buf_printf(buf, "\"");
+}
+
+// labels is empty or e.g. "command=\"MSG\","
+static void write_prometheus_histogram(admin_buf_t *buf, const char *name, const char *labels,
+                                       const metrics_histogram_t *histogram) {
+    // the 8 buckets of each power of two are merged, le is inclusive
+    uint64_t cumulative = 0;
+    for (int bucket = 0; bucket < METRICS_BUCKETS && cumulative < histogram->count; ) {
+        int end = bucket < METRICS_SUB_BUCKETS ? METRICS_SUB_BUCKETS : bucket + METRICS_SUB_BUCKETS;
+        for (; bucket < end; bucket++) {
+            cumulative += histogram->buckets[bucket];
+        }
+        buf_printf(buf, "chat_%s_bucket{%sle=\"%llu\"} %llu\n", name, labels,
+                   (unsigned long long)(metrics_bucket_lower_bound(end) - 1), (unsigned long long)cumulative);
+    }
+    buf_printf(buf, "chat_%s_bucket{%sle=\"+Inf\"} %llu\n", name, labels, (unsigned long long)histogram->count);
+    // the same labels without the trailing comma
+    int labels_len = strlen(labels);
+    const char *open = labels_len ? "{" : "", *close = labels_len ? "}" : "";
+    labels_len = labels_len ? labels_len - 1 : 0;
+    buf_printf(buf, "chat_%s_sum%s%.*s%s %llu\n", name, open, labels_len, labels, close,
+               (unsigned long long)histogram->sum);
+    buf_printf(buf, "chat_%s_count%s%.*s%s %llu\n", name, open, labels_len, labels, close,
+               (unsigned long long)histogram->count);
+}
+
+static void write_prometheus(admin_buf_t *buf) {
+    metrics_snapshot_t *metrics = malloc(sizeof(metrics_snapshot_t));
+    if (metrics == NULL) {
+        buf->failed = 1;
+        return;
+    }
+    metrics_snapshot(metrics);
+
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        const char *name = metrics_counter_name(i);
+        metrics_command command = metrics_counter_command(i);
+        if (command == METRICS_COMMANDS) {
+            buf_printf(buf, "# TYPE chat_%s_total counter\nchat_%s_total %llu\n", name, name,
+                       (unsigned long long)metrics->counters[i]);
+            continue;
+        }
+        if (command == 0) {
+            buf_printf(buf, "# TYPE chat_%s_total counter\n", name);
+        }
+        buf_printf(buf, "chat_%s_total{command=\"%s\"} %llu\n", name, metrics_command_name(command),
+                   (unsigned long long)metrics->counters[i]);
+    }
+    buf_printf(buf, "# TYPE chat_flood_dropped_total counter\n");
+    for (int i = 0; i < FLOOD_CLASSES; i++) {
+        buf_printf(buf, "chat_flood_dropped_total{class=\"%s\"} %llu\n", flood_class_names[i],
+                   (unsigned long long)flood_dropped(i));
+    }
+    for (int i = 0; i < METRIC_GAUGES; i++) {
+        const char *name = metrics_gauge_name(i);
+        buf_printf(buf, "# TYPE chat_%s gauge\nchat_%s %lld\n", name, name, (long long)metrics->gauges[i]);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+        const char *name = metrics_histogram_name(i);
+        metrics_command command = metrics_histogram_command(i);
+        char labels[64] = "";
+        if (command == METRICS_COMMANDS || command == 0) {
+            buf_printf(buf, "# TYPE chat_%s histogram\n", name);
+        }
+        if (command != METRICS_COMMANDS) {
+            snprintf(labels, sizeof(labels), "command=\"%s\",", metrics_command_name(command));
+        }
+        write_prometheus_histogram(buf, name, labels, &metrics->histograms[i]);
+    }
+    free(metrics);
+}
+
+typedef struct {
+    admin_buf_t *buf;
+    int first;
+} server_walk_t;
+
+static void write_server_link(conn_t *conn, void *arg) {
+    server_walk_t *walk = arg;
+    int queued = 0;
+    // bytes in the kernel send queue not yet acknowledged by the peer
+    if (ioctl(conn->fd, SIOCOUTQ, &queued) < 0) {
+        queued = 0;
+    }
+    buf_printf(walk->buf, "%s{\"fd\":%d,\"send_queue\":%d}", walk->first ? "" : ",", conn->fd, queued);
+    walk->first = 0;
+}
+
+static void write_state(admin_buf_t *buf) {
+    packets_state_t state;
+    packets_get_state(&state);
+    metrics_snapshot_t *metrics = malloc(sizeof(metrics_snapshot_t));
+    if (metrics == NULL) {
+        buf->failed = 1;
+        return;
+    }
+    metrics_snapshot(metrics);
+
+    buf_printf(buf, "{\"nicknames\":%zu,\"local_nicknames\":%zu,\"channels\":%zu,\"servers\":%zu,"
+               "\"connections\":{\"clients\":%lld,\"servers\":%lld},",
+               state.nicknames, state.local_nicknames, state.channels, state.servers,
+               (long long)metrics->gauges[METRIC_CLIENTS], (long long)metrics->gauges[METRIC_SERVERS]);
+
+    // the servers are few and asked directly, the clients would be one
+    // system call each, so they come from the last TCP sampling round
+    server_walk_t walk = { buf, 1 };
+    buf_printf(buf, "\"server_links\":[");
+    packets_foreach_server(write_server_link, &walk);
+    const tcpstats_queues_t *queues = tcpstats_client_queues();
+    buf_printf(buf, "],\"client_links\":{\"count\":%zu,\"send_queue_total\":%zu,\"send_queue_max\":%zu},",
+               queues->clients, queues->send_queue_total, queues->send_queue_max);
+
+    const tcpstats_link_t *worst;
+    int worst_count = tcpstats_worst(&worst);
+    buf_printf(buf, "\"slow_consumers\":[");
+    for (int i = 0; i < worst_count; i++) {
+        const tcp_sample_t *sample = &worst[i].sample;
+        buf_printf(buf, "%s{\"fd\":%d,\"type\":\"%s\",\"nickname\":", i ? "," : "", worst[i].fd,
+                   worst[i].type == CLIENT ? "client" : "server");
+        buf_json_string(buf, worst[i].nickname);
+        buf_printf(buf, ",\"send_queue\":%u,\"send_queue_avg\":%u,\"send_queue_max\":%u,\"rtt_us\":%u,"
+                   "\"cwnd\":%u,\"unacked\":%u,\"retransmits\":%u}",
+                   sample->send_queue, sample->send_queue_avg, sample->send_queue_max, sample->rtt_us,
+                   sample->cwnd, sample->unacked, sample->retransmits);
+    }
+    buf_printf(buf, "],");
+
+    size_t client_memory = metrics->gauges[METRIC_CLIENTS] * sizeof(client_t);
+    buf_printf(buf, "\"memory\":{\"nick_table\":%zu,\"nicknames\":%zu,\"channel_table\":%zu,\"channels\":%zu,"
+               "\"symbols\":%zu,\"clients\":%zu,\"servers\":%zu,\"log_queue\":%zu,\"metrics\":%zu}}\n",
+               state.nick_table_memory, state.nickname_memory, state.channel_table_memory,
+               state.channel_memory, state.symbol_memory, client_memory, state.server_memory,
+               log_memory(), metrics_memory());
+    free(metrics);
+}
+
+// builds the response for a complete request, returns 0 if it failed
+static int admin_respond(admin_conn_t *admin) {
+    admin_buf_t body = { NULL, 0, 0, 0 };
+    const char *status = "200 OK";
+    const char *content_type = "text/plain; version=0.0.4";
+    if (strncmp(admin->request, "GET /metrics ", strlen("GET /metrics ")) == 0) {
+        write_prometheus(&body);
+    } else if (strncmp(admin->request, "GET /state ", strlen("GET /state ")) == 0) {
+        content_type = "application/json";
+        write_state(&body);
+    } else {
+        status = "404 Not Found";
+        buf_printf(&body, "Try /metrics or /state\n");
+    }
+    if (body.failed) {
+        free(body.data);
+        body.data = NULL;
+        body.len = 0;
+        status = "500 Internal Server Error";
+    }
+
+    admin_buf_t response = { NULL, 0, 0, 0 };
+    buf_printf(&response, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+               status, content_type, body.len);
+    if (body.len) {
+        buf_printf(&response, "%.*s", (int)body.len, body.data);
+    }
+    free(body.data);
+    if (response.failed) {
+        free(response.data);
+        return 0;
+    }
+    admin->response = response.data;
+    admin->response_len = response.len;
+    admin->response_sent = 0;
+    return 1;
+}
+
+// writes as much of the response as the socket takes, closing the
+// connection when it's all sent. waits for EPOLLOUT for the rest
+static void admin_write(admin_conn_t *admin) {
+    while (admin->response_sent < admin->response_len) {
+        ssize_t n = send(admin->conn.fd, admin->response + admin->response_sent,
+                         admin->response_len - admin->response_sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(struct epoll_event));
+            ev.events = EPOLLOUT;
+            ev.data.ptr = admin;
+            if (epoll_ctl(admin_epollfd, EPOLL_CTL_MOD, admin->conn.fd, &ev) == -1) {
+                admin_close(admin);
+            }
+            return;
+        } else if (n <= 0) {
+            admin_close(admin);
+            return;
+        }
+        admin->response_sent += n;
+    }
+    admin_close(admin);
+}
+
+static void admin_read(admin_conn_t *admin) {
+    ssize_t n = read(admin->conn.fd, admin->request + admin->request_len,
+                     ADMIN_REQUEST_SIZE - 1 - admin->request_len);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    } else if (n <= 0) {
+        admin_close(admin);
+        return;
+    }
+    admin->request_len += n;
+    admin->request[admin->request_len] = '\0';
+    // answer once the headers have ended, or when there's no room for more
+    if (strstr(admin->request, "\r\n\r\n") || strstr(admin->request, "\n\n") ||
+        admin->request_len == ADMIN_REQUEST_SIZE - 1) {
+        if (admin_respond(admin)) {
+            admin_write(admin);
+        } else {
+            admin_close(admin);
+        }
+    }
+}
+
+void admin_handle_event(conn_t *conn, uint32_t events) {
+    if (conn == &admin_listener) {
+        admin_accept();
+        return;
+    }
+    admin_conn_t *admin = (admin_conn_t*)conn;
+    if (admin->response != NULL) {
+        if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            admin_write(admin);
+        }
+    } else if (events & EPOLLIN) {
+        admin_read(admin);
+    } else {
+        admin_close(admin);
+    }
+}
+
+void admin_timer() {
+    time_t now = time(NULL);
+    for (int i = 0; i < ADMIN_MAX_CONNS; i++) {
+        if (admin_conns[i] && now - admin_conns[i]->opened > ADMIN_TIMEOUT) {
+            admin_close(admin_conns[i]);
+        }
+    }
+}
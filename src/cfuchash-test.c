@@ -0,0 +1,153 @@
+// stress test of cfuchash: writers put, replace and delete keys of their own
+// while readers look up all the keys and check what they find. the values
+// are allocated and retired, so a value freed too early shows up as a
+// reader seeing a wrong value (or as an error under a sanitizer)
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "cfuchash.h"
+
+#define WRITERS 4
+#define READERS 4
+#define KEYS 5000 // per writer
+#define WRITES 200000 // per writer
+#define VALUE_MAGIC 0x5eed5eedu
+
+typedef struct {
+    uint32_t magic;
+    int writer;
+    int key;
+} value_t;
+
+static cfuchash_table_t *table;
+// set and read with atomics, the threads look at them all the time
+static int writers_done = 0;
+static int failed = 0;
+
+static void fail(const char *what) {
+    fprintf(stderr, "cfuchash-test: %s\n", what);
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void free_value(void *data) {
+    value_t *value = data;
+    // poison it, so a reader still looking at it notices
+    value->magic = 0;
+    free(value);
+}
+
+static void make_key(char *key, size_t size, int writer, int i, int upper) {
+    snprintf(key, size, upper ? "WRITER%d-KEY%d" : "writer%d-key%d", writer, i);
+}
+
+static void *writer(void *arg) {
+    int id = (int)(intptr_t)arg;
+    unsigned int seed = id + 1;
+    char key[32];
+    for (int n = 0; n < WRITES && !__atomic_load_n(&failed, __ATOMIC_RELAXED); n++) {
+        int i = rand_r(&seed) % KEYS;
+        make_key(key, sizeof(key), id, i, rand_r(&seed) & 1);
+        void *old = NULL;
+        if (rand_r(&seed) % 3) {
+            value_t *value = malloc(sizeof(value_t));
+            if (value == NULL) {
+                fail("out of memory");
+                break;
+            }
+            value->magic = VALUE_MAGIC;
+            value->writer = id;
+            value->key = i;
+            int added = cfuchash_put_data(table, key, -1, value, &old);
+            if (added < 0) {
+                fail("put ran out of memory");
+                free(value);
+                break;
+            }
+            if (!added && old == NULL) {
+                fail("replaced entry had no value");
+            }
+        } else {
+            old = cfuchash_delete(table, key);
+        }
+        if (old != NULL && !cfuchash_retire(table, old, free_value)) {
+            fail("retire ran out of memory");
+        }
+    }
+    return NULL;
+}
+
+static void *reader(void *arg) {
+    unsigned int seed = (unsigned int)(intptr_t)arg;
+    char key[32];
+    while (!__atomic_load_n(&writers_done, __ATOMIC_RELAXED) && !__atomic_load_n(&failed, __ATOMIC_RELAXED)) {
+        int id = rand_r(&seed) % WRITERS;
+        int i = rand_r(&seed) % KEYS;
+        make_key(key, sizeof(key), id, i, rand_r(&seed) & 1);
+        // the value must stay valid for the whole read section
+        cfuchash_read_lock();
+        void *data;
+        if (cfuchash_get_data(table, key, -1, &data)) {
+            value_t *value = data;
+            if (value->magic != VALUE_MAGIC || value->writer != id || value->key != i) {
+                fail("reader found a wrong or freed value");
+            }
+        }
+        cfuchash_read_unlock();
+    }
+    return NULL;
+}
+
+static int count_entry(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+    (void)key;
+    (void)key_size;
+    (void)data_size;
+    (void)arg;
+    value_t *value = data;
+    if (value->magic != VALUE_MAGIC) {
+        fail("foreach found a freed value");
+    }
+    return 0;
+}
+
+static int free_entry(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
+    (void)key;
+    (void)key_size;
+    (void)data_size;
+    (void)arg;
+    free(data);
+    return 0;
+}
+
+int main() {
+    table = cfuchash_new(CFUHASH_IGNORE_CASE);
+    if (table == NULL) {
+        fail("couldn't create the table");
+        return 1;
+    }
+
+    pthread_t writers[WRITERS], readers[READERS];
+    for (int i = 0; i < READERS; i++) {
+        pthread_create(&readers[i], NULL, reader, (void*)(intptr_t)(i + 100));
+    }
+    for (int i = 0; i < WRITERS; i++) {
+        pthread_create(&writers[i], NULL, writer, (void*)(intptr_t)i);
+    }
+    for (int i = 0; i < WRITERS; i++) {
+        pthread_join(writers[i], NULL);
+    }
+    __atomic_store_n(&writers_done, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    size_t visited = cfuchash_foreach(table, count_entry, NULL);
+    if (visited != cfuchash_num_entries(table)) {
+        fail("foreach and the entry count disagree");
+    }
+    printf("cfuchash-test: %zu entries left, %s\n", visited, failed ? "FAILED" : "ok");
+
+    cfuchash_foreach(table, free_entry, NULL);
+    cfuchash_destroy(table);
+    return failed;
+}
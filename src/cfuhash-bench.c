@@ -0,0 +1,123 @@
+// benchmarks of cfuhash, run by make bench:
+// - the key hash, the seeded one against the old Perl hash
+// - chained against open addressing tables, at a few sizes
+// the numbers only mean something when built with optimization (CFLAGS+=-O3)
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+#include "cfuhash.h"
+
+#define HASH_ROUNDS 20000000
+#define LOOKUP_ROUNDS 3
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// the hash cfuhash used before it was seeded, folding case as it did
+static unsigned int perl_hash(const void *key, size_t length) {
+    const unsigned char *s = key;
+    unsigned int hv = 0;
+    while (length--) {
+        hv += tolower(*s++);
+        hv += (hv << 10);
+        hv ^= (hv >> 6);
+    }
+    hv += (hv << 3);
+    hv ^= (hv >> 11);
+    hv += (hv << 15);
+    return hv;
+}
+
+static void bench_hash() {
+    char key[64];
+    memset(key, 'A', sizeof(key));
+    size_t lengths[] = {6, 10, 32};
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        volatile unsigned int sink = 0;
+        double start = now();
+        for (int i = 0; i < HASH_ROUNDS; i++) {
+            key[0] = i;
+            sink += perl_hash(key, lengths[l]);
+        }
+        double perl = now() - start;
+        start = now();
+        for (int i = 0; i < HASH_ROUNDS; i++) {
+            key[0] = i;
+            sink += cfuhash_hash_key(key, lengths[l], 1);
+        }
+        double seeded = now() - start;
+        printf("hash, %2zu bytes: perl %5.1f ns, seeded %5.1f ns\n", lengths[l],
+               perl / HASH_ROUNDS * 1e9, seeded / HASH_ROUNDS * 1e9);
+    }
+}
+
+static void bench_table(size_t n, unsigned int flags, const char *name) {
+    char (*keys)[16] = malloc(n * sizeof(*keys));
+    size_t *lengths = malloc(n * sizeof(size_t));
+    if (keys == NULL || lengths == NULL) {
+        fprintf(stderr, "cfuhash-bench: out of memory\n");
+        exit(1);
+    }
+    // nickname like keys, inserted in no particular order
+    for (size_t i = 0; i < n; i++) {
+        lengths[i] = snprintf(keys[i], sizeof(keys[i]), "nick%zu", (size_t)(i * 2654435761u % 100000000));
+    }
+    cfuhash_table_t *table = cfuhash_new_with_flags(flags);
+
+    double start = now();
+    for (size_t i = 0; i < n; i++) {
+        cfuhash_put_data(table, keys[i], lengths[i], (void*)(intptr_t)i, 0, NULL);
+    }
+    double insert = now() - start;
+
+    size_t found = 0;
+    start = now();
+    for (int r = 0; r < LOOKUP_ROUNDS; r++) {
+        for (size_t i = 0; i < n; i++) {
+            size_t j = i * 7919 % n;
+            found += cfuhash_exists_data(table, keys[j], lengths[j]);
+        }
+    }
+    double hit = now() - start;
+
+    size_t missed = 0;
+    char key[16];
+    start = now();
+    for (size_t i = 0; i < n; i++) {
+        size_t length = snprintf(key, sizeof(key), "miss%zu", i);
+        missed += !cfuhash_exists_data(table, key, length);
+    }
+    double miss = now() - start;
+
+    start = now();
+    for (size_t i = 0; i < n; i++) {
+        cfuhash_delete_data(table, keys[i], lengths[i]);
+    }
+    double delete = now() - start;
+
+    if (found != LOOKUP_ROUNDS * n || missed != n) {
+        fprintf(stderr, "cfuhash-bench: %s table lost entries\n", name);
+        exit(1);
+    }
+    printf("table, %-7s %7zu entries: insert %6.1f ns, hit %6.1f ns, miss %6.1f ns, delete %6.1f ns\n",
+           name, n, insert / n * 1e9, hit / (LOOKUP_ROUNDS * n) * 1e9, miss / n * 1e9, delete / n * 1e9);
+    cfuhash_destroy(table);
+    free(keys);
+    free(lengths);
+}
+
+int main() {
+    bench_hash();
+    size_t sizes[] = {10000, 100000, 1000000};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        bench_table(sizes[s], CFUHASH_IGNORE_CASE, "chained");
+        bench_table(sizes[s], CFUHASH_IGNORE_CASE | CFUHASH_OPEN_ADDRESSING, "open");
+    }
+    return 0;
+}
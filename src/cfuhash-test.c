@@ -0,0 +1,181 @@
+// regression tests of the hash tables the server keeps its state in:
+// - nicknames chosen to collide under the old zero seed Perl hash must not
+//   pile up in the seeded tables
+// - during an incremental rehash, iterating and the stats must see every
+//   entry once, without finishing the rehash
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cfuhash.h"
+#include "network.h"
+
+#define COLLIDING_KEYS 4000
+#define COLLIDING_MASK 0x3fff
+#define COLLIDING_BITS 0x1234
+#define COLLIDING_MAX_PROBE 16
+#define REHASH_KEYS 10000
+#define REHASH_CHECK_EVERY 37 // puts, a full walk each time is slow
+
+TYPED_HASH_DEFINE(nick_table, nick_key_t, int, nick_key_hash, nick_key_equal)
+
+static int failed = 0;
+
+static void check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "cfuhash-test: %s\n", what);
+        failed = 1;
+    }
+}
+
+// the Perl hash cfuhash used before it was seeded, split in steps so the
+// keys can be searched for a character at a time
+static unsigned int perl_step(unsigned int hv, unsigned char c) {
+    hv += c;
+    hv += (hv << 10);
+    hv ^= (hv >> 6);
+    return hv;
+}
+
+static unsigned int perl_finish(unsigned int hv) {
+    hv += (hv << 3);
+    hv ^= (hv >> 11);
+    hv += (hv << 15);
+    return hv;
+}
+
+static unsigned int perl_hash(const void *key, size_t length) {
+    const unsigned char *s = key;
+    unsigned int hv = 0;
+    while (length--) {
+        hv = perl_step(hv, *s++);
+    }
+    return perl_finish(hv);
+}
+
+static char colliding_keys[COLLIDING_KEYS][NICKNAME_LENGTH];
+static int colliding_found = 0;
+
+// appends characters to key from pos on, keeping the ones whose Perl hash
+// ends in COLLIDING_BITS
+static void find_colliding_keys(char *key, int pos, unsigned int hv) {
+    static const char chars[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    for (const char *c = chars; *c && colliding_found < COLLIDING_KEYS; c++) {
+        key[pos] = *c;
+        unsigned int next = perl_step(hv, *c);
+        if (pos < NICKNAME_LENGTH - 3) {
+            find_colliding_keys(key, pos + 1, next);
+        } else if ((perl_finish(next) & COLLIDING_MASK) == COLLIDING_BITS) {
+            memcpy(colliding_keys[colliding_found++], key, pos + 1);
+        }
+    }
+}
+
+// nicknames whose Perl hashes agree in the low 14 bits, so they all land
+// in the same bucket of any table up to 16384 buckets
+static void make_colliding_keys() {
+    char key[NICKNAME_LENGTH] = "n";
+    find_colliding_keys(key, 1, perl_step(0, 'n'));
+}
+
+static void fill(cfuhash_table_t *table) {
+    for (int i = 0; i < COLLIDING_KEYS; i++) {
+        cfuhash_put_data(table, colliding_keys[i], strlen(colliding_keys[i]), NULL, 0, NULL);
+    }
+}
+
+static void test_collisions(unsigned int flags, const char *name) {
+    char what[128];
+
+    // the keys really do collide under the old hash. open addressing probes
+    // whole groups of slots and doesn't use the low bits for the group, so
+    // it suffers less
+    cfuhash_table_t *table = cfuhash_new_with_flags(flags);
+    cfuhash_set_hash_function(table, perl_hash);
+    fill(table);
+    cfuhash_stats_t stats;
+    cfuhash_get_stats(table, &stats);
+    snprintf(what, sizeof(what), "%s: the keys don't collide under the Perl hash (max probe %zu)",
+             name, stats.max_probe);
+    check(stats.max_probe >= 2 * COLLIDING_MAX_PROBE, what);
+    cfuhash_destroy(table);
+
+    table = cfuhash_new_with_flags(flags);
+    fill(table);
+    cfuhash_get_stats(table, &stats);
+    snprintf(what, sizeof(what), "%s: colliding keys pile up (max probe %zu, avg %.2f)",
+             name, stats.max_probe, stats.avg_probe);
+    check(stats.entries == COLLIDING_KEYS && stats.max_probe <= COLLIDING_MAX_PROBE && stats.avg_probe < 2, what);
+    printf("cfuhash-test: %s: %zu colliding keys, max probe %zu avg %.2f\n",
+           name, stats.entries, stats.max_probe, stats.avg_probe);
+    cfuhash_destroy(table);
+}
+
+static void test_nick_table_collisions() {
+    nick_table_t table;
+    check(nick_table_init(&table, 0), "nick table: init failed");
+    for (int i = 0; i < COLLIDING_KEYS; i++) {
+        int inserted;
+        nick_table_insert(&table, nick_key(colliding_keys[i], strlen(colliding_keys[i])), &inserted);
+    }
+    typed_hash_stats_t stats;
+    nick_table_get_stats(&table, &stats);
+    char what[128];
+    snprintf(what, sizeof(what), "nick table: colliding keys pile up (max probe %zu, avg %.2f)",
+             stats.max_probe, stats.avg_probe);
+    // linear probing, so the probes are slots and the runs are longer
+    check(stats.count == COLLIDING_KEYS && stats.max_probe <= 128 && stats.avg_probe < 4, what);
+    printf("cfuhash-test: nick table: %zu colliding keys, max probe %zu avg %.2f\n",
+           stats.count, stats.max_probe, stats.avg_probe);
+    nick_table_destroy(&table);
+}
+
+static void test_incremental_rehash(unsigned int flags, const char *name) {
+    cfuhash_table_t *table = cfuhash_new_with_flags(flags | CFUHASH_INCREMENTAL_REHASH);
+    char *seen = calloc(REHASH_KEYS, 1);
+    int migrations = 0;
+    char what[128];
+    for (int i = 0; i < REHASH_KEYS; i++) {
+        char key[32];
+        size_t len = snprintf(key, sizeof(key), "key%d", i);
+        cfuhash_put_data(table, key, len, (void*)(intptr_t)(i + 1), 0, NULL);
+
+        cfuhash_stats_t stats;
+        cfuhash_get_stats(table, &stats);
+        if (!stats.old_buckets || migrations++ % REHASH_CHECK_EVERY) {
+            continue;
+        }
+        // look at the table in the middle of the rehash
+        check(stats.entries == (size_t)i + 1, "stats miss entries during a rehash");
+        memset(seen, 0, REHASH_KEYS);
+        size_t count = 0;
+        cfuhash_iter_t iter;
+        void *data;
+        cfuhash_iter_init(&iter, table);
+        while (cfuhash_iter_next(&iter, NULL, NULL, &data, NULL)) {
+            intptr_t value = (intptr_t)data - 1;
+            snprintf(what, sizeof(what), "%s: entry %ld seen twice during a rehash", name, (long)value);
+            check(!seen[value], what);
+            seen[value] = 1;
+            count++;
+        }
+        snprintf(what, sizeof(what), "%s: %zu of %d entries seen during a rehash", name, count, i + 1);
+        check(count == (size_t)i + 1, what);
+        cfuhash_get_stats(table, &stats);
+        check(stats.old_buckets != 0, "reading the stats or iterating finished the rehash");
+    }
+    snprintf(what, sizeof(what), "%s: no incremental rehash happened", name);
+    check(migrations > 0, what);
+    free(seen);
+    cfuhash_destroy(table);
+}
+
+int main() {
+    make_colliding_keys();
+    test_collisions(CFUHASH_IGNORE_CASE, "chained");
+    test_collisions(CFUHASH_IGNORE_CASE | CFUHASH_OPEN_ADDRESSING, "open addressing");
+    test_nick_table_collisions();
+    test_incremental_rehash(0, "chained");
+    test_incremental_rehash(CFUHASH_OPEN_ADDRESSING, "open addressing");
+    printf("cfuhash-test: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
@@ -12,6 +12,7 @@
 #include <time.h>
 #include "cfuhash.h"
 #include "client.h"
+#include "timecache.h"
 
 
 #define COLOR_RED     "\033[22;31m"
@@ -124,11 +125,10 @@ int my_channels(char *channel_string) {
 }
 
 void get_current_time(char *timestamp) {
-	time_t msg_time;
-	struct tm *tm_p;
-	msg_time = time(NULL);
-	tm_p = localtime(&msg_time);
-	sprintf(timestamp, "[%.2d:%.2d] ", tm_p->tm_hour, tm_p->tm_min);
+	// "[HH:MM] " from the cached "HH:MM:SS"
+	timestamp[0] = '[';
+	memcpy(timestamp + 1, timecache_hms(timecache_seconds()), 5);
+	memcpy(timestamp + 6, "] ", 3);
 }
 
 int quit = 1;
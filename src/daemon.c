@@ -15,6 +15,8 @@ void create_pid_file();
 void delete_pid_file();
 void sigterm_handler(int);
 
+volatile sig_atomic_t daemon_stop = 0;
+
 // daemon technique adapted from 
 // http://www.linuxprofilm.com/articles/linux-daemon-howto.html
 // and http://stackoverflow.com/a/17955149
@@ -89,6 +91,8 @@ void delete_pid_file() {
 void sigterm_handler(int signum) {
     signum = signum; // ignore unused parameter
     delete_pid_file();
+    // the only way the daemon is stopped, so the event loop must notice it
+    daemon_stop = 1;
 }
 
 void create_pid_file() {
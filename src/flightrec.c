@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "flightrec.h"
+
+flightrec_record_t flightrec_ring[FLIGHTREC_SIZE];
+uint64_t flightrec_next = 0;
+uint64_t flightrec_time = 0;
+
+static char dump_path[FLIGHTREC_PATH_LENGTH];
+
+static const char *event_names[] = {
+    [FLIGHTREC_ACCEPT] = "accept",
+    [FLIGHTREC_READ] = "read",
+    [FLIGHTREC_PACKET] = "packet",
+    [FLIGHTREC_SEND] = "send",
+    [FLIGHTREC_SEND_FAILED] = "send failed",
+    [FLIGHTREC_CLOSE] = "close",
+    [FLIGHTREC_STALL] = "stall",
+};
+
+const char *flightrec_event_name(flightrec_event event) {
+    return event < FLIGHTREC_EVENTS ? event_names[event] : "?";
+}
+
+// write() until all of it is written, the only way to write a file that is
+// safe in a signal handler
+static int write_all(int fd, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+int flightrec_dump(int signum) {
+    int saved_errno = errno;
+    // the event loop may be in the middle of adding an event, so at worst
+    // the newest record is half written
+    uint64_t next = flightrec_next;
+    flightrec_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FLIGHTREC_MAGIC, FLIGHTREC_MAGIC_LENGTH);
+    header.record_size = sizeof(flightrec_record_t);
+    header.records = next < FLIGHTREC_SIZE ? next : FLIGHTREC_SIZE;
+    header.total = next;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    header.time = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    header.signal = signum;
+
+    int ok = 0;
+    // no following a symlink someone left in place of the dump
+    int fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+    if (fd >= 0) {
+        // the oldest records are at the position the next one goes to
+        size_t start = next < FLIGHTREC_SIZE ? 0 : next & (FLIGHTREC_SIZE - 1);
+        ok = write_all(fd, &header, sizeof(header)) &&
+             write_all(fd, &flightrec_ring[start], (header.records - start) * sizeof(flightrec_record_t)) &&
+             write_all(fd, flightrec_ring, start * sizeof(flightrec_record_t));
+        close(fd);
+    }
+    errno = saved_errno;
+    return ok;
+}
+
+static void dump_handler(int signum) {
+    flightrec_dump(signum);
+}
+
+static void fatal_handler(int signum) {
+    flightrec_dump(signum);
+    // die of the signal as we would have without the handler, core dump included
+    signal(signum, SIG_DFL);
+    raise(signum);
+}
+
+int flightrec_install(const char *path) {
+    if (path[0] == '/') {
+        if (strlen(path) >= sizeof(dump_path)) {
+            return 0;
+        }
+        strcpy(dump_path, path);
+    } else {
+        char cwd[FLIGHTREC_PATH_LENGTH];
+        if (getcwd(cwd, sizeof(cwd)) == NULL ||
+            (size_t)snprintf(dump_path, sizeof(dump_path), "%s/%s", cwd, path) >= sizeof(dump_path)) {
+            return 0;
+        }
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = dump_handler;
+    action.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &action, NULL) < 0) {
+        return 0;
+    }
+
+    int fatal_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    action.sa_handler = fatal_handler;
+    action.sa_flags = 0;
+    for (size_t i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++) {
+        if (sigaction(fatal_signals[i], &action, NULL) < 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
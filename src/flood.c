@@ -0,0 +1,77 @@
+#include <time.h>
+#include "flood.h"
+
+typedef struct {
+    uint32_t rate;
+    uint32_t burst;
+} flood_limit_t;
+
+// defaults allow normal chatting but cut off scripted floods
+flood_limit_t flood_limits[FLOOD_CLASSES] = {
+    [FLOOD_ALL] = { 20, 40 },
+    [FLOOD_MSG] = { 10, 20 },
+    [FLOOD_JOIN] = { 2, 10 },
+    [FLOOD_NAMES] = { 2, 5 },
+};
+
+uint64_t flood_dropped_counts[FLOOD_CLASSES];
+
+static int64_t flood_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void flood_set_limit(flood_class class, uint32_t rate, uint32_t burst) {
+    flood_limits[class].rate = rate;
+    flood_limits[class].burst = burst;
+}
+
+void flood_init(flood_bucket_t *bucket) {
+    for (int i = 0; i < FLOOD_CLASSES; i++) {
+        bucket->tokens[i] = (int64_t)flood_limits[i].burst * 1000;
+    }
+    bucket->refilled_ms = flood_now_ms();
+    bucket->dropped = 0;
+    bucket->throttled = 0;
+}
+
+static void flood_refill(flood_bucket_t *bucket) {
+    int64_t now = flood_now_ms();
+    int64_t elapsed = now - bucket->refilled_ms;
+    if (elapsed <= 0) {
+        return;
+    }
+    bucket->refilled_ms = now;
+    for (int i = 0; i < FLOOD_CLASSES; i++) {
+        // rate tokens per second is rate thousandths of a token per millisecond
+        int64_t max = (int64_t)flood_limits[i].burst * 1000;
+        bucket->tokens[i] += elapsed * flood_limits[i].rate;
+        if (bucket->tokens[i] > max) {
+            bucket->tokens[i] = max;
+        }
+    }
+}
+
+int flood_allow(flood_bucket_t *bucket, flood_class class) {
+    flood_refill(bucket);
+    int limit_all = flood_limits[FLOOD_ALL].rate != 0;
+    int limit_class = class != FLOOD_ALL && flood_limits[class].rate != 0;
+    if ((limit_all && bucket->tokens[FLOOD_ALL] < 1000) ||
+        (limit_class && bucket->tokens[class] < 1000)) {
+        bucket->dropped++;
+        flood_dropped_counts[class]++;
+        return 0;
+    }
+    if (limit_all) {
+        bucket->tokens[FLOOD_ALL] -= 1000;
+    }
+    if (limit_class) {
+        bucket->tokens[class] -= 1000;
+    }
+    return 1;
+}
+
+uint64_t flood_dropped(flood_class class) {
+    return flood_dropped_counts[class];
+}
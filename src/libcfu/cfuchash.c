@@ -0,0 +1,536 @@
+/*
+ * cfuchash.c - This file is part of the libcfu library
+ *
+ * This code is released under the BSD license, see cfuhash.c.
+ */
+
+#include "cfu.h"
+#include "cfuchash.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CFUCHASH_DEFAULT_STRIPES 64
+
+/* buckets each stripe starts with, they double when the stripe
+   has more entries than buckets */
+#define CHASH_INITIAL_BUCKETS 8
+
+/* retired pointers a stripe collects before it tries to free them */
+#define CHASH_RETIRE_BATCH 64
+
+#define CHASH_CACHE_LINE 64
+
+/*
+ Readers walk the chains without any locks, so a writer never changes
+ a node that is reachable from the table except for its data pointer,
+ which is replaced atomically.  New nodes are linked at the head of a
+ chain, deleted ones are unlinked by pointing their predecessor past
+ them, and growing a stripe copies its nodes into a new bucket array
+ which is then published with a single store.  The unlinked nodes and
+ the old bucket arrays are retired: they are freed only once no
+ reader can still be looking at them.
+
+ That is tracked with epochs.  A reader publishes the global epoch
+ when it starts a read section and clears it when it ends.  The epoch
+ can only advance when every reader in a read section has seen the
+ current one, so a pointer retired during epoch e can't be reached by
+ anyone once the epoch is e + 2.
+*/
+
+typedef struct cfuchash_node {
+	struct cfuchash_node *next;
+	void *data;
+	unsigned int hv;
+	size_t key_size;
+	char key[];
+} cfuchash_node;
+
+typedef struct cfuchash_buckets {
+	size_t num_buckets;
+	cfuchash_node *buckets[];
+} cfuchash_buckets;
+
+typedef struct cfuchash_retired {
+	void *ptr;
+	cfuhash_free_fn_t ff;
+	unsigned long epoch;
+} cfuchash_retired;
+
+/* stripes are cache line aligned so writers on different stripes
+   don't bounce the same line around */
+typedef struct cfuchash_stripe {
+	pthread_mutex_t mutex;
+	cfuchash_buckets *table; /* read without the mutex */
+	size_t entries;
+	cfuchash_retired *retired;
+	size_t num_retired;
+	size_t retired_size;
+	size_t reclaim_at;
+} __attribute__((aligned(CHASH_CACHE_LINE))) cfuchash_stripe;
+
+struct cfuchash_table {
+	unsigned int flags;
+	unsigned int stripe_bits;
+	size_t num_stripes;
+	cfuchash_stripe *stripes;
+};
+
+/* the read section state of a thread.  The records are never freed,
+   a thread that exits leaves its record for the next one to reuse. */
+typedef struct chash_reader {
+	unsigned long epoch; /* epoch the read section started in, 0 outside of one */
+	unsigned int depth;  /* only touched by the owning thread */
+	int in_use;
+	struct chash_reader *next;
+} __attribute__((aligned(CHASH_CACHE_LINE))) chash_reader;
+
+static unsigned long chash_epoch = 1;
+static chash_reader *chash_readers;
+static pthread_key_t chash_reader_key;
+static pthread_once_t chash_reader_once = PTHREAD_ONCE_INIT;
+static __thread chash_reader *chash_self;
+
+static void
+chash_reader_release(void *arg) {
+	chash_reader *r = (chash_reader *)arg;
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+chash_reader_key_init(void) {
+	pthread_key_create(&chash_reader_key, chash_reader_release);
+}
+
+/* returns the reader record of this thread, claiming one on first use */
+static chash_reader *
+chash_reader_get(void) {
+	chash_reader *r = chash_self;
+	void *p = NULL;
+
+	if (r) return r;
+
+	pthread_once(&chash_reader_once, chash_reader_key_init);
+	for (r = __atomic_load_n(&chash_readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&r->in_use, &unused, 1, 0, __ATOMIC_ACQ_REL,
+				__ATOMIC_RELAXED))
+			break;
+	}
+	if (!r) {
+		if (posix_memalign(&p, CHASH_CACHE_LINE, sizeof(chash_reader))) abort();
+		r = (chash_reader *)p;
+		memset(r, 0, sizeof(chash_reader));
+		r->in_use = 1;
+		r->next = __atomic_load_n(&chash_readers, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&chash_readers, &r->next, r, 0, __ATOMIC_RELEASE,
+				__ATOMIC_RELAXED))
+			;
+	}
+	r->depth = 0;
+	chash_self = r;
+	pthread_setspecific(chash_reader_key, r);
+	return r;
+}
+
+void
+cfuchash_read_lock(void) {
+	chash_reader *r = chash_reader_get();
+	unsigned long e, now;
+
+	if (r->depth++) return;
+	/* publish the epoch, and make sure it is still the current one
+	   after the store is visible to writers */
+	e = __atomic_load_n(&chash_epoch, __ATOMIC_SEQ_CST);
+	for (;;) {
+		__atomic_store_n(&r->epoch, e, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		now = __atomic_load_n(&chash_epoch, __ATOMIC_SEQ_CST);
+		if (now == e) break;
+		e = now;
+	}
+}
+
+void
+cfuchash_read_unlock(void) {
+	chash_reader *r = chash_self;
+
+	if (--r->depth) return;
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* moves the global epoch forward if every reader has seen it, and
+   returns the epoch after the attempt */
+static unsigned long
+chash_try_advance(void) {
+	unsigned long e = __atomic_load_n(&chash_epoch, __ATOMIC_SEQ_CST);
+	chash_reader *r;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (r = __atomic_load_n(&chash_readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+		unsigned long re = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+		if (re && re != e) return e;
+	}
+	__atomic_compare_exchange_n(&chash_epoch, &e, e + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&chash_epoch, __ATOMIC_SEQ_CST);
+}
+
+/* frees the retired pointers of the stripe that no reader can see anymore.
+   The stripe must be locked. */
+static void
+stripe_reclaim(cfuchash_stripe *st) {
+	unsigned long e = chash_try_advance();
+	size_t i, kept = 0;
+
+	for (i = 0; i < st->num_retired; i++) {
+		if (st->retired[i].epoch + 2 <= e) {
+			st->retired[i].ff(st->retired[i].ptr);
+		} else {
+			st->retired[kept++] = st->retired[i];
+		}
+	}
+	st->num_retired = kept;
+	/* if readers are holding the epoch back, don't rescan the
+	   whole list on every retire */
+	st->reclaim_at = kept * 2 > CHASH_RETIRE_BATCH ? kept * 2 : CHASH_RETIRE_BATCH;
+}
+
+/* makes room for count more retired pointers, so that retiring them
+   can't fail once they have been unlinked.  Returns zero if the memory
+   couldn't be allocated.  The stripe must be locked. */
+static int
+stripe_reserve(cfuchash_stripe *st, size_t count) {
+	size_t size = st->retired_size ? st->retired_size : CHASH_RETIRE_BATCH;
+	cfuchash_retired *retired;
+
+	if (st->num_retired + count <= st->retired_size) return 1;
+	while (size < st->num_retired + count) size *= 2;
+	retired = realloc(st->retired, size * sizeof(cfuchash_retired));
+	if (!retired) return 0;
+	st->retired = retired;
+	st->retired_size = size;
+	return 1;
+}
+
+/* frees ptr with ff once no reader can see it.  The stripe must be
+   locked, ptr already unreachable from the table, and room for it
+   reserved with stripe_reserve(). */
+static void
+stripe_retire(cfuchash_stripe *st, void *ptr, cfuhash_free_fn_t ff) {
+	/* the epoch is read after the pointer was unlinked */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	st->retired[st->num_retired].ptr = ptr;
+	st->retired[st->num_retired].ff = ff;
+	st->retired[st->num_retired].epoch = __atomic_load_n(&chash_epoch, __ATOMIC_SEQ_CST);
+	st->num_retired++;
+
+	if (st->num_retired >= st->reclaim_at) stripe_reclaim(st);
+}
+
+static cfuchash_buckets *
+chash_buckets_new(size_t num_buckets) {
+	cfuchash_buckets *b = calloc(1, sizeof(cfuchash_buckets) +
+		num_buckets * sizeof(cfuchash_node *));
+	if (b) b->num_buckets = num_buckets;
+	return b;
+}
+
+/* frees the nodes of a bucket array no reader has seen, and the array */
+static void
+chash_buckets_free(cfuchash_buckets *b) {
+	size_t i;
+
+	for (i = 0; i < b->num_buckets; i++) {
+		cfuchash_node *node = b->buckets[i];
+		while (node) {
+			cfuchash_node *next = node->next;
+			free(node);
+			node = next;
+		}
+	}
+	free(b);
+}
+
+static CFU_INLINE cfuchash_stripe *
+chash_stripe(cfuchash_table_t *ht, unsigned int hv) {
+	/* the stripe comes from the high bits and the bucket from the low ones */
+	return &ht->stripes[((uint64_t)hv << ht->stripe_bits) >> 32];
+}
+
+static CFU_INLINE cfuchash_node **
+chash_bucket(cfuchash_buckets *b, unsigned int hv) {
+	return &b->buckets[hv & (b->num_buckets - 1)];
+}
+
+static cfuchash_node *
+chash_find(cfuchash_table_t *ht, cfuchash_buckets *b, const void *key, size_t key_size,
+	unsigned int hv) {
+	cfuchash_node *node = __atomic_load_n(chash_bucket(b, hv), __ATOMIC_ACQUIRE);
+
+	for (; node; node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) {
+		if (node->hv == hv && !cfuhash_key_cmp(key, key_size, node->key, node->key_size,
+				ht->flags & CFUHASH_IGNORE_CASE))
+			return node;
+	}
+	return NULL;
+}
+
+/* doubles the buckets of the stripe by copying its nodes into a new
+   bucket array.  If memory runs out, the stripe just stays at its
+   size, with longer chains.  The stripe must be locked. */
+static void
+stripe_grow(cfuchash_stripe *st) {
+	cfuchash_buckets *old = st->table;
+	cfuchash_buckets *b;
+	cfuchash_node *node;
+	size_t i;
+
+	/* the old nodes and the old array are retired */
+	if (!stripe_reserve(st, st->entries + 1)) return;
+	b = chash_buckets_new(old->num_buckets * 2);
+	if (!b) return;
+	for (i = 0; i < old->num_buckets; i++) {
+		for (node = old->buckets[i]; node; node = node->next) {
+			size_t size = sizeof(cfuchash_node) + node->key_size;
+			cfuchash_node *copy = malloc(size);
+			cfuchash_node **bucket = chash_bucket(b, node->hv);
+			if (!copy) {
+				chash_buckets_free(b);
+				return;
+			}
+			memcpy(copy, node, size);
+			copy->next = *bucket;
+			*bucket = copy;
+		}
+	}
+	__atomic_store_n(&st->table, b, __ATOMIC_RELEASE);
+
+	for (i = 0; i < old->num_buckets; i++) {
+		cfuchash_node *next;
+		for (node = old->buckets[i]; node; node = next) {
+			next = node->next;
+			stripe_retire(st, node, free);
+		}
+	}
+	stripe_retire(st, old, free);
+}
+
+cfuchash_table_t *
+cfuchash_new_with_stripes(size_t num_stripes, unsigned int flags) {
+	cfuchash_table_t *ht = calloc(1, sizeof(cfuchash_table_t));
+	void *p = NULL;
+	size_t i;
+
+	if (!ht) return NULL;
+	/* picks the hash seed before any other thread can race for it */
+	cfuhash_hash_key("", 0, 0);
+
+	ht->flags = flags & CFUHASH_IGNORE_CASE;
+	ht->num_stripes = 1;
+	while (ht->num_stripes < num_stripes) {
+		ht->num_stripes <<= 1;
+		ht->stripe_bits++;
+	}
+	if (posix_memalign(&p, CHASH_CACHE_LINE, ht->num_stripes * sizeof(cfuchash_stripe))) {
+		free(ht);
+		return NULL;
+	}
+	ht->stripes = (cfuchash_stripe *)p;
+	memset(ht->stripes, 0, ht->num_stripes * sizeof(cfuchash_stripe));
+	for (i = 0; i < ht->num_stripes; i++) {
+		pthread_mutex_init(&ht->stripes[i].mutex, NULL);
+		ht->stripes[i].table = chash_buckets_new(CHASH_INITIAL_BUCKETS);
+		ht->stripes[i].reclaim_at = CHASH_RETIRE_BATCH;
+		if (!ht->stripes[i].table) {
+			ht->num_stripes = i + 1;
+			cfuchash_destroy(ht);
+			return NULL;
+		}
+	}
+
+	return ht;
+}
+
+cfuchash_table_t *
+cfuchash_new(unsigned int flags) {
+	return cfuchash_new_with_stripes(CFUCHASH_DEFAULT_STRIPES, flags);
+}
+
+void
+cfuchash_destroy(cfuchash_table_t *ht) {
+	size_t i, j;
+
+	if (!ht) return;
+
+	for (i = 0; i < ht->num_stripes; i++) {
+		cfuchash_stripe *st = &ht->stripes[i];
+		if (st->table) chash_buckets_free(st->table);
+		for (j = 0; j < st->num_retired; j++) st->retired[j].ff(st->retired[j].ptr);
+		free(st->retired);
+		pthread_mutex_destroy(&st->mutex);
+	}
+	free(ht->stripes);
+	free(ht);
+}
+
+int
+cfuchash_get_data(cfuchash_table_t *ht, const void *key, size_t key_size, void **data) {
+	unsigned int hv;
+	cfuchash_stripe *st;
+	cfuchash_node *node;
+
+	if (key_size == (size_t)(-1)) key_size = strlen(key) + 1;
+	hv = cfuhash_hash_key(key, key_size, ht->flags & CFUHASH_IGNORE_CASE);
+	st = chash_stripe(ht, hv);
+
+	cfuchash_read_lock();
+	node = chash_find(ht, __atomic_load_n(&st->table, __ATOMIC_ACQUIRE), key, key_size, hv);
+	if (node && data) *data = __atomic_load_n(&node->data, __ATOMIC_ACQUIRE);
+	cfuchash_read_unlock();
+
+	return node != NULL;
+}
+
+int
+cfuchash_put_data(cfuchash_table_t *ht, const void *key, size_t key_size, void *data,
+	void **r) {
+	unsigned int hv;
+	cfuchash_stripe *st;
+	cfuchash_node *node;
+	cfuchash_node **bucket;
+
+	if (key_size == (size_t)(-1)) key_size = strlen(key) + 1;
+	hv = cfuhash_hash_key(key, key_size, ht->flags & CFUHASH_IGNORE_CASE);
+	st = chash_stripe(ht, hv);
+
+	pthread_mutex_lock(&st->mutex);
+	node = chash_find(ht, st->table, key, key_size, hv);
+	if (node) {
+		if (r) *r = node->data;
+		__atomic_store_n(&node->data, data, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&st->mutex);
+		return 0;
+	}
+
+	node = malloc(sizeof(cfuchash_node) + key_size);
+	if (!node) {
+		pthread_mutex_unlock(&st->mutex);
+		return -1;
+	}
+	node->data = data;
+	node->hv = hv;
+	node->key_size = key_size;
+	memcpy(node->key, key, key_size);
+	bucket = chash_bucket(st->table, hv);
+	node->next = *bucket;
+	__atomic_store_n(bucket, node, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&st->entries, 1, __ATOMIC_RELAXED);
+
+	if (st->entries > st->table->num_buckets) stripe_grow(st);
+	pthread_mutex_unlock(&st->mutex);
+
+	return 1;
+}
+
+void *
+cfuchash_delete_data(cfuchash_table_t *ht, const void *key, size_t key_size) {
+	unsigned int hv;
+	cfuchash_stripe *st;
+	cfuchash_node *node;
+	cfuchash_node **prev;
+	void *r = NULL;
+
+	if (key_size == (size_t)(-1)) key_size = strlen(key) + 1;
+	hv = cfuhash_hash_key(key, key_size, ht->flags & CFUHASH_IGNORE_CASE);
+	st = chash_stripe(ht, hv);
+
+	pthread_mutex_lock(&st->mutex);
+	/* the entry is left alone if it couldn't be retired */
+	if (!stripe_reserve(st, 1)) {
+		pthread_mutex_unlock(&st->mutex);
+		return NULL;
+	}
+	prev = chash_bucket(st->table, hv);
+	for (node = *prev; node; prev = &node->next, node = node->next) {
+		if (node->hv == hv && !cfuhash_key_cmp(key, key_size, node->key, node->key_size,
+				ht->flags & CFUHASH_IGNORE_CASE))
+			break;
+	}
+	if (node) {
+		/* readers already on the node can still follow its next pointer */
+		__atomic_store_n(prev, node->next, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&st->entries, 1, __ATOMIC_RELAXED);
+		r = node->data;
+		stripe_retire(st, node, free);
+	}
+	pthread_mutex_unlock(&st->mutex);
+
+	return r;
+}
+
+void *
+cfuchash_get(cfuchash_table_t *ht, const char *key) {
+	void *r = NULL;
+	cfuchash_get_data(ht, key, -1, &r);
+	return r;
+}
+
+void *
+cfuchash_put(cfuchash_table_t *ht, const char *key, void *data) {
+	void *r = NULL;
+	cfuchash_put_data(ht, key, -1, data, &r);
+	return r;
+}
+
+void *
+cfuchash_delete(cfuchash_table_t *ht, const char *key) {
+	return cfuchash_delete_data(ht, key, -1);
+}
+
+size_t
+cfuchash_num_entries(cfuchash_table_t *ht) {
+	size_t entries = 0;
+	size_t i;
+
+	for (i = 0; i < ht->num_stripes; i++)
+		entries += __atomic_load_n(&ht->stripes[i].entries, __ATOMIC_RELAXED);
+	return entries;
+}
+
+size_t
+cfuchash_foreach(cfuchash_table_t *ht, cfuhash_foreach_fn_t fe_fn, void *arg) {
+	size_t num_accessed = 0;
+	size_t i, j;
+	int rv = 0;
+
+	cfuchash_read_lock();
+	for (i = 0; i < ht->num_stripes && !rv; i++) {
+		cfuchash_buckets *b = __atomic_load_n(&ht->stripes[i].table, __ATOMIC_ACQUIRE);
+		for (j = 0; j < b->num_buckets && !rv; j++) {
+			cfuchash_node *node = __atomic_load_n(&b->buckets[j], __ATOMIC_ACQUIRE);
+			for (; node && !rv; node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) {
+				num_accessed++;
+				rv = fe_fn(node->key, node->key_size,
+					__atomic_load_n(&node->data, __ATOMIC_ACQUIRE), 0, arg);
+			}
+		}
+	}
+	cfuchash_read_unlock();
+
+	return num_accessed;
+}
+
+int
+cfuchash_retire(cfuchash_table_t *ht, void *ptr, cfuhash_free_fn_t ff) {
+	cfuchash_stripe *st = &ht->stripes[((uintptr_t)ptr / CHASH_CACHE_LINE) & (ht->num_stripes - 1)];
+	int ok;
+
+	pthread_mutex_lock(&st->mutex);
+	ok = stripe_reserve(st, 1);
+	if (ok) stripe_retire(st, ptr, ff);
+	pthread_mutex_unlock(&st->mutex);
+	return ok;
+}
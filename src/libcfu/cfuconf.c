@@ -212,7 +212,7 @@ cfuconf_get_directive_n_args(cfuconf_t *conf, char *directive, size_t n, ...) {
 		va_start(ap, n);
 		for (i = 0; i < n; i++) {
 			ptr = va_arg(ap, char **);
-			if (cfulist_nth_data(val_list, &val, &size, 1)) {
+			if (cfulist_nth_data(val_list, &val, &size, i)) {
 				*ptr = (char *)val;
 			} else {
 				i--;
@@ -54,6 +54,17 @@
 #endif
 
 #include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+# include <sys/random.h>
+#endif
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 
 typedef struct cfuhash_event_flags {
@@ -61,14 +72,38 @@ typedef struct cfuhash_event_flags {
 	int pad:31;
 } cfuhash_event_flags;
 
+/* keys up to this size are copied into the entry itself instead of
+   into a separate allocation */
+#define HASH_INLINE_KEY_SIZE 16
+
 typedef struct cfuhash_entry {
 	void *key;
 	size_t key_size;
 	void *data;
 	size_t data_size;
 	struct cfuhash_entry *next;
+	char key_buf[HASH_INLINE_KEY_SIZE];
 } cfuhash_entry;
 
+/* a slot of an open addressing table (CFUHASH_OPEN_ADDRESSING) */
+typedef struct cfuhash_slot {
+	void *key;
+	size_t key_size;
+	void *data;
+	size_t data_size;
+	char key_buf[HASH_INLINE_KEY_SIZE];
+} cfuhash_slot;
+
+/* chained entries are carved out of chunks owned by the table */
+typedef struct cfuhash_entry_chunk {
+	struct cfuhash_entry_chunk *next;
+	cfuhash_entry entries[];
+} cfuhash_entry_chunk;
+
+/* sizes of the first and the largest entry chunk, in entries */
+#define HASH_CHUNK_MIN_ENTRIES 16
+#define HASH_CHUNK_MAX_ENTRIES 4096
+
 struct cfuhash_table {
 	libcfu_type type;
 	size_t num_buckets;
@@ -79,31 +114,211 @@ struct cfuhash_table {
 #endif
 	unsigned int flags;
 	cfuhash_function_t hash_func;
-	size_t each_bucket_index;
-	cfuhash_entry *each_chain_entry;
+	cfuhash_iter_t each_iter; /* used by cfuhash_each() and cfuhash_next() */
 	float high;
 	float low;
 	cfuhash_free_fn_t free_fn;
 	unsigned int resized_count;
+	uint64_t rehash_ns; /* time spent resizing and moving entries */
 	cfuhash_event_flags event_flags;
+	/* With CFUHASH_OPEN_ADDRESSING, the entries live directly in
+	   slots instead of buckets, and ctrl has one byte per slot
+	   telling whether it is empty, deleted or full.  For full slots
+	   the byte holds 7 bits of the hash value, so most mismatching
+	   keys are rejected without touching the slot itself.
+	*/
+	signed char *ctrl;
+	cfuhash_slot *slots;
+	size_t growth_left; /* empty slots that can be filled before a resize */
+	/* With CFUHASH_INCREMENTAL_REHASH, resizing only allocates the new
+	   storage.  The entries are then moved over from the old storage a
+	   few buckets at a time by each put, starting from migrate_index.
+	   Deletes leave the entries where they are, so that a delete
+	   during an iteration over both storages doesn't move an entry
+	   past the iterator.  old_num_buckets is zero when nothing is
+	   being moved.
+	*/
+	cfuhash_entry **old_buckets;
+	signed char *old_ctrl;
+	cfuhash_slot *old_slots;
+	size_t old_num_buckets;
+	size_t migrate_index;
+	/* chained entries come from chunks, and deleted ones are kept on
+	   free_entries (linked through next) for reuse */
+	cfuhash_entry_chunk *chunks;
+	cfuhash_entry *free_entries;
+	size_t chunk_entries; /* total entries in all the chunks */
+	size_t num_chunks;
+	size_t key_memory; /* bytes of the keys copied outside the entries */
 };
 
-/* Perl's hash function */
+/* monotonic time in nanoseconds, for timing the rehashes */
+static uint64_t
+hash_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* how many buckets or slots each put moves during an incremental rehash */
+#define HASH_MIGRATE_STEP 32
+
+/* ASCII lower case, same as tolower() in the C locale */
+static CFU_INLINE unsigned char
+fold_case(unsigned char c) {
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/* lower cases the ASCII letters in all 8 bytes of v at once */
+static CFU_INLINE uint64_t
+fold_case64(uint64_t v) {
+	uint64_t low7 = v & 0x7f7f7f7f7f7f7f7full;
+	/* the high bit of each byte tells whether the byte is >= 'A' or > 'Z',
+	   the additions can't carry over to the next byte */
+	uint64_t ge_a = low7 + 0x3f3f3f3f3f3f3f3full;
+	uint64_t gt_z = low7 + 0x2525252525252525ull;
+	uint64_t upper = (ge_a ^ gt_z) & ~v & 0x8080808080808080ull;
+	return v | (upper >> 2);
+}
+
+/*
+ The default hash function is wyhash (https://github.com/wangyi-fudan/wyhash,
+ public domain) with a random seed per process.  It reads the key 8
+ bytes at a time and mixes them with 64x64->128 bit multiplications,
+ so it's much faster per byte than the Perl hash this used to be.
+ The seed makes the hash values of the keys unpredictable, so clients
+ can't choose nicknames or channel names that all collide.
+*/
+
+static uint64_t hash_seed;
+
+static const uint64_t hash_secret[4] = {
+	0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+/* multiplies a and b, returning the low and high halves of the 128 bit result */
+static CFU_INLINE void
+hash_mum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+	__extension__ typedef unsigned __int128 uint128;
+	uint128 r = (uint128)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), c = t < rl, lo;
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static CFU_INLINE uint64_t
+hash_mix(uint64_t a, uint64_t b) {
+	hash_mum(&a, &b);
+	return a ^ b;
+}
+
+/* picks the seed for the default hash function, done once per process */
+static void
+hash_seed_init(void) {
+	uint64_t seed = 0;
+#ifdef __linux__
+	if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed))
+#endif
+	{
+		/* no entropy available, this is still better than a fixed seed */
+		seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)&seed;
+	}
+	if (!seed) seed = 1;
+	/* wyhash starts by mixing the seed with the secret, do it only once */
+	hash_seed = seed ^ hash_mix(seed ^ hash_secret[0], hash_secret[1]);
+	if (!hash_seed) hash_seed = 1;
+}
+
+/* the readers lower case what they read if lower_case is set */
+static CFU_INLINE uint64_t
+hash_read8(const unsigned char *p, int lower_case) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return lower_case ? fold_case64(v) : v;
+}
+
+static CFU_INLINE uint64_t
+hash_read4(const unsigned char *p, int lower_case) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return lower_case ? fold_case64(v) : v;
+}
+
+/* reads 1 to 3 bytes */
+static CFU_INLINE uint64_t
+hash_read3(const unsigned char *p, size_t len, int lower_case) {
+	uint64_t v = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+	return lower_case ? fold_case64(v) : v;
+}
+
+static CFU_INLINE unsigned int
+wyhash(const void *key, size_t len, int lower_case) {
+	const unsigned char *p = (const unsigned char *)key;
+	uint64_t seed = hash_seed;
+	uint64_t a, b, h;
+
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (hash_read4(p, lower_case) << 32) | hash_read4(p + ((len >> 3) << 2), lower_case);
+			b = (hash_read4(p + len - 4, lower_case) << 32)
+				| hash_read4(p + len - 4 - ((len >> 3) << 2), lower_case);
+		} else if (len > 0) {
+			a = hash_read3(p, len, lower_case);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = len;
+		if (i > 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = hash_mix(hash_read8(p, lower_case) ^ hash_secret[1],
+					hash_read8(p + 8, lower_case) ^ seed);
+				see1 = hash_mix(hash_read8(p + 16, lower_case) ^ hash_secret[2],
+					hash_read8(p + 24, lower_case) ^ see1);
+				see2 = hash_mix(hash_read8(p + 32, lower_case) ^ hash_secret[3],
+					hash_read8(p + 40, lower_case) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = hash_mix(hash_read8(p, lower_case) ^ hash_secret[1],
+				hash_read8(p + 8, lower_case) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = hash_read8(p + i - 16, lower_case);
+		b = hash_read8(p + i - 8, lower_case);
+	}
+
+	a ^= hash_secret[1];
+	b ^= seed;
+	hash_mum(&a, &b);
+	h = hash_mix(a ^ hash_secret[0] ^ len, b ^ hash_secret[1]);
+	return (unsigned int)(h ^ (h >> 32));
+}
+
 static unsigned int
 hash_func(const void *key, size_t length) {
-	register size_t i = length;
-	register unsigned int hv = 0; /* could put a seed here instead of zero */
-	register const unsigned char *s = (const unsigned char *)key;
-	while (i--) {
-		hv += *s++;
-		hv += (hv << 10);
-		hv ^= (hv >> 6);
-	}
-	hv += (hv << 3);
-	hv ^= (hv >> 11);
-	hv += (hv << 15);
+	return wyhash(key, length, 0);
+}
 
-	return hv;
+/* same as hash_func() on a lower case copy of the key, without making the copy */
+static unsigned int
+hash_func_lower_case(const void *key, size_t length) {
+	return wyhash(key, length, 1);
 }
 
 /* makes sure the real size of the buckets array is a power of 2 */
@@ -121,29 +336,111 @@ hash_key_dup(const void *key, size_t key_size) {
 	return new_key;
 }
 
+/* returns true if a key of this size is kept in the key_buf of its entry */
+static CFU_INLINE int
+hash_key_is_inline(cfuhash_table_t *ht, size_t key_size) {
+	return !(ht->flags & CFUHASH_NOCOPY_KEYS) && key_size <= HASH_INLINE_KEY_SIZE;
+}
+
+/* returns the key to store in an entry whose inline key buffer is key_buf */
 static CFU_INLINE void *
-hash_key_dup_lower_case(const void *key, size_t key_size) {
-	char *new_key = (char *)hash_key_dup(key, key_size);
-	size_t i = 0;
-	for (i = 0; i < key_size; i++) new_key[i] = tolower(new_key[i]);
-	return (void *)new_key;
+hash_key_store(cfuhash_table_t *ht, const void *key, size_t key_size, char *key_buf) {
+	if (ht->flags & CFUHASH_NOCOPY_KEYS) return (void *)key;
+	if (key_size > HASH_INLINE_KEY_SIZE) {
+		ht->key_memory += key_size;
+		return hash_key_dup(key, key_size);
+	}
+	memcpy(key_buf, key, key_size);
+	return key_buf;
 }
 
-/* returns the index into the buckets array */
+static CFU_INLINE void
+hash_key_free(cfuhash_table_t *ht, void *key, size_t key_size) {
+	if (!(ht->flags & CFUHASH_NOCOPY_KEYS) && key_size > HASH_INLINE_KEY_SIZE) {
+		ht->key_memory -= key_size;
+		free(key);
+	}
+}
+
+/* takes an entry from the free list, adding a new chunk to it if it's empty */
+static cfuhash_entry *
+hash_entry_alloc(cfuhash_table_t *ht) {
+	cfuhash_entry *he = ht->free_entries;
+
+	if (!he) {
+		/* chunks double in size, so the number of allocations
+		   grows only logarithmically with the table */
+		size_t n = ht->chunk_entries;
+		size_t i;
+		cfuhash_entry_chunk *chunk;
+
+		if (n < HASH_CHUNK_MIN_ENTRIES) n = HASH_CHUNK_MIN_ENTRIES;
+		if (n > HASH_CHUNK_MAX_ENTRIES) n = HASH_CHUNK_MAX_ENTRIES;
+		chunk = malloc(sizeof(cfuhash_entry_chunk) + n * sizeof(cfuhash_entry));
+		if (!chunk) return NULL;
+		chunk->next = ht->chunks;
+		ht->chunks = chunk;
+		ht->chunk_entries += n;
+		ht->num_chunks++;
+		for (i = n; i > 0; i--) {
+			chunk->entries[i - 1].next = ht->free_entries;
+			ht->free_entries = &chunk->entries[i - 1];
+		}
+		he = ht->free_entries;
+	}
+	ht->free_entries = he->next;
+	return he;
+}
+
+static CFU_INLINE void
+hash_entry_free(cfuhash_table_t *ht, cfuhash_entry *he) {
+	he->next = ht->free_entries;
+	ht->free_entries = he;
+}
+
+/* keys up to this size are lower cased on the stack for custom hash functions */
+#define HASH_LOWER_CASE_BUF_SIZE 256
+
+/* hashes the lower case form of the key with a custom hash function */
+static unsigned int
+hash_custom_lower_case(cfuhash_table_t *ht, const void *key, size_t key_size) {
+	char buf[HASH_LOWER_CASE_BUF_SIZE];
+	char *lc_key = key_size <= sizeof(buf) ? buf : malloc(key_size);
+	const unsigned char *s = (const unsigned char *)key;
+	unsigned int hv;
+	size_t i;
+
+	for (i = 0; i < key_size; i++) lc_key[i] = fold_case(s[i]);
+	hv = ht->hash_func(lc_key, key_size);
+	if (lc_key != buf) free(lc_key);
+	return hv;
+}
+
+/* returns the full hash value of the key */
 static CFU_INLINE unsigned int
-hash_value(cfuhash_table_t *ht, const void *key, size_t key_size, size_t num_buckets) {
+hash_full(cfuhash_table_t *ht, const void *key, size_t key_size) {
 	unsigned int hv = 0;
 
 	if (key) {
 		if (ht->flags & CFUHASH_IGNORE_CASE) {
-			char *lc_key = (char *)hash_key_dup_lower_case(key, key_size);
-			hv = ht->hash_func(lc_key, key_size);
-			free(lc_key);
+			if (ht->hash_func == hash_func) {
+				hv = hash_func_lower_case(key, key_size);
+			} else {
+				hv = hash_custom_lower_case(ht, key, key_size);
+			}
 		} else {
 			hv = ht->hash_func(key, key_size);
 		}
 	}
 
+	return hv;
+}
+
+/* returns the index into the buckets array */
+static CFU_INLINE unsigned int
+hash_value(cfuhash_table_t *ht, const void *key, size_t key_size, size_t num_buckets) {
+	unsigned int hv = hash_full(ht, key, key_size);
+
 	/* The idea is the following: if, e.g., num_buckets is 32
 	   (000001), num_buckets - 1 will be 31 (111110). The & will make
 	   sure we only get the first 5 bits which will guarantee the
@@ -152,19 +449,489 @@ hash_value(cfuhash_table_t *ht, const void *key, size_t key_size, size_t num_buc
 	return hv & (num_buckets - 1);
 }
 
+#ifdef __SSE2__
+/* lower cases the ASCII letters of 16 bytes */
+static CFU_INLINE __m128i
+fold_case16(__m128i v) {
+	__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+		_mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+	return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8('a' - 'A')));
+}
+
+/* returns 1 if the 16 bytes at a and b are equal ignoring case */
+static CFU_INLINE int
+case_equal16(const void *a, const void *b) {
+	__m128i va = fold_case16(_mm_loadu_si128((const __m128i *)a));
+	__m128i vb = fold_case16(_mm_loadu_si128((const __m128i *)b));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xffff;
+}
+#endif
+
+/* compares two keys of the same size ignoring the case of ASCII letters,
+   returns zero if they match.  Unlike strncasecmp(), this doesn't stop at
+   a '\0' but compares the whole key.
+*/
+static CFU_INLINE int
+key_casecmp(const void *key, const void *other, size_t key_size) {
+	const unsigned char *a = (const unsigned char *)key;
+	const unsigned char *b = (const unsigned char *)other;
+#ifdef __SSE2__
+	unsigned char tail_a[16] = { 0 };
+	unsigned char tail_b[16] = { 0 };
+
+	for (; key_size >= 16; a += 16, b += 16, key_size -= 16) {
+		if (!case_equal16(a, b)) return 1;
+	}
+	if (!key_size) return 0;
+	/* copy the rest so that the loads don't read past the keys */
+	memcpy(tail_a, a, key_size);
+	memcpy(tail_b, b, key_size);
+	return !case_equal16(tail_a, tail_b);
+#else
+	size_t i;
+	for (i = 0; i < key_size; i++) {
+		if (fold_case(a[i]) != fold_case(b[i])) return 1;
+	}
+	return 0;
+#endif
+}
+
+/* see if two keys match */
+/* uses the convention that zero means a match, like memcmp */
+static CFU_INLINE int
+key_cmp(const void *key, size_t key_size, const void *other, size_t other_size,
+	unsigned int case_insensitive) {
+	if (key_size != other_size) return 1;
+	if (key == other) return 0;
+	if (case_insensitive) {
+		return key_casecmp(key, other, key_size);
+	}
+	return memcmp(key, other, key_size);
+}
+
+unsigned int
+cfuhash_hash_key(const void *key, size_t key_size, int ignore_case) {
+	if (!hash_seed) hash_seed_init();
+	return wyhash(key, key_size, ignore_case);
+}
+
+int
+cfuhash_key_cmp(const void *key, size_t key_size, const void *other, size_t other_size,
+	int ignore_case) {
+	return key_cmp(key, key_size, other, other_size, ignore_case);
+}
+
+/*
+ Open addressing (CFUHASH_OPEN_ADDRESSING)
+
+ The slots are split into groups of OA_GROUP_SIZE.  A key is looked
+ up by comparing the 7 bit hash tag of the key against the control
+ bytes of a whole group at once (with SSE2 when available), and only
+ the slots whose tag matches are compared against the key.  If the
+ group has an empty slot, the key can't be further along the probe
+ sequence and the search stops.  Otherwise the probing continues
+ with the next group in a triangular sequence, which visits every
+ group as the number of groups is a power of 2.
+
+ Deleted slots are marked with a tombstone unless their group still
+ has an empty slot.  Tombstones are reused by inserts and purged
+ when the table is resized.
+*/
+
+#define OA_GROUP_SIZE 16
+#define OA_EMPTY ((signed char)-128)
+#define OA_DELETED ((signed char)-2)
+#define OA_NOT_FOUND ((size_t)-1)
+
+/* the maximum load is 7/8 of the slots */
+#define OA_MAX_LOAD(num_slots) ((num_slots) - (num_slots) / 8)
+
+/* the index of the first group of the probe sequence */
+static CFU_INLINE size_t
+oa_h1(unsigned int hv) {
+	return hv >> 7;
+}
+
+/* the hash tag stored in the control byte of a full slot */
+static CFU_INLINE signed char
+oa_h2(unsigned int hv) {
+	return (signed char)(hv & 0x7f);
+}
+
+#ifdef __SSE2__
+/* returns a bitmask of the slots in the group whose control byte is c */
+static CFU_INLINE unsigned int
+oa_match_byte(const signed char *group, signed char c) {
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+	return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+}
+
+/* returns a bitmask of the empty or deleted slots in the group */
+static CFU_INLINE unsigned int
+oa_match_free(const signed char *group) {
+	return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+}
+#else
+static CFU_INLINE unsigned int
+oa_match_byte(const signed char *group, signed char c) {
+	unsigned int mask = 0;
+	unsigned int i;
+	for (i = 0; i < OA_GROUP_SIZE; i++) {
+		if (group[i] == c) mask |= 1u << i;
+	}
+	return mask;
+}
+
+static CFU_INLINE unsigned int
+oa_match_free(const signed char *group) {
+	unsigned int mask = 0;
+	unsigned int i;
+	for (i = 0; i < OA_GROUP_SIZE; i++) {
+		if (group[i] < 0) mask |= 1u << i;
+	}
+	return mask;
+}
+#endif
+
+/* allocates empty storage for num_slots slots.  Returns 0 and leaves
+   the hash as it was if memory runs out. */
+static int
+oa_alloc(cfuhash_table_t *ht, size_t num_slots) {
+	signed char *ctrl;
+	cfuhash_slot *slots;
+
+	if (num_slots < OA_GROUP_SIZE) num_slots = OA_GROUP_SIZE;
+	ctrl = malloc(num_slots);
+	slots = malloc(num_slots * sizeof(cfuhash_slot));
+	if (!ctrl || !slots) {
+		free(ctrl);
+		free(slots);
+		return 0;
+	}
+	memset(ctrl, OA_EMPTY, num_slots);
+	ht->num_buckets = num_slots;
+	ht->ctrl = ctrl;
+	ht->slots = slots;
+	ht->growth_left = OA_MAX_LOAD(num_slots);
+	return 1;
+}
+
+/* returns the index of the slot holding key in the given slots, or OA_NOT_FOUND */
+static CFU_INLINE size_t
+oa_find_in(const signed char *ctrl_bytes, const cfuhash_slot *slots, size_t num_slots,
+	const void *key, size_t key_size, unsigned int hv, unsigned int case_insensitive) {
+	size_t group_mask = num_slots / OA_GROUP_SIZE - 1;
+	size_t group = oa_h1(hv) & group_mask;
+	size_t step = 0;
+	signed char h2 = oa_h2(hv);
+
+	for (;;) {
+		const signed char *ctrl = ctrl_bytes + group * OA_GROUP_SIZE;
+		unsigned int match = oa_match_byte(ctrl, h2);
+		while (match) {
+			size_t i = group * OA_GROUP_SIZE + __builtin_ctz(match);
+			const cfuhash_slot *slot = &slots[i];
+			if (!key_cmp(key, key_size, slot->key, slot->key_size, case_insensitive)) return i;
+			match &= match - 1;
+		}
+		if (oa_match_byte(ctrl, OA_EMPTY)) return OA_NOT_FOUND;
+		group = (group + ++step) & group_mask;
+	}
+}
+
+/* finds the slot holding key.  During an incremental rehash the key may
+   still be in the old slots, in which case *old is set to 1.  Returns
+   NULL if the key is not in the hash.
+*/
+static CFU_INLINE cfuhash_slot *
+oa_lookup(cfuhash_table_t *ht, const void *key, size_t key_size, unsigned int hv,
+	size_t *index, int *old) {
+	unsigned int case_insensitive = ht->flags & CFUHASH_IGNORE_CASE;
+	size_t i = oa_find_in(ht->ctrl, ht->slots, ht->num_buckets, key, key_size, hv,
+		case_insensitive);
+
+	*old = 0;
+	if (i == OA_NOT_FOUND && ht->old_num_buckets) {
+		i = oa_find_in(ht->old_ctrl, ht->old_slots, ht->old_num_buckets, key, key_size, hv,
+			case_insensitive);
+		*old = 1;
+	}
+	if (i == OA_NOT_FOUND) return NULL;
+	*index = i;
+	return *old ? &ht->old_slots[i] : &ht->slots[i];
+}
+
+/* returns the index of the first empty or deleted slot on the probe sequence */
+static CFU_INLINE size_t
+oa_find_free(cfuhash_table_t *ht, unsigned int hv) {
+	size_t group_mask = ht->num_buckets / OA_GROUP_SIZE - 1;
+	size_t group = oa_h1(hv) & group_mask;
+	size_t step = 0;
+
+	for (;;) {
+		unsigned int match = oa_match_free(ht->ctrl + group * OA_GROUP_SIZE);
+		if (match) return group * OA_GROUP_SIZE + __builtin_ctz(match);
+		group = (group + ++step) & group_mask;
+	}
+}
+
+/* moves the entries of up to count old slots to the current slots */
+static void
+oa_migrate(cfuhash_table_t *ht, size_t count) {
+	size_t end = ht->migrate_index + count;
+	size_t i;
+
+	if (end > ht->old_num_buckets) end = ht->old_num_buckets;
+	for (i = ht->migrate_index; i < end; i++) {
+		if (ht->old_ctrl[i] >= 0) {
+			cfuhash_slot *slot = &ht->old_slots[i];
+			unsigned int hv = hash_full(ht, slot->key, slot->key_size);
+			size_t j = oa_find_free(ht, hv);
+			if (ht->ctrl[j] == OA_EMPTY) ht->growth_left--;
+			ht->ctrl[j] = oa_h2(hv);
+			ht->slots[j] = *slot;
+			if (hash_key_is_inline(ht, slot->key_size))
+				ht->slots[j].key = ht->slots[j].key_buf;
+			/* lookups still probe the old slots */
+			ht->old_ctrl[i] = OA_DELETED;
+		}
+	}
+	ht->migrate_index = end;
+
+	if (end == ht->old_num_buckets) {
+		free(ht->old_ctrl);
+		free(ht->old_slots);
+		ht->old_ctrl = NULL;
+		ht->old_slots = NULL;
+		ht->old_num_buckets = 0;
+	}
+}
+
+/* moves the entries to new storage with num_slots slots, dropping the
+   tombstones.  With incremental set, only the new storage is allocated
+   and the entries are moved later by oa_migrate().  If memory runs out,
+   the hash keeps its current storage and 0 is returned.
+*/
+static int
+oa_resize(cfuhash_table_t *ht, size_t num_slots, int incremental) {
+	uint64_t start = hash_now_ns();
+	signed char *ctrl;
+	cfuhash_slot *slots;
+	size_t num_buckets;
+
+	if (ht->old_num_buckets) oa_migrate(ht, ht->old_num_buckets);
+
+	ctrl = ht->ctrl;
+	slots = ht->slots;
+	num_buckets = ht->num_buckets;
+	if (!oa_alloc(ht, num_slots)) return 0;
+	ht->old_ctrl = ctrl;
+	ht->old_slots = slots;
+	ht->old_num_buckets = num_buckets;
+	ht->migrate_index = 0;
+	ht->resized_count++;
+
+	if (!incremental) oa_migrate(ht, ht->old_num_buckets);
+	ht->rehash_ns += hash_now_ns() - start;
+	return 1;
+}
+
+/* adds an entry for a key known not to be in the hash.  Returns NULL
+   if the table is full and can't be resized. */
+static cfuhash_slot *
+oa_add_entry(cfuhash_table_t *ht, unsigned int hv, const void *key, size_t key_size,
+	void *data, size_t data_size) {
+	size_t i = oa_find_free(ht, hv);
+	cfuhash_slot *slot;
+
+	if (ht->ctrl[i] == OA_EMPTY && !ht->growth_left) {
+		int incremental = ht->flags & CFUHASH_INCREMENTAL_REHASH;
+		int resized;
+		/* grow if the table is really filling up, otherwise
+		   just get rid of the tombstones.  The new storage is
+		   at most half full, so an incremental rehash is done
+		   long before it fills up again. */
+		if (ht->entries >= OA_MAX_LOAD(ht->num_buckets) / 2) {
+			resized = oa_resize(ht, ht->num_buckets * 2, incremental);
+		} else {
+			resized = oa_resize(ht, ht->num_buckets, incremental);
+		}
+		/* filling the slot anyway would use up the empty slots
+		   that end the probe sequences */
+		if (!resized) return NULL;
+		i = oa_find_free(ht, hv);
+	}
+
+	if (ht->ctrl[i] == OA_EMPTY) ht->growth_left--;
+	ht->ctrl[i] = oa_h2(hv);
+	slot = &ht->slots[i];
+	slot->key = hash_key_store(ht, key, key_size, slot->key_buf);
+	slot->key_size = key_size;
+	slot->data = data;
+	slot->data_size = data_size;
+	ht->entries++;
+	return slot;
+}
+
+/* marks the slot as free, the caller takes care of its key and data */
+static CFU_INLINE void
+oa_erase(cfuhash_table_t *ht, size_t i) {
+	/* a probe sequence stops at a group with an empty slot, so if
+	   this group has one, no other key can depend on this slot
+	   being full */
+	if (oa_match_byte(ht->ctrl + (i & ~(size_t)(OA_GROUP_SIZE - 1)), OA_EMPTY)) {
+		ht->ctrl[i] = OA_EMPTY;
+		ht->growth_left++;
+	} else {
+		ht->ctrl[i] = OA_DELETED;
+	}
+	ht->entries--;
+}
+
+/* returns the bucket that holds key if it's in the hash.  During an
+   incremental rehash, the old buckets are moved in order, so a key is
+   still in the old buckets if its old bucket hasn't been moved yet.
+*/
+static CFU_INLINE cfuhash_entry **
+chain_bucket(cfuhash_table_t *ht, unsigned int hv) {
+	if (ht->old_num_buckets) {
+		size_t i = hv & (ht->old_num_buckets - 1);
+		if (i >= ht->migrate_index) return &ht->old_buckets[i];
+	}
+	return &ht->buckets[hv & (ht->num_buckets - 1)];
+}
+
+/* moves the entries of up to count old buckets to the current buckets */
+static void
+chain_migrate(cfuhash_table_t *ht, size_t count) {
+	size_t end = ht->migrate_index + count;
+	size_t i;
+
+	if (end > ht->old_num_buckets) end = ht->old_num_buckets;
+	for (i = ht->migrate_index; i < end; i++) {
+		cfuhash_entry *he = ht->old_buckets[i];
+		while (he) {
+			cfuhash_entry *nhe = he->next;
+			unsigned int hv = hash_value(ht, he->key, he->key_size, ht->num_buckets);
+			he->next = ht->buckets[hv];
+			ht->buckets[hv] = he;
+			he = nhe;
+		}
+	}
+	ht->migrate_index = end;
+
+	if (end == ht->old_num_buckets) {
+		free(ht->old_buckets);
+		ht->old_buckets = NULL;
+		ht->old_num_buckets = 0;
+	}
+}
+
+/* see oa_resize() */
+static void
+chain_resize(cfuhash_table_t *ht, size_t num_buckets, int incremental) {
+	uint64_t start = hash_now_ns();
+
+	if (ht->old_num_buckets) chain_migrate(ht, ht->old_num_buckets);
+
+	ht->old_buckets = ht->buckets;
+	ht->old_num_buckets = ht->num_buckets;
+	ht->migrate_index = 0;
+	ht->buckets = calloc(num_buckets, sizeof(cfuhash_entry *));
+	ht->num_buckets = num_buckets;
+	ht->resized_count++;
+
+	if (!incremental) chain_migrate(ht, ht->old_num_buckets);
+	ht->rehash_ns += hash_now_ns() - start;
+}
+
+/* moves the entries of up to count buckets during an incremental rehash */
+static CFU_INLINE void
+hash_migrate(cfuhash_table_t *ht, size_t count) {
+	uint64_t start;
+
+	if (!ht->old_num_buckets) return;
+	start = hash_now_ns();
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) oa_migrate(ht, count);
+	else chain_migrate(ht, count);
+	ht->rehash_ns += hash_now_ns() - start;
+}
+
+/* finishes an incremental rehash, must be done before changing the buckets in bulk */
+static CFU_INLINE void
+hash_finish_migration(cfuhash_table_t *ht) {
+	hash_migrate(ht, ht->old_num_buckets);
+}
+
+/* switches the hash between chained buckets and open addressing, the
+   hash must be empty.  Returns 0 and keeps the current storage if memory
+   for the new one runs out. */
+static int
+hash_set_storage(cfuhash_table_t *ht, int open_addressing) {
+	size_t size = ht->num_buckets;
+
+	hash_finish_migration(ht);
+	if (open_addressing) {
+		if (!oa_alloc(ht, size)) return 0;
+		free(ht->buckets);
+		ht->buckets = NULL;
+	} else {
+		cfuhash_entry **buckets = calloc(size, sizeof(cfuhash_entry *));
+		if (!buckets) return 0;
+		free(ht->ctrl);
+		free(ht->slots);
+		ht->ctrl = NULL;
+		ht->slots = NULL;
+		ht->buckets = buckets;
+	}
+	return 1;
+}
+
+/* resizes the buckets for the current number of entries, the hash must be locked */
+static int
+hash_rehash(cfuhash_table_t *ht, int incremental) {
+	size_t new_size;
+
+	hash_finish_migration(ht);
+	new_size = hash_size(ht->entries * 2 / (ht->high + ht->low));
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) {
+		if (new_size < OA_GROUP_SIZE) new_size = OA_GROUP_SIZE;
+		while (ht->entries >= OA_MAX_LOAD(new_size)) new_size *= 2;
+		if (new_size == ht->num_buckets && ht->growth_left + ht->entries == OA_MAX_LOAD(new_size)) {
+			/* no tombstones to get rid of either */
+			return 0;
+		}
+		return oa_resize(ht, new_size, incremental);
+	}
+	if (new_size == ht->num_buckets) return 0;
+
+	chain_resize(ht, new_size, incremental);
+	return 1;
+}
+
 static cfuhash_table_t *
 _cfuhash_new(size_t size, unsigned int flags) {
 	cfuhash_table_t *ht;
 
+	if (!hash_seed) hash_seed_init();
+
 	size = hash_size(size);
 	ht = malloc(sizeof(cfuhash_table_t));
+	if (!ht) return NULL;
 	memset(ht, '\000', sizeof(cfuhash_table_t));
 
 	ht->type = libcfu_t_hash_table;
 	ht->num_buckets = size;
 	ht->entries = 0;
 	ht->flags = flags;
-	ht->buckets = calloc(size, sizeof(cfuhash_entry *));
+	if (flags & CFUHASH_OPEN_ADDRESSING) {
+		if (!oa_alloc(ht, size)) {
+			free(ht);
+			return NULL;
+		}
+	} else {
+		ht->buckets = calloc(size, sizeof(cfuhash_entry *));
+	}
 
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_init(&ht->mutex, NULL);
@@ -245,6 +1012,10 @@ cfuhash_get_flags(cfuhash_table_t *ht) {
 unsigned int
 cfuhash_set_flag(cfuhash_table_t *ht, unsigned int new_flag) {
 	unsigned int flags = ht->flags;
+	if ((new_flag & CFUHASH_OPEN_ADDRESSING) && !(flags & CFUHASH_OPEN_ADDRESSING)) {
+		/* the storage can only be changed while the hash is empty */
+		if (ht->entries || !hash_set_storage(ht, 1)) new_flag &= ~CFUHASH_OPEN_ADDRESSING;
+	}
 	ht->flags = flags | new_flag;
 	return flags;
 }
@@ -252,6 +1023,9 @@ cfuhash_set_flag(cfuhash_table_t *ht, unsigned int new_flag) {
 unsigned int
 cfuhash_clear_flag(cfuhash_table_t *ht, unsigned int new_flag) {
 	unsigned int flags = ht->flags;
+	if ((new_flag & CFUHASH_OPEN_ADDRESSING) && (flags & CFUHASH_OPEN_ADDRESSING)) {
+		if (ht->entries || !hash_set_storage(ht, 0)) new_flag &= ~CFUHASH_OPEN_ADDRESSING;
+	}
 	ht->flags = flags & ~new_flag;
 	return flags;
 }
@@ -326,30 +1100,20 @@ cfuhash_unlock(cfuhash_table_t *ht) {
 
 static CFU_INLINE int
 hash_cmp(const void *key, size_t key_size, cfuhash_entry *he, unsigned int case_insensitive) {
-	if (key_size != he->key_size) return 1;
-	if (key == he->key) return 0;
-	if (case_insensitive) {
-		return strncasecmp(key, he->key, key_size);
-	}
-	return memcmp(key, he->key, key_size);
+	return key_cmp(key, key_size, he->key, he->key_size, case_insensitive);
 }
 
 static CFU_INLINE cfuhash_entry *
-hash_add_entry(cfuhash_table_t *ht, unsigned int hv, const void *key, size_t key_size,
+hash_add_entry(cfuhash_table_t *ht, cfuhash_entry **bucket, const void *key, size_t key_size,
 	void *data, size_t data_size) {
-	cfuhash_entry *he = calloc(1, sizeof(cfuhash_entry));
-
-	assert(hv < ht->num_buckets);
+	cfuhash_entry *he = hash_entry_alloc(ht);
 
-	if (ht->flags & CFUHASH_NOCOPY_KEYS)
-		he->key = (void *)key;
-	else
-		he->key = hash_key_dup(key, key_size);
+	he->key = hash_key_store(ht, key, key_size, he->key_buf);
 	he->key_size = key_size;
 	he->data = data;
 	he->data_size = data_size;
-	he->next = ht->buckets[hv];
-	ht->buckets[hv] = he;
+	he->next = *bucket;
+	*bucket = he;
 	ht->entries++;
 
 	return he;
@@ -362,7 +1126,6 @@ hash_add_entry(cfuhash_table_t *ht, unsigned int hv, const void *key, size_t key
 int
 cfuhash_get_data(cfuhash_table_t *ht, const void *key, size_t key_size, void **r,
 	size_t *data_size) {
-	unsigned int hv = 0;
 	cfuhash_entry *hr = NULL;
 
 	if (!ht) return 0;
@@ -374,11 +1137,19 @@ cfuhash_get_data(cfuhash_table_t *ht, const void *key, size_t key_size, void **r
 	}
 
 	lock_hash(ht);
-	hv = hash_value(ht, key, key_size, ht->num_buckets);
-
-	assert(hv < ht->num_buckets);
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) {
+		size_t i;
+		int old;
+		cfuhash_slot *slot = oa_lookup(ht, key, key_size, hash_full(ht, key, key_size), &i, &old);
+		if (slot && r) {
+			*r = slot->data;
+			if (data_size) *data_size = slot->data_size;
+		}
+		unlock_hash(ht);
+		return (slot ? 1 : 0);
+	}
 
-	for (hr = ht->buckets[hv]; hr; hr = hr->next) {
+	for (hr = *chain_bucket(ht, hash_full(ht, key, key_size)); hr; hr = hr->next) {
 		if (!hash_cmp(key, key_size, hr, ht->flags & CFUHASH_IGNORE_CASE)) break;
 	}
 
@@ -405,6 +1176,12 @@ cfuhash_get(cfuhash_table_t *ht, const char *key) {
 	return NULL;
 }
 
+/* Same as cfuhash_get_data(), except assumes key is a null-terminated string */
+int
+cfuhash_try_get(cfuhash_table_t *ht, const char *key, void **data) {
+	return cfuhash_get_data(ht, (const void *)key, -1, data, NULL);
+}
+
 /* Returns 1 if an entry exists in the table for the given key, 0 otherwise */
 int
 cfuhash_exists_data(cfuhash_table_t *ht, const void *key, size_t key_size) {
@@ -420,6 +1197,79 @@ cfuhash_exists(cfuhash_table_t *ht, const char *key) {
 	return cfuhash_exists_data(ht, (const void *)key, -1);
 }
 
+/*
+ Add the entry to the hash.  If there is already an entry for the
+ given key, the old data value will be returned in r, and the return
+ value is zero.  If a new entry is created for the key, the function
+ returns 1.
+*/
+/*
+ Finds the entry for key, adding one with NULL data if there is none.
+ Returns pointers to the data and data size of the entry, and sets
+ inserted to 1 if the entry was added.  The hash must be locked.
+*/
+static void **
+hash_find_or_insert(cfuhash_table_t *ht, const void *key, size_t key_size, size_t **data_size,
+	int *inserted) {
+	unsigned int hv = hash_full(ht, key, key_size);
+	cfuhash_entry **bucket = NULL;
+	cfuhash_entry *he = NULL;
+
+	hash_migrate(ht, HASH_MIGRATE_STEP);
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) {
+		size_t i;
+		int old;
+		cfuhash_slot *slot = oa_lookup(ht, key, key_size, hv, &i, &old);
+		*inserted = 0;
+		if (!slot) {
+			/* open addressing tables grow before the entry is placed,
+			   so the slot stays where it is */
+			slot = oa_add_entry(ht, hv, key, key_size, NULL, 0);
+			if (!slot) return NULL;
+			*inserted = 1;
+		}
+		*data_size = &slot->data_size;
+		return &slot->data;
+	}
+
+	bucket = chain_bucket(ht, hv);
+	for (he = *bucket; he; he = he->next) {
+		if (!hash_cmp(key, key_size, he, ht->flags & CFUHASH_IGNORE_CASE)) break;
+	}
+
+	*inserted = 0;
+	if (!he) {
+		he = hash_add_entry(ht, bucket, key, key_size, NULL, 0);
+		*inserted = 1;
+		/* rehashing relinks the entries but doesn't move them */
+		if (!(ht->flags & CFUHASH_FROZEN)) {
+			if ( (float)ht->entries/(float)ht->num_buckets > ht->high )
+				hash_rehash(ht, ht->flags & CFUHASH_INCREMENTAL_REHASH);
+		}
+	}
+	*data_size = &he->data_size;
+	return &he->data;
+}
+
+void **
+cfuhash_find_or_insert(cfuhash_table_t *ht, const void *key, size_t key_size, int *inserted) {
+	void **data;
+	size_t *data_size;
+	int added;
+
+	if (key_size == (size_t)(-1)) {
+		if (key) key_size = strlen(key) + 1;
+		else key_size = 0;
+	}
+
+	lock_hash(ht);
+	data = hash_find_or_insert(ht, key, key_size, &data_size, &added);
+	unlock_hash(ht);
+
+	if (inserted) *inserted = added;
+	return data;
+}
+
 /*
  Add the entry to the hash.  If there is already an entry for the
  given key, the old data value will be returned in r, and the return
@@ -429,8 +1279,8 @@ cfuhash_exists(cfuhash_table_t *ht, const char *key) {
 int
 cfuhash_put_data(cfuhash_table_t *ht, const void *key, size_t key_size, void *data,
 	size_t data_size, void **r) {
-	unsigned int hv = 0;
-	cfuhash_entry *he = NULL;
+	void **entry_data;
+	size_t *entry_data_size;
 	int added_an_entry = 0;
 
 	if (key_size == (size_t)(-1)) {
@@ -444,31 +1294,23 @@ cfuhash_put_data(cfuhash_table_t *ht, const void *key, size_t key_size, void *da
 	}
 
 	lock_hash(ht);
-	hv = hash_value(ht, key, key_size, ht->num_buckets);
-	assert(hv < ht->num_buckets);
-	for (he = ht->buckets[hv]; he; he = he->next) {
-		if (!hash_cmp(key, key_size, he, ht->flags & CFUHASH_IGNORE_CASE)) break;
+	entry_data = hash_find_or_insert(ht, key, key_size, &entry_data_size, &added_an_entry);
+	if (!entry_data) {
+		unlock_hash(ht);
+		if (r) *r = NULL;
+		return 0;
 	}
-
-	if (he) {
-		if (r) *r = he->data;
+	if (!added_an_entry) {
+		if (r) *r = *entry_data;
 		if (ht->free_fn) {
-			ht->free_fn(he->data);
+			ht->free_fn(*entry_data);
 			if (r) *r = NULL; /* don't return a pointer to a free()'d location */
 		}
-		he->data = data;
-		he->data_size = data_size;
-	} else {
-		hash_add_entry(ht, hv, key, key_size, data, data_size);
-		added_an_entry = 1;
 	}
-
+	*entry_data = data;
+	*entry_data_size = data_size;
 	unlock_hash(ht);
 
-	if (added_an_entry && !(ht->flags & CFUHASH_FROZEN)) {
-		if ( (float)ht->entries/(float)ht->num_buckets > ht->high ) cfuhash_rehash(ht);
-	}
-
 	return added_an_entry;
 }
 
@@ -493,14 +1335,25 @@ cfuhash_clear(cfuhash_table_t *ht) {
 	size_t i = 0;
 
 	lock_hash(ht);
-	for (i = 0; i < ht->num_buckets; i++) {
+	hash_finish_migration(ht);
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) {
+		for (i = 0; i < ht->num_buckets; i++) {
+			if (ht->ctrl[i] >= 0) {
+				hash_key_free(ht, ht->slots[i].key, ht->slots[i].key_size);
+				if (ht->free_fn) ht->free_fn(ht->slots[i].data);
+			}
+		}
+		memset(ht->ctrl, OA_EMPTY, ht->num_buckets);
+		ht->growth_left = OA_MAX_LOAD(ht->num_buckets);
+	}
+	for (i = 0; i < ht->num_buckets && ht->buckets; i++) {
 		if ( (he = ht->buckets[i]) ) {
 			while (he) {
 				hep = he;
 				he = he->next;
-				if (! (ht->flags & CFUHASH_NOCOPY_KEYS) ) free(hep->key);
+				hash_key_free(ht, hep->key, hep->key_size);
 				if (ht->free_fn) ht->free_fn(hep->data);
-				free(hep);
+				hash_entry_free(ht, hep);
 			}
 			ht->buckets[i] = NULL;
 		}
@@ -518,41 +1371,68 @@ cfuhash_clear(cfuhash_table_t *ht) {
 
 void *
 cfuhash_delete_data(cfuhash_table_t *ht, const void *key, size_t key_size) {
-	unsigned int hv = 0;
+	cfuhash_entry **bucket = NULL;
 	cfuhash_entry *he = NULL;
 	cfuhash_entry *hep = NULL;
 	void *r = NULL;
+	int found = 0;
 
 	if (key_size == (size_t)(-1)) key_size = strlen(key) + 1;
 	lock_hash(ht);
-	hv = hash_value(ht, key, key_size, ht->num_buckets);
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) {
+		size_t i;
+		int old;
+		cfuhash_slot *slot = oa_lookup(ht, key, key_size, hash_full(ht, key, key_size), &i, &old);
+		if (slot) {
+			r = slot->data;
+			hash_key_free(ht, slot->key, slot->key_size);
+			if (ht->free_fn) {
+				ht->free_fn(slot->data);
+				r = NULL;
+			}
+			if (old) {
+				/* nothing is added to the old slots, a tombstone will do */
+				ht->old_ctrl[i] = OA_DELETED;
+				ht->entries--;
+			} else {
+				oa_erase(ht, i);
+			}
+			found = 1;
+		}
+	} else {
+		bucket = chain_bucket(ht, hash_full(ht, key, key_size));
 
-	for (he = ht->buckets[hv]; he; he = he->next) {
-		if (!hash_cmp(key, key_size, he, ht->flags & CFUHASH_IGNORE_CASE)) break;
-		hep = he;
+		for (he = *bucket; he; he = he->next) {
+			if (!hash_cmp(key, key_size, he, ht->flags & CFUHASH_IGNORE_CASE)) break;
+			hep = he;
+		}
 	}
 
 	if (he) {
+		found = 1;
 		r = he->data;
 		if (hep) hep->next = he->next;
-		else ht->buckets[hv] = he->next;
+		else *bucket = he->next;
 
 		ht->entries--;
-		if (! (ht->flags & CFUHASH_NOCOPY_KEYS) ) free(he->key);
+		hash_key_free(ht, he->key, he->key_size);
 		if (ht->free_fn) {
 			ht->free_fn(he->data);
 			r = NULL; /* don't return a pointer to a free()'d location */
 		}
-		free(he);
+		hash_entry_free(ht, he);
 	}
 
-	unlock_hash(ht);
-
-	if (he && !(ht->flags & CFUHASH_FROZEN) &&
+	/* no shrinking in the middle of an incremental rehash, that would
+	   finish it here */
+	if (found && !ht->old_num_buckets && !(ht->flags & CFUHASH_FROZEN) &&
 		!( (ht->flags & CFUHASH_FROZEN_UNTIL_GROWS) && !ht->resized_count) ) {
-		if ( (float)ht->entries/(float)ht->num_buckets < ht->low ) cfuhash_rehash(ht);
+		if ( (float)ht->entries/(float)ht->num_buckets < ht->low )
+			hash_rehash(ht, ht->flags & CFUHASH_INCREMENTAL_REHASH);
 	}
 
+	unlock_hash(ht);
+
 
 	return r;
 }
@@ -562,13 +1442,116 @@ cfuhash_delete(cfuhash_table_t *ht, const char *key) {
 	return cfuhash_delete_data(ht, key, -1);
 }
 
+/* moves the iterator to the first entry at or after its position, and
+   prefetches it so that it's likely in the cache when it's returned.
+   During an incremental rehash, the entries still in the old storage
+   come first, then the ones already moved. */
+static CFU_INLINE void
+iter_seek(cfuhash_iter_t *iter) {
+	cfuhash_table_t *ht = iter->ht;
+
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) {
+		if (iter->old) {
+			/* the moved slots are marked deleted */
+			while (iter->index < ht->old_num_buckets && ht->old_ctrl[iter->index] < 0) iter->index++;
+			if (iter->index < ht->old_num_buckets) {
+				__builtin_prefetch(ht->old_slots[iter->index].data);
+				return;
+			}
+			iter->old = 0;
+			iter->index = 0;
+		}
+		while (iter->index < ht->num_buckets && ht->ctrl[iter->index] < 0) iter->index++;
+		if (iter->index < ht->num_buckets) __builtin_prefetch(ht->slots[iter->index].data);
+		return;
+	}
+	if (iter->old) {
+		while (!iter->entry && iter->index < ht->old_num_buckets) {
+			iter->entry = ht->old_buckets[iter->index++];
+		}
+		if (iter->entry) {
+			__builtin_prefetch(iter->entry);
+			return;
+		}
+		iter->old = 0;
+		iter->index = 0;
+	}
+	while (!iter->entry && iter->index < ht->num_buckets) {
+		iter->entry = ht->buckets[iter->index++];
+	}
+	if (iter->entry) __builtin_prefetch(iter->entry);
+}
+
+/* starts an iteration, the hash must be locked */
+static void
+iter_start(cfuhash_iter_t *iter, cfuhash_table_t *ht) {
+	iter->ht = ht;
+	iter->entry = NULL;
+	iter->old = 0;
+	iter->index = 0;
+	if (!ht) return;
+	if (ht->old_num_buckets) {
+		/* the old chained buckets before migrate_index are already moved */
+		iter->old = 1;
+		if (!(ht->flags & CFUHASH_OPEN_ADDRESSING)) iter->index = ht->migrate_index;
+	}
+	iter_seek(iter);
+}
+
+void
+cfuhash_iter_init(cfuhash_iter_t *iter, cfuhash_table_t *ht) {
+	lock_hash(ht);
+	iter_start(iter, ht);
+	unlock_hash(ht);
+}
+
+int
+cfuhash_iter_next(cfuhash_iter_t *iter, void **key, size_t *key_size, void **data,
+	size_t *data_size) {
+	cfuhash_table_t *ht = iter->ht;
+	void *k, *d;
+	size_t ks, ds;
+
+	if (!ht) return 0;
+
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) {
+		cfuhash_slot *slot;
+		if (iter->old) {
+			slot = &ht->old_slots[iter->index++];
+		} else {
+			if (iter->index >= ht->num_buckets) return 0;
+			slot = &ht->slots[iter->index++];
+		}
+		k = slot->key;
+		ks = slot->key_size;
+		d = slot->data;
+		ds = slot->data_size;
+	} else {
+		cfuhash_entry *he = iter->entry;
+		if (!he) return 0;
+		/* move on before returning the entry, so that it can be deleted */
+		iter->entry = he->next;
+		k = he->key;
+		ks = he->key_size;
+		d = he->data;
+		ds = he->data_size;
+	}
+	iter_seek(iter);
+
+	if (key) *key = k;
+	if (key_size) *key_size = ks;
+	if (data) *data = d;
+	if (data_size) *data_size = ds;
+	return 1;
+}
+
 void **
 cfuhash_keys_data(cfuhash_table_t *ht, size_t *num_keys, size_t **key_sizes, int fast) {
 	size_t *key_lengths = NULL;
 	void **keys = NULL;
-	cfuhash_entry *he = NULL;
-	size_t bucket = 0;
-	size_t entry_index = 0;
+	cfuhash_iter_t iter;
+	void *key;
+	size_t key_size;
 	size_t key_count = 0;
 
 	if (!ht) {
@@ -582,22 +1565,16 @@ cfuhash_keys_data(cfuhash_table_t *ht, size_t *num_keys, size_t **key_sizes, int
 	if (key_sizes) key_lengths = calloc(ht->entries, sizeof(size_t));
 	keys = calloc(ht->entries, sizeof(void *));
 
-	for (bucket = 0; bucket < ht->num_buckets; bucket++) {
-		if ( (he = ht->buckets[bucket]) ) {
-			for (; he; he = he->next, entry_index++) {
-				if (entry_index >= ht->entries) break; /* this should never happen */
-
-				if (fast) {
-					keys[entry_index] = he->key;
-				} else {
-					keys[entry_index] = calloc(he->key_size, 1);
-					memcpy(keys[entry_index], he->key, he->key_size);
-				}
-				key_count++;
-
-				if (key_lengths) key_lengths[entry_index] = he->key_size;
-			}
+	iter_start(&iter, ht);
+	while (key_count < ht->entries && cfuhash_iter_next(&iter, &key, &key_size, NULL, NULL)) {
+		if (fast) {
+			keys[key_count] = key;
+		} else {
+			keys[key_count] = calloc(key_size, 1);
+			memcpy(keys[key_count], key, key_size);
 		}
+		if (key_lengths) key_lengths[key_count] = key_size;
+		key_count++;
 	}
 
 	if (! (ht->flags & CFUHASH_NO_LOCKING) ) unlock_hash(ht);
@@ -617,52 +1594,34 @@ int
 cfuhash_each_data(cfuhash_table_t *ht, void **key, size_t *key_size, void **data,
 	size_t *data_size) {
 
-	ht->each_bucket_index = -1;
-	ht->each_chain_entry = NULL;
-
+	cfuhash_iter_init(&ht->each_iter, ht);
 	return cfuhash_next_data(ht, key, key_size, data, data_size);
 }
 
 int
 cfuhash_next_data(cfuhash_table_t *ht, void **key, size_t *key_size, void **data,
 	size_t *data_size) {
-
-	if (ht->each_chain_entry && ht->each_chain_entry->next) {
-		ht->each_chain_entry = ht->each_chain_entry->next;
-	} else {
-		ht->each_chain_entry = NULL;
-		ht->each_bucket_index++;
-		for (; ht->each_bucket_index < ht->num_buckets; ht->each_bucket_index++) {
-			if (ht->buckets[ht->each_bucket_index]) {
-				ht->each_chain_entry = ht->buckets[ht->each_bucket_index];
-				break;
-			}
-		}
-	}
-
-	if (ht->each_chain_entry) {
-		*key = ht->each_chain_entry->key;
-		*key_size = ht->each_chain_entry->key_size;
-		*data = ht->each_chain_entry->data;
-		if (data_size) *data_size = ht->each_chain_entry->data_size;
-		return 1;
-	}
-
-	return 0;
+	return cfuhash_iter_next(&ht->each_iter, key, key_size, data, data_size);
 }
 
 static void
-_cfuhash_destroy_entry(cfuhash_table_t *ht, cfuhash_entry *he, cfuhash_free_fn_t ff) {
+_cfuhash_destroy_key_data(cfuhash_table_t *ht, void *key, size_t key_size, void *data,
+	cfuhash_free_fn_t ff) {
 	if (ff) {
-		ff(he->data);
+		ff(data);
 	} else {
-		if (ht->free_fn) ht->free_fn(he->data);
+		if (ht->free_fn) ht->free_fn(data);
 		else {
-			if (ht->flags & CFUHASH_FREE_DATA) free(he->data);
+			if (ht->flags & CFUHASH_FREE_DATA) free(data);
 		}
 	}
-	if ( !(ht->flags & CFUHASH_NOCOPY_KEYS) ) free(he->key);
-	free(he);
+	hash_key_free(ht, key, key_size);
+}
+
+static void
+_cfuhash_destroy_entry(cfuhash_table_t *ht, cfuhash_entry *he, cfuhash_free_fn_t ff) {
+	_cfuhash_destroy_key_data(ht, he->key, he->key_size, he->data, ff);
+	hash_entry_free(ht, he);
 }
 
 size_t
@@ -678,6 +1637,21 @@ cfuhash_foreach_remove(cfuhash_table_t *ht, cfuhash_remove_fn_t r_fn, cfuhash_fr
 	if (!ht) return 0;
 
 	lock_hash(ht);
+	hash_finish_migration(ht);
+
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) {
+		for (hv = 0; hv < ht->num_buckets; hv++) {
+			cfuhash_slot *slot = &ht->slots[hv];
+			if (ht->ctrl[hv] < 0) continue;
+			if (r_fn(slot->key, slot->key_size, slot->data, slot->data_size, arg)) {
+				num_removed++;
+				_cfuhash_destroy_key_data(ht, slot->key, slot->key_size, slot->data, ff);
+				oa_erase(ht, hv);
+			}
+		}
+		unlock_hash(ht);
+		return num_removed;
+	}
 
 	buckets = ht->buckets;
 	num_buckets = ht->num_buckets;
@@ -695,7 +1669,7 @@ cfuhash_foreach_remove(cfuhash_table_t *ht, cfuhash_remove_fn_t r_fn, cfuhash_fr
 					entry = prev->next;
 				} else {
 					buckets[hv] = entry->next;
-					_cfuhash_destroy_entry(ht, entry, NULL);
+					_cfuhash_destroy_entry(ht, entry, ff);
 					entry = buckets[hv];
 				}
 			} else {
@@ -712,26 +1686,21 @@ cfuhash_foreach_remove(cfuhash_table_t *ht, cfuhash_remove_fn_t r_fn, cfuhash_fr
 
 size_t
 cfuhash_foreach(cfuhash_table_t *ht, cfuhash_foreach_fn_t fe_fn, void *arg) {
-	cfuhash_entry *entry = NULL;
-	size_t hv = 0;
+	cfuhash_iter_t iter;
+	void *key, *data;
+	size_t key_size, data_size;
 	size_t num_accessed = 0;
-	cfuhash_entry **buckets = NULL;
-	size_t num_buckets = 0;
 	int rv = 0;
 
 	if (!ht) return 0;
 
 	lock_hash(ht);
 
-	buckets = ht->buckets;
-	num_buckets = ht->num_buckets;
-	for (hv = 0; hv < num_buckets && !rv; hv++) {
-		entry = buckets[hv];
-
-		for (; entry && !rv; entry = entry->next) {
-			num_accessed++;
-			rv = fe_fn(entry->key, entry->key_size, entry->data, entry->data_size, arg);
-		}
+	/* the iterator prefetches the next entry while fe_fn runs */
+	iter_start(&iter, ht);
+	while (!rv && cfuhash_iter_next(&iter, &key, &key_size, &data, &data_size)) {
+		num_accessed++;
+		rv = fe_fn(key, key_size, data, data_size, arg);
 	}
 
 	unlock_hash(ht);
@@ -757,7 +1726,18 @@ cfuhash_destroy_with_free_fn(cfuhash_table_t *ht, cfuhash_free_fn_t ff) {
 	if (!ht) return 0;
 
 	lock_hash(ht);
-	for (i = 0; i < ht->num_buckets; i++) {
+	hash_finish_migration(ht);
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) {
+		for (i = 0; i < ht->num_buckets; i++) {
+			if (ht->ctrl[i] >= 0) {
+				_cfuhash_destroy_key_data(ht, ht->slots[i].key, ht->slots[i].key_size,
+					ht->slots[i].data, ff);
+			}
+		}
+		free(ht->ctrl);
+		free(ht->slots);
+	}
+	for (i = 0; i < ht->num_buckets && ht->buckets; i++) {
 		if (ht->buckets[i]) {
 			cfuhash_entry *he = ht->buckets[i];
 			while (he) {
@@ -768,6 +1748,11 @@ cfuhash_destroy_with_free_fn(cfuhash_table_t *ht, cfuhash_free_fn_t ff) {
 		}
 	}
 	free(ht->buckets);
+	while (ht->chunks) {
+		cfuhash_entry_chunk *next = ht->chunks->next;
+		free(ht->chunks);
+		ht->chunks = next;
+	}
 	unlock_hash(ht);
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_destroy(&ht->mutex);
@@ -816,35 +1801,12 @@ cfuhash_pretty_print(cfuhash_table_t *ht, FILE *fp) {
 
 int
 cfuhash_rehash(cfuhash_table_t *ht) {
-	size_t new_size, i;
-	cfuhash_entry **new_buckets = NULL;
+	int rv;
 
 	lock_hash(ht);
-	new_size = hash_size(ht->entries * 2 / (ht->high + ht->low));
-	if (new_size == ht->num_buckets) {
-		unlock_hash(ht);
-		return 0;
-	}
-	new_buckets = calloc(new_size, sizeof(cfuhash_entry *));
-
-	for (i = 0; i < ht->num_buckets; i++) {
-		cfuhash_entry *he = ht->buckets[i];
-		while (he) {
-			cfuhash_entry *nhe = he->next;
-			unsigned int hv = hash_value(ht, he->key, he->key_size, new_size);
-			he->next = new_buckets[hv];
-			new_buckets[hv] = he;
-			he = nhe;
-		}
-	}
-
-	ht->num_buckets = new_size;
-	free(ht->buckets);
-	ht->buckets = new_buckets;
-	ht->resized_count++;
-
+	rv = hash_rehash(ht, 0);
 	unlock_hash(ht);
-	return 1;
+	return rv;
 }
 
 size_t
@@ -868,12 +1830,122 @@ cfuhash_num_buckets_used(cfuhash_table_t *ht) {
 
 	lock_hash(ht);
 
-	for (i = 0; i < ht->num_buckets; i++) {
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) {
+		/* every full slot is a bucket of its own */
+		count = ht->entries;
+	}
+	for (i = 0; i < ht->num_buckets && ht->buckets; i++) {
 		if (ht->buckets[i]) count++;
 	}
+	/* the old chained buckets that haven't been moved yet */
+	for (i = ht->migrate_index; i < ht->old_num_buckets && ht->old_buckets; i++) {
+		if (ht->old_buckets[i]) count++;
+	}
 	unlock_hash(ht);
 	return count;
 }
+
+/* bytes allocated for the storage, the entries and the copied keys */
+static size_t
+hash_memory(cfuhash_table_t *ht) {
+	size_t memory = sizeof(cfuhash_table_t) + ht->key_memory;
+
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) {
+		return memory + (ht->num_buckets + ht->old_num_buckets) *
+			(sizeof(cfuhash_slot) + sizeof(signed char));
+	}
+	return memory + (ht->num_buckets + ht->old_num_buckets) * sizeof(cfuhash_entry *) +
+		ht->chunk_entries * sizeof(cfuhash_entry) + ht->num_chunks * sizeof(cfuhash_entry_chunk);
+}
+
+size_t
+cfuhash_memory(cfuhash_table_t *ht) {
+	size_t memory;
+
+	if (!ht) return 0;
+	lock_hash(ht);
+	memory = hash_memory(ht);
+	unlock_hash(ht);
+	return memory;
+}
+
+/* adds the probe lengths of one slot array to the stats.
+   An entry in the old slots of an incremental rehash counts the probes
+   of the old slots only. */
+static void
+oa_get_stats(cfuhash_table_t *ht, signed char *ctrl, cfuhash_slot *slots, size_t num_slots,
+	cfuhash_stats_t *stats, size_t *total_probes) {
+	size_t group_mask = num_slots / OA_GROUP_SIZE - 1;
+	size_t i;
+
+	for (i = 0; i < num_slots; i++) {
+		/* follow the probe sequence of the key to the group it's in */
+		cfuhash_slot *slot = &slots[i];
+		size_t group, step = 0;
+		if (ctrl[i] < 0) continue;
+		group = oa_h1(hash_full(ht, slot->key, slot->key_size)) & group_mask;
+		while (group != i / OA_GROUP_SIZE) group = (group + ++step) & group_mask;
+		*total_probes += step + 1;
+		if (step + 1 > stats->max_probe) stats->max_probe = step + 1;
+		stats->histogram[step < CFUHASH_STATS_HISTOGRAM_SIZE ? step :
+			CFUHASH_STATS_HISTOGRAM_SIZE - 1]++;
+	}
+}
+
+/* adds the chains of buckets [start, end) to the stats */
+static void
+chain_get_stats(cfuhash_entry **buckets, size_t start, size_t end, cfuhash_stats_t *stats,
+	size_t *total_probes) {
+	size_t i;
+
+	for (i = start; i < end; i++) {
+		cfuhash_entry *he;
+		size_t length = 0;
+		for (he = buckets[i]; he; he = he->next) {
+			/* finding the entry takes as many comparisons as its position */
+			length++;
+			*total_probes += length;
+		}
+		if (length) stats->buckets_used++;
+		if (length > stats->max_probe) stats->max_probe = length;
+		stats->histogram[length < CFUHASH_STATS_HISTOGRAM_SIZE ? length :
+			CFUHASH_STATS_HISTOGRAM_SIZE - 1]++;
+	}
+}
+
+int
+cfuhash_get_stats(cfuhash_table_t *ht, cfuhash_stats_t *stats) {
+	size_t total_probes = 0;
+
+	if (!ht) return 0;
+
+	memset(stats, 0, sizeof(cfuhash_stats_t));
+	lock_hash(ht);
+
+	stats->entries = ht->entries;
+	stats->buckets = ht->num_buckets;
+	stats->old_buckets = ht->old_num_buckets;
+	stats->load_factor = (double)ht->entries / (double)ht->num_buckets;
+	stats->rehash_count = ht->resized_count;
+	stats->rehash_ns = ht->rehash_ns;
+	stats->memory = hash_memory(ht);
+
+	if (ht->flags & CFUHASH_OPEN_ADDRESSING) {
+		stats->buckets_used = ht->entries;
+		oa_get_stats(ht, ht->ctrl, ht->slots, ht->num_buckets, stats, &total_probes);
+		if (ht->old_num_buckets)
+			oa_get_stats(ht, ht->old_ctrl, ht->old_slots, ht->old_num_buckets, stats, &total_probes);
+	} else {
+		chain_get_stats(ht->buckets, 0, ht->num_buckets, stats, &total_probes);
+		if (ht->old_num_buckets)
+			chain_get_stats(ht->old_buckets, ht->migrate_index, ht->old_num_buckets, stats, &total_probes);
+	}
+	if (ht->entries) stats->avg_probe = (double)total_probes / (double)ht->entries;
+	unlock_hash(ht);
+
+	return 1;
+}
+
 /*
 char *
 cfuhash_bencode_strings(cfuhash_table_t *ht) {
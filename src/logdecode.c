@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "logformat.h"
+#include "timecache.h"
+#include "flightrec.h"
+#include "metrics.h"
+
+// turns a binary log file (see logformat.h) back into the text log format,
+// or with -f prints a flight recorder dump (see flightrec.h)
+
+static const char *level_names[] = { "[DEBUG]", "[INFO]", "[WARN]", "[ERROR]" };
+
+// the format strings of the current session, by id
+#define LOGDECODE_MAX_FORMATS (1 << 20)
+static char **formats = NULL;
+static size_t formats_size = 0;
+
+static FILE *input;
+static long offset = 0;
+
+static int read_bytes(void *buf, size_t size) {
+    if (fread(buf, 1, size, input) != size) {
+        return 0;
+    }
+    offset += size;
+    return 1;
+}
+
+static void reset_formats() {
+    for (size_t i = 0; i < formats_size; i++) {
+        free(formats[i]);
+        formats[i] = NULL;
+    }
+}
+
+static int define_format(uint32_t id, char *format) {
+    // ids are given out one by one, a huge one means the file is broken
+    if (id > LOGDECODE_MAX_FORMATS) {
+        free(format);
+        return 0;
+    }
+    if (id >= formats_size) {
+        size_t new_size = formats_size ? formats_size : 64;
+        while (new_size <= id) {
+            new_size *= 2;
+        }
+        char **new_formats = realloc(formats, new_size * sizeof(char *));
+        if (!new_formats) {
+            free(format);
+            return 0;
+        }
+        memset(new_formats + formats_size, 0, (new_size - formats_size) * sizeof(char *));
+        formats = new_formats;
+        formats_size = new_size;
+    }
+    free(formats[id]);
+    formats[id] = format;
+    return 1;
+}
+
+// prints a conversion with the given value and the * arguments before it
+#define PRINT_ARG(spec, stars, star, value) \
+    ((stars) == 0 ? printf(spec, value) : \
+     (stars) == 1 ? printf(spec, star[0], value) : printf(spec, star[0], star[1], value))
+
+// prints the format with the packed arguments. if the arguments run out,
+// the rest of the format is printed as it is
+static void render(const char *format, const char *args, size_t len) {
+    const char *rest = format;
+    size_t pos = 0;
+    for (;;) {
+        logformat_piece_t piece;
+        const char *next = logformat_next(rest, &piece);
+        if (piece.type == LOGFORMAT_END) {
+            return;
+        }
+        if (piece.type == LOGFORMAT_LITERAL) {
+            if (piece.start[0] == '%') {
+                // %% and the text after it
+                putchar('%');
+                fwrite(piece.start + 2, 1, piece.length - 2, stdout);
+            } else {
+                fwrite(piece.start, 1, piece.length, stdout);
+            }
+            rest = next;
+            continue;
+        }
+
+        char spec[32];
+        int star[2];
+        int64_t integer;
+        if (piece.type == LOGFORMAT_INVALID || piece.length >= sizeof(spec) || piece.stars > 2) {
+            break;
+        }
+        memcpy(spec, piece.start, piece.length);
+        spec[piece.length] = '\0';
+        int missing = 0;
+        for (int i = 0; i < piece.stars; i++) {
+            if (pos + sizeof(integer) > len) {
+                missing = 1;
+                break;
+            }
+            memcpy(&integer, args + pos, sizeof(integer));
+            pos += sizeof(integer);
+            star[i] = (int)integer;
+        }
+        if (missing) {
+            break;
+        }
+
+        if (piece.type == LOGFORMAT_STRING) {
+            uint16_t str_len;
+            char str[1024];
+            if (pos + sizeof(str_len) > len) {
+                break;
+            }
+            memcpy(&str_len, args + pos, sizeof(str_len));
+            pos += sizeof(str_len);
+            if (pos + str_len > len || str_len >= sizeof(str)) {
+                break;
+            }
+            memcpy(str, args + pos, str_len);
+            str[str_len] = '\0';
+            pos += str_len;
+            PRINT_ARG(spec, piece.stars, star, str);
+        } else {
+            if (pos + sizeof(integer) > len) {
+                break;
+            }
+            if (piece.type == LOGFORMAT_DOUBLE) {
+                double d;
+                memcpy(&d, args + pos, sizeof(d));
+                pos += sizeof(d);
+                PRINT_ARG(spec, piece.stars, star, d);
+            } else {
+                memcpy(&integer, args + pos, sizeof(integer));
+                pos += sizeof(integer);
+                switch (piece.type) {
+                case LOGFORMAT_INT:
+                    PRINT_ARG(spec, piece.stars, star, (int)integer);
+                    break;
+                case LOGFORMAT_LONG:
+                    PRINT_ARG(spec, piece.stars, star, (long)integer);
+                    break;
+                case LOGFORMAT_LONG_LONG:
+                    PRINT_ARG(spec, piece.stars, star, (long long)integer);
+                    break;
+                case LOGFORMAT_SIZE:
+                    PRINT_ARG(spec, piece.stars, star, (size_t)integer);
+                    break;
+                default:
+                    PRINT_ARG(spec, piece.stars, star, (void *)(intptr_t)integer);
+                    break;
+                }
+            }
+        }
+        rest = next;
+    }
+    fputs(rest, stdout);
+}
+
+static void print_prefix(int64_t seconds, uint8_t level) {
+    printf("%s %s ", timecache_hms((time_t)seconds), level < 4 ? level_names[level] : "[?]");
+}
+
+static int decode_record(int type) {
+    uint32_t id;
+    uint16_t len;
+    int64_t seconds;
+    switch (type) {
+    case LOGFORMAT_SESSION: {
+        char magic[LOGFORMAT_MAGIC_LENGTH];
+        if (!read_bytes(magic, sizeof(magic)) || memcmp(magic, LOGFORMAT_MAGIC, sizeof(magic)) != 0) {
+            return 0;
+        }
+        reset_formats();
+        return 1;
+    }
+    case LOGFORMAT_DEFINE: {
+        if (!read_bytes(&id, sizeof(id)) || !read_bytes(&len, sizeof(len))) {
+            return 0;
+        }
+        char *format = malloc(len + 1);
+        if (!format || !read_bytes(format, len)) {
+            free(format);
+            return 0;
+        }
+        format[len] = '\0';
+        return define_format(id, format);
+    }
+    case LOGFORMAT_RECORD: {
+        uint8_t level;
+        char args[UINT16_MAX];
+        if (!read_bytes(&id, sizeof(id)) || !read_bytes(&level, sizeof(level)) ||
+            !read_bytes(&seconds, sizeof(seconds)) || !read_bytes(&len, sizeof(len)) ||
+            !read_bytes(args, len)) {
+            return 0;
+        }
+        print_prefix(seconds, level);
+        if (id < formats_size && formats[id]) {
+            render(formats[id], args, len);
+        } else {
+            printf("<unknown format %u>\n", id);
+        }
+        return 1;
+    }
+    case LOGFORMAT_DROPPED: {
+        uint64_t dropped;
+        if (!read_bytes(&seconds, sizeof(seconds)) || !read_bytes(&dropped, sizeof(dropped))) {
+            return 0;
+        }
+        print_prefix(seconds, 2);
+        printf("%llu log messages dropped, the log writer couldn't keep up\n", (unsigned long long)dropped);
+        return 1;
+    }
+    }
+    return 0;
+}
+
+static const char *conn_type_names[] = { "server", "client", "admin" };
+
+// prints the events of a flight recorder dump, with their time relative to
+// the dump
+static int decode_flight() {
+    flightrec_header_t header;
+    if (!read_bytes(&header, sizeof(header)) ||
+        memcmp(header.magic, FLIGHTREC_MAGIC, FLIGHTREC_MAGIC_LENGTH) != 0 ||
+        header.record_size != sizeof(flightrec_record_t)) {
+        fprintf(stderr, "Not a flight recorder dump\n");
+        return 2;
+    }
+    printf("%u of %llu events, dumped on signal %d\n", header.records,
+           (unsigned long long)header.total, header.signal);
+    for (uint32_t i = 0; i < header.records; i++) {
+        flightrec_record_t record;
+        if (!read_bytes(&record, sizeof(record))) {
+            fflush(stdout);
+            fprintf(stderr, "Truncated dump at offset %ld\n", offset);
+            return 2;
+        }
+        printf("%12.6f s fd %-5d %-11s", ((double)record.time - (double)header.time) / 1e9, record.fd,
+               flightrec_event_name(record.event));
+        switch (record.event) {
+        case FLIGHTREC_ACCEPT:
+        case FLIGHTREC_CLOSE:
+            printf(" %s", record.conn_type < 3 ? conn_type_names[record.conn_type] : "?");
+            break;
+        case FLIGHTREC_READ:
+            printf(" %u bytes", record.size);
+            break;
+        case FLIGHTREC_PACKET:
+            printf(" %s %u bytes %u us",
+                   record.command < METRICS_COMMANDS ? metrics_command_name(record.command) : "?",
+                   record.size, record.value);
+            break;
+        case FLIGHTREC_SEND:
+            printf(" %u bytes in %u writes", record.size, record.value);
+            break;
+        case FLIGHTREC_SEND_FAILED:
+            printf(" %u bytes: %s", record.size, record.value ? strerror(record.value) : "connection closed");
+            break;
+        case FLIGHTREC_STALL:
+            printf(" %.1f ms with %u events", record.value / 1e3, record.size);
+            if (record.command < METRICS_COMMANDS) {
+                printf(", slowest packet %s", metrics_command_name(record.command));
+            }
+            break;
+        }
+        putchar('\n');
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int flight = argc > 1 && strcmp(argv[1], "-f") == 0;
+    if (flight) {
+        argc--;
+        argv++;
+    }
+    if (argc > 2) {
+        printf("Usage: logdecode [binary_log_file]\n"
+               "       logdecode -f [flight_recorder_dump]\n");
+        return 1;
+    }
+    if (argc == 2) {
+        input = fopen(argv[1], "rb");
+        if (!input) {
+            perror("Failed to open the log file");
+            return 1;
+        }
+    } else {
+        input = stdin;
+    }
+    if (flight) {
+        return decode_flight();
+    }
+
+    int type;
+    while ((type = fgetc(input)) != EOF) {
+        long record_offset = offset++;
+        if (!decode_record(type)) {
+            fflush(stdout);
+            fprintf(stderr, "Broken or truncated record at offset %ld\n", record_offset);
+            return 2;
+        }
+    }
+    return 0;
+}
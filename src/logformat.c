@@ -0,0 +1,96 @@
+#include <string.h>
+#include "logformat.h"
+
+const char *logformat_next(const char *format, logformat_piece_t *piece) {
+    const char *p = format;
+    piece->start = format;
+    piece->stars = 0;
+    piece->precision = -1;
+    if (*p == '\0') {
+        piece->type = LOGFORMAT_END;
+        piece->length = 0;
+        return p;
+    }
+    if (*p != '%' || p[1] == '%') {
+        // text up to the next conversion, %% on its own
+        p += *p == '%' ? 2 : 1;
+        while (*p && *p != '%') {
+            p++;
+        }
+        piece->type = LOGFORMAT_LITERAL;
+        piece->length = p - format;
+        return p;
+    }
+
+    p++;
+    while (*p && strchr("-+ #0'", *p)) {
+        p++;
+    }
+    // width and precision
+    for (int i = 0; i < 2; i++) {
+        if (i == 1) {
+            if (*p != '.') {
+                break;
+            }
+            p++;
+        }
+        int value = 0;
+        if (*p == '*') {
+            piece->stars++;
+            value = -2;
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9') {
+                value = value * 10 + (*p - '0');
+                p++;
+            }
+        }
+        if (i == 1) {
+            piece->precision = value;
+        }
+    }
+
+    logformat_type type = LOGFORMAT_INT;
+    if (*p == 'h') {
+        p += p[1] == 'h' ? 2 : 1;
+    } else if (*p == 'l' && p[1] == 'l') {
+        type = LOGFORMAT_LONG_LONG;
+        p += 2;
+    } else if (*p == 'l') {
+        type = LOGFORMAT_LONG;
+        p++;
+    } else if (*p == 'j') {
+        type = LOGFORMAT_LONG_LONG;
+        p++;
+    } else if (*p == 'z' || *p == 't') {
+        type = LOGFORMAT_SIZE;
+        p++;
+    } else if (*p == 'L') {
+        type = LOGFORMAT_INVALID;
+        p++;
+    }
+
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        type = type == LOGFORMAT_INVALID ? type : LOGFORMAT_DOUBLE;
+        break;
+    case 's':
+        // no wide strings
+        type = type == LOGFORMAT_INT ? LOGFORMAT_STRING : LOGFORMAT_INVALID;
+        break;
+    case 'p':
+        type = LOGFORMAT_POINTER;
+        break;
+    default:
+        type = LOGFORMAT_INVALID;
+        break;
+    }
+    if (*p) {
+        p++;
+    }
+    piece->type = type;
+    piece->length = p - format;
+    return p;
+}
@@ -5,13 +5,82 @@
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
 #include "logging.h"
+#include "timecache.h"
+#include "logformat.h"
+#include "typed_hash.h"
 
 int initialized = 0;
 log_level logging_level;
 FILE *log_target;
 char *target_filename = NULL;
 
+// log records waiting for the writer thread. the ring is a bounded queue
+// where every slot has a sequence number telling whether it's free for
+// the producer at that position or filled for the consumer, so producers
+// only need a compare-and-swap to claim a slot and never take a lock
+#define LOG_RING_SIZE 2048 // must be a power of 2
+#define LOG_RECORD_SIZE 512
+// the writer wakes up on its own this often, or when this many records
+// have been queued
+#define LOG_WRITER_INTERVAL_MS 50
+#define LOG_WAKE_BATCH (LOG_RING_SIZE / 4) // must be a power of 2
+
+typedef struct {
+    uint64_t sequence;
+    time_t time;
+    log_level level;
+    const char *format; // set in the binary format only
+    size_t len;
+    char text[LOG_RECORD_SIZE]; // the message, or the packed arguments of format
+} log_record_t;
+
+static log_record_t log_ring[LOG_RING_SIZE];
+static uint64_t log_enqueue_pos;
+static uint64_t log_dequeue_pos; // only used by the writer thread
+static uint64_t log_dropped;
+
+static int writer_running = 0;
+static int writer_stopping = 0;
+static int writer_waiting = 0;
+static int writer_reopen = 0;
+static pthread_t writer_thread;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
+// the binary format, see logformat.h. format strings are given ids by
+// their address as they are first written, only the writer touches these
+static int log_binary = 0;
+
+static inline int format_equal(const char *a, const char *b) {
+    return a == b;
+}
+
+TYPED_HASH_DEFINE(format_table, const char *, uint32_t, typed_hash_pointer, format_equal)
+
+static format_table_t format_ids;
+static uint32_t next_format_id;
+
+// the argument types of a format string, cached per thread by its address
+// so the string is parsed only once
+#define LOG_MAX_ARGS 16
+#define LOG_FORMAT_CACHE_SIZE 64
+
+typedef struct {
+    const char *format;
+    int count;
+    uint8_t types[LOG_MAX_ARGS];
+    int8_t precision[LOG_MAX_ARGS]; // for strings: 1 if the * before it is the precision
+    int16_t fixed_precision[LOG_MAX_ARGS];
+} format_args_t;
+
+static __thread format_args_t format_args_cache[LOG_FORMAT_CACHE_SIZE];
+
+static const char *level_names[] = { "[DEBUG]", "[INFO]", "[WARN]", "[ERROR]" };
+
 int init_logger(log_level level, char *log_filename) {
     logging_level = level;
     initialized = 1;
@@ -29,63 +98,406 @@ int init_logger(log_level level, char *log_filename) {
     return 1;
 }
 
-void do_log(char *level, char *format_string, va_list args) {
-    time_t msg_time;
-    struct tm *tm_p;
-    msg_time = time(NULL);
-    tm_p = localtime(&msg_time);
-    fprintf(log_target, "%.2d:%.2d:%.2d %s ", tm_p->tm_hour, tm_p->tm_min, tm_p->tm_sec, level); 
-    vfprintf(log_target, format_string, args);
-    fflush(log_target);
+// writes "HH:MM:SS [LEVEL] " from the cached time string
+static void write_prefix(time_t msg_time, log_level level) {
+    char prefix[TIMECACHE_HMS_LENGTH + 10];
+    size_t level_length = strlen(level_names[level]);
+    memcpy(prefix, timecache_hms(msg_time), TIMECACHE_HMS_LENGTH);
+    prefix[TIMECACHE_HMS_LENGTH] = ' ';
+    memcpy(prefix + TIMECACHE_HMS_LENGTH + 1, level_names[level], level_length);
+    prefix[TIMECACHE_HMS_LENGTH + 1 + level_length] = ' ';
+    fwrite(prefix, 1, TIMECACHE_HMS_LENGTH + 2 + level_length, log_target);
 }
 
-void log_debug(char *format_string, ...) {
-    assert(initialized);
-    if (logging_level == DEBUG) {
-        va_list args;
-        va_start(args, format_string);
-        do_log("[DEBUG]", format_string, args);
-        va_end(args); 
+// starts a new session in the binary log, the format strings are
+// defined again before they are used
+static int start_session() {
+    format_table_destroy(&format_ids);
+    if (!format_table_init(&format_ids, 64)) {
+        return 0;
     }
+    next_format_id = 0;
+    fputc(LOGFORMAT_SESSION, log_target);
+    fwrite(LOGFORMAT_MAGIC, 1, LOGFORMAT_MAGIC_LENGTH, log_target);
+    return 1;
 }
 
-void log_info(char *format_string, ...) {
-    assert(initialized);
-    if (logging_level == DEBUG || logging_level == INFO) {
-        va_list args;
-        va_start(args, format_string);
-        do_log("[INFO]", format_string, args);
-        va_end(args); 
+static void reopen_target() {
+    // ignore the return value as we can't even log the error anywhere!
+    fclose(log_target);
+
+    log_target = fopen(target_filename, "a");
+    if (!log_target || (log_binary && !start_session())) {
+        // we can only exit, no way to write this error anywhere
+        exit(3);
+    }
+}
+
+static const format_args_t *get_format_args(const char *format) {
+    format_args_t *args = &format_args_cache[((uintptr_t)format >> 3) & (LOG_FORMAT_CACHE_SIZE - 1)];
+    if (args->format == format) {
+        return args;
+    }
+    logformat_piece_t piece;
+    const char *rest = format;
+    args->count = 0;
+    for (;;) {
+        rest = logformat_next(rest, &piece);
+        if (piece.type == LOGFORMAT_END || piece.type == LOGFORMAT_INVALID ||
+            args->count + piece.stars + 1 > LOG_MAX_ARGS) {
+            break;
+        }
+        if (piece.type == LOGFORMAT_LITERAL) {
+            continue;
+        }
+        for (int i = 0; i < piece.stars; i++) {
+            args->types[args->count++] = LOGFORMAT_INT;
+        }
+        args->precision[args->count] = piece.precision == -2;
+        args->fixed_precision[args->count] = piece.precision >= 0 && piece.precision < INT16_MAX ? piece.precision : -1;
+        args->types[args->count++] = piece.type;
+    }
+    args->format = format;
+    return args;
+}
+
+// packs the arguments as described in logformat.h, leaving out the ones
+// that don't fit
+static size_t pack_args(char *buf, const char *format, va_list args) {
+    const format_args_t *format_args = get_format_args(format);
+    size_t len = 0;
+    int last_int = -1;
+    for (int i = 0; i < format_args->count; i++) {
+        int64_t integer;
+        switch (format_args->types[i]) {
+        case LOGFORMAT_INT:
+            integer = last_int = va_arg(args, int);
+            break;
+        case LOGFORMAT_LONG:
+            integer = va_arg(args, long);
+            break;
+        case LOGFORMAT_LONG_LONG:
+            integer = va_arg(args, long long);
+            break;
+        case LOGFORMAT_SIZE:
+            integer = (int64_t)va_arg(args, size_t);
+            break;
+        case LOGFORMAT_POINTER:
+            integer = (int64_t)(intptr_t)va_arg(args, void *);
+            break;
+        case LOGFORMAT_DOUBLE: {
+            double d = va_arg(args, double);
+            if (len + sizeof(d) > LOG_RECORD_SIZE) {
+                return len;
+            }
+            memcpy(buf + len, &d, sizeof(d));
+            len += sizeof(d);
+            continue;
+        }
+        case LOGFORMAT_STRING: {
+            const char *str = va_arg(args, const char *);
+            if (!str) {
+                str = "(null)";
+            }
+            // with a precision the string doesn't need a null at the end
+            size_t max = LOG_RECORD_SIZE;
+            if (format_args->precision[i] && last_int >= 0) {
+                max = last_int;
+            } else if (format_args->fixed_precision[i] >= 0) {
+                max = format_args->fixed_precision[i];
+            }
+            size_t str_len = strnlen(str, max);
+            if (len + sizeof(uint16_t) > LOG_RECORD_SIZE) {
+                return len;
+            }
+            if (str_len > LOG_RECORD_SIZE - len - sizeof(uint16_t)) {
+                str_len = LOG_RECORD_SIZE - len - sizeof(uint16_t);
+            }
+            uint16_t str_len16 = str_len;
+            memcpy(buf + len, &str_len16, sizeof(str_len16));
+            memcpy(buf + len + sizeof(str_len16), str, str_len);
+            len += sizeof(str_len16) + str_len;
+            continue;
+        }
+        default:
+            return len;
+        }
+        if (len + sizeof(integer) > LOG_RECORD_SIZE) {
+            return len;
+        }
+        memcpy(buf + len, &integer, sizeof(integer));
+        len += sizeof(integer);
     }
+    return len;
 }
 
-void log_warn(char *format_string, ...) {
+// formats the message, or packs its arguments in the binary format
+static void fill_record(log_record_t *record, log_level level, char *format_string, va_list args) {
+    record->time = timecache_seconds();
+    record->level = level;
+    if (log_binary) {
+        record->format = format_string;
+        record->len = pack_args(record->text, format_string, args);
+        return;
+    }
+    int len = vsnprintf(record->text, LOG_RECORD_SIZE, format_string, args);
+    if (len < 0) {
+        len = 0;
+    } else if (len >= LOG_RECORD_SIZE) {
+        // cut short, but keep the line ending
+        len = LOG_RECORD_SIZE - 1;
+        record->text[len - 1] = '\n';
+    }
+    record->len = len;
+}
+
+static void write_binary(const log_record_t *record) {
+    char header[1 + sizeof(uint32_t) + 1 + sizeof(int64_t) + sizeof(uint16_t)];
+    int inserted;
+    uint32_t *id = format_table_insert(&format_ids, record->format, &inserted);
+    if (!id) {
+        // out of memory, nothing better to do than to lose the record
+        return;
+    }
+    if (inserted) {
+        *id = next_format_id++;
+        size_t format_len = strlen(record->format);
+        uint16_t format_len16 = format_len > UINT16_MAX ? UINT16_MAX : format_len;
+        header[0] = LOGFORMAT_DEFINE;
+        memcpy(header + 1, id, sizeof(uint32_t));
+        memcpy(header + 1 + sizeof(uint32_t), &format_len16, sizeof(uint16_t));
+        fwrite(header, 1, 1 + sizeof(uint32_t) + sizeof(uint16_t), log_target);
+        fwrite(record->format, 1, format_len16, log_target);
+    }
+    int64_t seconds = record->time;
+    uint16_t len = record->len;
+    char *p = header;
+    *p++ = LOGFORMAT_RECORD;
+    memcpy(p, id, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    *p++ = record->level;
+    memcpy(p, &seconds, sizeof(seconds));
+    p += sizeof(seconds);
+    memcpy(p, &len, sizeof(len));
+    fwrite(header, 1, sizeof(header), log_target);
+    fwrite(record->text, 1, record->len, log_target);
+}
+
+static void write_record(const log_record_t *record) {
+    if (log_binary) {
+        write_binary(record);
+        return;
+    }
+    write_prefix(record->time, record->level);
+    fwrite(record->text, 1, record->len, log_target);
+}
+
+static void write_dropped(uint64_t dropped) {
+    if (log_binary) {
+        char record[1 + sizeof(int64_t) + sizeof(uint64_t)];
+        int64_t seconds = timecache_seconds();
+        record[0] = LOGFORMAT_DROPPED;
+        memcpy(record + 1, &seconds, sizeof(seconds));
+        memcpy(record + 1 + sizeof(seconds), &dropped, sizeof(dropped));
+        fwrite(record, 1, sizeof(record), log_target);
+        return;
+    }
+    write_prefix(timecache_seconds(), WARN);
+    fprintf(log_target, "%llu log messages dropped, the log writer couldn't keep up\n",
+            (unsigned long long)dropped);
+}
+
+// claims the next free slot of the ring, returns NULL if the ring is full
+static log_record_t *ring_claim(uint64_t *pos_out) {
+    uint64_t pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        log_record_t *record = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos_out = pos;
+                return record;
+            }
+        } else if (diff < 0) {
+            // the writer hasn't consumed the record from one lap ago yet
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void wake_writer() {
+    if (__atomic_load_n(&writer_waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&writer_mutex);
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(&writer_mutex);
+    }
+}
+
+// formats a record into the ring. when the ring is full, debug and info
+// records are dropped and counted, warnings and errors wait for room
+static void queue_log(log_level level, char *format_string, va_list args) {
+    uint64_t pos;
+    log_record_t *record;
+    while ((record = ring_claim(&pos)) == NULL) {
+        if (level < WARN) {
+            __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        wake_writer();
+        sched_yield();
+    }
+    fill_record(record, level, format_string, args);
+    __atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+    // waking the writer costs a system call, so let records pile up for a
+    // batch unless they are important
+    if (level >= WARN || (pos & (LOG_WAKE_BATCH - 1)) == 0) {
+        wake_writer();
+    }
+}
+
+// writes out every record in the ring, returns the number written
+static size_t drain_ring() {
+    size_t written = 0;
+    for (;;) {
+        log_record_t *record = &log_ring[log_dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != log_dequeue_pos + 1) {
+            break;
+        }
+        write_record(record);
+        // hand the slot back to the producers for the next lap
+        __atomic_store_n(&record->sequence, log_dequeue_pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        log_dequeue_pos++;
+        written++;
+    }
+    return written;
+}
+
+static void *writer_main(void *arg) {
+    uint64_t dropped_reported = 0;
+    (void)arg;
+    for (;;) {
+        size_t written = drain_ring();
+        uint64_t dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+        if (dropped != dropped_reported) {
+            write_dropped(dropped - dropped_reported);
+            dropped_reported = dropped;
+            written++;
+        }
+        if (written) {
+            // one flush for the whole batch
+            fflush(log_target);
+            continue;
+        }
+        if (__atomic_load_n(&writer_reopen, __ATOMIC_ACQUIRE)) {
+            reopen_target();
+            __atomic_store_n(&writer_reopen, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (__atomic_load_n(&writer_stopping, __ATOMIC_ACQUIRE)) {
+            // the producers are done, so the ring was drained for good above
+            return NULL;
+        }
+        // nothing to do, sleep until a producer wakes us up or it's time to
+        // write what was queued meanwhile. the ring is checked again after
+        // announcing the wait so no important record waits for the timeout
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_WRITER_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&writer_mutex);
+        __atomic_store_n(&writer_waiting, 1, __ATOMIC_SEQ_CST);
+        log_record_t *next = &log_ring[log_dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&next->sequence, __ATOMIC_SEQ_CST) != log_dequeue_pos + 1 &&
+            !__atomic_load_n(&writer_stopping, __ATOMIC_SEQ_CST) &&
+            !__atomic_load_n(&writer_reopen, __ATOMIC_SEQ_CST)) {
+            pthread_cond_timedwait(&writer_cond, &writer_mutex, &deadline);
+        }
+        __atomic_store_n(&writer_waiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&writer_mutex);
+    }
+}
+
+int log_use_binary() {
+    assert(initialized && !writer_running);
+    if (!target_filename) {
+        return 0;
+    }
+    log_binary = 1;
+    return start_session();
+}
+
+int log_start_writer() {
     assert(initialized);
-    if (logging_level == DEBUG || logging_level == INFO || logging_level == WARN) {
-        va_list args;
-        va_start(args, format_string);
-        do_log("[WARN]", format_string, args);
-        va_end(args); 
+    if (writer_running) {
+        return 1;
     }
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+        log_ring[i].sequence = i;
+    }
+    log_enqueue_pos = 0;
+    log_dequeue_pos = 0;
+    writer_stopping = 0;
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        return 0;
+    }
+    __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+    atexit(log_stop_writer);
+    return 1;
 }
 
-void log_error(char *format_string, ...) {
+size_t log_memory() {
+    return sizeof(log_ring);
+}
+
+void log_stop_writer() {
+    if (!writer_running) {
+        return;
+    }
+    __atomic_store_n(&writer_stopping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&writer_mutex);
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_mutex);
+    pthread_join(writer_thread, NULL);
+    writer_running = 0;
+    fflush(log_target);
+}
+
+static void do_log(log_level level, char *format_string, va_list args) {
+    if (writer_running) {
+        queue_log(level, format_string, args);
+        return;
+    }
+    log_record_t record;
+    fill_record(&record, level, format_string, args);
+    write_record(&record);
+    fflush(log_target);
+}
+
+void log_write(log_level level, char *format_string, ...) {
     assert(initialized);
     va_list args;
     va_start(args, format_string);
-    do_log("[ERROR]", format_string, args);
-    va_end(args); 
+    do_log(level, format_string, args);
+    va_end(args);
 }
 
 void log_reopen() {
     assert(target_filename);
     log_info("Reopening the log file\n");
-    // ignore the return value as we can't even log the error anywhere!
-    fclose(log_target); 
-    
-    log_target = fopen(target_filename, "a");
-    if (!log_target) {
-        // we can only exit, no way to write this error anywhere
-        exit(3);
+    if (writer_running) {
+        // the writer thread owns the file, let it reopen it after
+        // writing out what was queued before this
+        __atomic_store_n(&writer_reopen, 1, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&writer_mutex);
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(&writer_mutex);
+        return;
     }
+    reopen_target();
 }
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "metrics.h"
+
+__thread metrics_shard_t *metrics_local_shard = NULL;
+int64_t metrics_gauges[METRIC_GAUGES];
+
+// all the shards ever created. shards are never freed, so the counts of
+// threads that have exited are still included
+static metrics_shard_t *shards = NULL;
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_shard_t dummy_shard;
+
+static const char *counter_names[] = {
+    [METRIC_BYTES_READ] = "bytes_read",
+    [METRIC_BYTES_WRITTEN] = "bytes_written",
+    [METRIC_PARTIAL_WRITES] = "partial_writes",
+    [METRIC_LOOP_STALLS] = "loop_stalls",
+    [METRIC_TCP_RETRANSMITS] = "tcp_retransmits",
+    [METRIC_PACKETS_IN] = "packets_in",
+    [METRIC_PACKETS_OUT] = "packets_out",
+};
+
+static const char *gauge_names[] = {
+    [METRIC_CLIENTS] = "clients",
+    [METRIC_SERVERS] = "servers",
+    [METRIC_CHANNELS] = "channels",
+};
+
+static const char *histogram_names[] = {
+    [METRIC_FANOUT] = "fanout",
+    [METRIC_SEND_BYTES] = "send_bytes",
+    [METRIC_LOOP_BUSY_NS] = "loop_busy_ns",
+    [METRIC_LOOP_EVENTS] = "loop_events",
+    [METRIC_TCP_RTT_US] = "tcp_rtt_us",
+    [METRIC_TCP_SEND_QUEUE] = "tcp_send_queue",
+    [METRIC_HANDLER_NS] = "handler_ns",
+};
+
+static const char *command_names[] = {
+    [METRICS_CMD_NICK] = "NICK",
+    [METRICS_CMD_MSG] = "MSG",
+    [METRICS_CMD_JOIN] = "JOIN",
+    [METRICS_CMD_LEAVE] = "LEAVE",
+    [METRICS_CMD_NAMES] = "NAMES",
+    [METRICS_CMD_KILL] = "KILL",
+    [METRICS_CMD_CMDREPLY] = "CMDREPLY",
+    [METRICS_CMD_OTHER] = "other",
+};
+
+metrics_shard_t *metrics_shard_create() {
+    metrics_shard_t *shard = calloc(1, sizeof(metrics_shard_t));
+    if (shard == NULL) {
+        // the numbers of the thread will be off, but it keeps running
+        metrics_local_shard = &dummy_shard;
+        return &dummy_shard;
+    }
+    pthread_mutex_lock(&shards_mutex);
+    shard->next = shards;
+    __atomic_store_n(&shards, shard, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&shards_mutex);
+    metrics_local_shard = shard;
+    return shard;
+}
+
+metrics_command metrics_command_of(const char *packet, size_t packet_len) {
+    size_t len = 0;
+    while (len < packet_len && packet[len] != ' ' && packet[len] != '\0') {
+        len++;
+    }
+    // a switch on the length first keeps this to a single compare
+    switch (len) {
+    case 3:
+        if (memcmp(packet, "MSG", 3) == 0) {
+            return METRICS_CMD_MSG;
+        }
+        break;
+    case 4:
+        if (memcmp(packet, "NICK", 4) == 0) {
+            return METRICS_CMD_NICK;
+        } else if (memcmp(packet, "JOIN", 4) == 0) {
+            return METRICS_CMD_JOIN;
+        } else if (memcmp(packet, "KILL", 4) == 0) {
+            return METRICS_CMD_KILL;
+        }
+        break;
+    case 5:
+        if (memcmp(packet, "LEAVE", 5) == 0) {
+            return METRICS_CMD_LEAVE;
+        } else if (memcmp(packet, "NAMES", 5) == 0) {
+            return METRICS_CMD_NAMES;
+        }
+        break;
+    case 8:
+        if (memcmp(packet, "CMDREPLY", 8) == 0) {
+            return METRICS_CMD_CMDREPLY;
+        }
+        break;
+    }
+    return METRICS_CMD_OTHER;
+}
+
+static void add_histogram(metrics_histogram_t *to, const metrics_histogram_t *from) {
+    to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        to->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_snapshot(metrics_snapshot_t *snapshot) {
+    memset(snapshot, 0, sizeof(metrics_snapshot_t));
+    metrics_shard_t *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+    for (; shard != NULL; shard = shard->next) {
+        for (int i = 0; i < METRIC_COUNTERS; i++) {
+            snapshot->counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+            add_histogram(&snapshot->histograms[i], &shard->histograms[i]);
+        }
+    }
+    for (int i = 0; i < METRIC_GAUGES; i++) {
+        snapshot->gauges[i] = __atomic_load_n(&metrics_gauges[i], __ATOMIC_RELAXED);
+    }
+}
+
+size_t metrics_memory() {
+    size_t memory = 0;
+    metrics_shard_t *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+    for (; shard != NULL; shard = shard->next) {
+        memory += sizeof(metrics_shard_t);
+    }
+    return memory;
+}
+
+metrics_command metrics_counter_command(metric_counter counter) {
+    if (counter >= METRIC_PACKETS_IN && counter < METRIC_PACKETS_OUT) {
+        return counter - METRIC_PACKETS_IN;
+    } else if (counter >= METRIC_PACKETS_OUT && counter < METRIC_COUNTERS) {
+        return counter - METRIC_PACKETS_OUT;
+    }
+    return METRICS_COMMANDS;
+}
+
+metrics_command metrics_histogram_command(metric_histogram histogram) {
+    if (histogram >= METRIC_HANDLER_NS && histogram < METRIC_HISTOGRAMS) {
+        return histogram - METRIC_HANDLER_NS;
+    }
+    return METRICS_COMMANDS;
+}
+
+const char *metrics_counter_name(metric_counter counter) {
+    metrics_command command = metrics_counter_command(counter);
+    if (command != METRICS_COMMANDS) {
+        return counter_names[counter - command];
+    }
+    return counter_names[counter];
+}
+
+const char *metrics_gauge_name(metric_gauge gauge) {
+    return gauge_names[gauge];
+}
+
+const char *metrics_histogram_name(metric_histogram histogram) {
+    metrics_command command = metrics_histogram_command(histogram);
+    if (command != METRICS_COMMANDS) {
+        return histogram_names[histogram - command];
+    }
+    return histogram_names[histogram];
+}
+
+const char *metrics_command_name(metrics_command command) {
+    return command_names[command];
+}
+
+uint64_t metrics_bucket_lower_bound(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return bucket;
+    }
+    int msb = bucket / METRICS_SUB_BUCKETS + 2;
+    uint64_t sub = bucket % METRICS_SUB_BUCKETS;
+    return (METRICS_SUB_BUCKETS + sub) << (msb - 3);
+}
+
+uint64_t metrics_percentile(const metrics_histogram_t *histogram, double fraction) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(fraction * histogram->count);
+    if (rank >= histogram->count) {
+        rank = histogram->count - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > rank) {
+            if (i == METRICS_BUCKETS - 1) {
+                return UINT64_MAX;
+            }
+            return metrics_bucket_lower_bound(i + 1) - 1;
+        }
+    }
+    return UINT64_MAX;
+}
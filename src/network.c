@@ -11,6 +11,12 @@
 #include "network.h"
 #include "packets.h"
 #include "logging.h"
+#include "metrics.h"
+#include "admin.h"
+#include "probes.h"
+#include "flightrec.h"
+#include "tcpstats.h"
+#include "daemon.h"
 
 int start_listening(uint16_t port);
 int make_nonblock(int);
@@ -22,6 +28,64 @@ int create_connect_fd();
 int connected = 0;
 int connect_fd = -1;
 
+// iterations of the event loop taking longer than this are logged, 0 disables
+static uint64_t stall_threshold_ns = NETWORK_DEFAULT_STALL_MS * 1000000ull;
+
+// the slowest step (handling one event, the timer...) and the slowest
+// packet of the current event loop iteration, for the stall log
+static struct {
+    const char *step;
+    int fd;
+    uint64_t step_ns;
+    metrics_command command;
+    uint64_t packet_ns;
+} slowest = { .step = "loop", .fd = -1 };
+
+void network_set_stall_threshold(int ms) {
+    stall_threshold_ns = ms * 1000000ull;
+}
+
+void network_note_packet(metrics_command command, uint64_t ns) {
+    if (ns > slowest.packet_ns) {
+        slowest.command = command;
+        slowest.packet_ns = ns;
+    }
+}
+
+// ends a step of the loop iteration that began at start, returns the time
+// it ended so the next step can begin from it without reading the clock
+static uint64_t loop_step(const char *step, int fd, uint64_t start) {
+    uint64_t now = metrics_now_ns();
+    if (now - start > slowest.step_ns) {
+        slowest.step = step;
+        slowest.fd = fd;
+        slowest.step_ns = now - start;
+    }
+    return now;
+}
+
+static void loop_finish(uint64_t woken, int events) {
+    uint64_t busy = metrics_now_ns() - woken;
+    metrics_record(METRIC_LOOP_BUSY_NS, busy);
+    metrics_record(METRIC_LOOP_EVENTS, events);
+    if (stall_threshold_ns > 0 && busy >= stall_threshold_ns) {
+        metrics_count(METRIC_LOOP_STALLS, 1);
+        flightrec_add(FLIGHTREC_STALL, slowest.fd, 0, slowest.packet_ns > 0 ? slowest.command : METRICS_COMMANDS,
+                      events, busy / 1000);
+        if (slowest.packet_ns > 0) {
+            log_warn("Event loop stalled for %.1f ms with %d events, slowest was %s fd %d (%.1f ms), "
+                     "slowest packet %s (%.1f ms)\n", busy / 1e6, events, slowest.step, slowest.fd,
+                     slowest.step_ns / 1e6, metrics_command_name(slowest.command), slowest.packet_ns / 1e6);
+        } else {
+            log_warn("Event loop stalled for %.1f ms with %d events, slowest was %s fd %d (%.1f ms)\n",
+                     busy / 1e6, events, slowest.step, slowest.fd, slowest.step_ns / 1e6);
+        }
+    }
+    memset(&slowest, 0, sizeof(slowest));
+    slowest.step = "loop";
+    slowest.fd = -1;
+}
+
 int network_start(uint16_t client_port, int socket_domain, int socket_protocol, void *connect_address, size_t connect_address_size, uint16_t server_port) {
     int client_listen_sock = start_listening(client_port);
     int server_listen_sock = start_listening(server_port);
@@ -95,18 +159,25 @@ client_t *client_create(int client_fd) {
         client->conn.fd = client_fd;
         client->conn.type = CLIENT;
         client->buf_used = 0;
+        flood_init(&client->flood);
+        metrics_gauge_add(METRIC_CLIENTS, 1);
         localnick_t *nick = malloc(sizeof(localnick_t));
         // TODO nick == NULL
         client->nick = nick;
         nick->client = client;
         nick->nick.type = LOCAL;
         memset(&nick->nick.nickname, 0, NICKNAME_LENGTH);
+        nick->nick.nickname_len = 0;
+        nick->nick.id = SYMBOL_NONE;
         memset(&nick->nick.channels, 0, USER_MAX_CHANNELS * sizeof(channel_t*));
     }
     return client;
 }
 
 void client_close(client_t *client) {
+    PROBE2(conn_free, client->conn.fd, CLIENT);
+    flightrec_add(FLIGHTREC_CLOSE, client->conn.fd, CLIENT, 0, 0, 0);
+    metrics_gauge_add(METRIC_CLIENTS, -1);
     close(client->conn.fd);
     free(client->nick);
     free(client);
@@ -124,12 +195,16 @@ server_t *server_create(int server_fd) {
         server->conn.fd = server_fd;
         server->conn.type = SERVER;
         server->buf_used = 0;
+        metrics_gauge_add(METRIC_SERVERS, 1);
     }
     return server;
 }
 
 void server_free(server_t *server) {
     handle_server_disconnect(server); 
+    PROBE2(conn_free, server->conn.fd, SERVER);
+    flightrec_add(FLIGHTREC_CLOSE, server->conn.fd, SERVER, 0, 0, 0);
+    metrics_gauge_add(METRIC_SERVERS, -1);
     close(server->conn.fd);
     if (server->conn.fd == connect_fd) {
         connected = 0;
@@ -171,7 +246,14 @@ int start_epoll(int client_listen_sock, int server_listen_sock, int socket_domai
         return -1;
     }
 
+    if (admin_start(epollfd) < 0) {
+        return -1;
+    }
+
     int connect_epoll_registered = 0;
+    // when the current iteration's epoll_wait returned, 0 before the first one
+    uint64_t woken = 0;
+    uint64_t step_start = 0;
     
     for (;;) {
         // if we have the address of another server to connect to
@@ -209,7 +291,10 @@ int start_epoll(int client_listen_sock, int server_listen_sock, int socket_domai
                     ev.events = EPOLLIN;
                     server_t *server = server_create(connect_fd); // TODO: server_create can return NULL
                     ev.data.ptr = server;
+                    // sending our whole state to the new link can take a while
+                    step_start = metrics_now_ns();
                     handle_server_connect(server);
+                    loop_step("server connect", connect_fd, step_start);
                     if (epoll_ctl(epollfd, EPOLL_CTL_ADD, connect_fd,
                                 &ev) == -1) {
                         log_error("Failed to call epoll_ctl for conn_sock! Error: %s\n", strerror(errno));
@@ -219,13 +304,46 @@ int start_epoll(int client_listen_sock, int server_listen_sock, int socket_domai
             }
         }
 
+        // closes admin connections, so it can't run while their events are being handled
+        admin_timer();
+        if (woken) {
+            loop_finish(woken, nfds);
+        }
         nfds = epoll_wait(epollfd, events, NETWORK_MAX_EVENTS, 1000);
-        if (nfds == -1) {
+        // checked after every wakeup, SIGTERM may have come in while we weren't waiting
+        if (daemon_stop) {
+            log_info("Got SIGTERM, stopping\n");
+            return 0;
+        }
+        if (nfds == -1 && errno == EINTR) {
+            // any other signal, e.g. SIGUSR1 dumping the flight recorder
+            nfds = 0;
+        } else if (nfds == -1) {
             log_error("Failed to call epoll_wait! Error: %s\n", strerror(errno));
             return -1;
         }
+        woken = metrics_now_ns();
+        flightrec_set_time(woken);
+        // epoll_wait times out every second, so this runs at least that often
+        handle_timer();
+        step_start = loop_step("timer", -1, woken);
+        tcpstats_timer();
+        step_start = loop_step("tcp sample", -1, step_start);
 
         for (int n = 0; n < nfds; ++n) {
+            // the handlers may free the connection, so look at it first
+            const char *step;
+            int fd = -1;
+            if (events[n].data.ptr == &client_listen_sock) {
+                step = "client accept";
+            } else if (events[n].data.ptr == &server_listen_sock) {
+                step = "server accept";
+            } else {
+                conn_t *conn = events[n].data.ptr;
+                step = conn->type == CLIENT ? "client" : conn->type == SERVER ? "server" : "admin";
+                fd = conn->fd;
+            }
+
             if (events[n].data.ptr == &client_listen_sock) {
                 // connecting client
                 if (accept_connection(epollfd, client_listen_sock, CLIENT) < 0) {
@@ -237,6 +355,9 @@ int start_epoll(int client_listen_sock, int server_listen_sock, int socket_domai
                 if (accept_connection(epollfd, server_listen_sock, SERVER) < 0) {
                     return -1;
                 }
+            } else if (((conn_t*)events[n].data.ptr)->type == ADMIN) {
+                // the admin endpoint or a connection to it
+                admin_handle_event(events[n].data.ptr, events[n].events);
             } else if (events[n].events & EPOLLIN) {
                 // data available for a connection (or an error condition)
                 conn_t *conn = events[n].data.ptr;
@@ -252,6 +373,7 @@ int start_epoll(int client_listen_sock, int server_listen_sock, int socket_domai
                     server_free((server_t*)conn);
                 }
             }
+            step_start = loop_step(step, fd, step_start);
         }
     }
 }
@@ -265,6 +387,8 @@ int accept_connection(int epollfd, int listen_sock, connection_type type) {
         log_error("Failed to call accept! Error: %s\n", strerror(errno));
         return -1;
     }
+    PROBE2(accept, conn_sock, type);
+    flightrec_add(FLIGHTREC_ACCEPT, conn_sock, type, 0, 0, 0);
     make_nonblock(conn_sock);
     memset(&ev, 0, sizeof(struct epoll_event));
     ev.events = EPOLLIN;
@@ -288,6 +412,9 @@ int read_for_conn(conn_t *conn) {
         client_t *client = (client_t*)conn;
         int n = read(client->conn.fd, &client->buf[client->buf_used], NETWORK_CLIENT_BUF - client->buf_used);
         if (n > 0) {
+            PROBE3(read, client->conn.fd, CLIENT, n);
+            flightrec_add(FLIGHTREC_READ, client->conn.fd, CLIENT, 0, n, 0);
+            metrics_count(METRIC_BYTES_READ, n);
             client->buf_used += n;
 
             int packet_start = 0;
@@ -300,8 +427,9 @@ int read_for_conn(conn_t *conn) {
                 }
                 if (client->buf[i] == '\n') {
                     client->buf[i] = '\0';
+                    PROBE3(packet, client->conn.fd, CLIENT, i - packet_start);
                     // pass the packet to the next layer to handle
-                    if (handle_client_packet(client, &client->buf[packet_start]) == STOP_HANDLING) {
+                    if (handle_client_packet(client, &client->buf[packet_start], i - packet_start) == STOP_HANDLING) {
                         return 1;
                     }
                     packet_start = i + 1;
@@ -328,6 +456,9 @@ int read_for_conn(conn_t *conn) {
         server_t *server = (server_t*)conn;
         int n = read(server->conn.fd, &server->buf[server->buf_used], NETWORK_SERVER_BUF - server->buf_used);
         if (n > 0) {
+            PROBE3(read, server->conn.fd, SERVER, n);
+            flightrec_add(FLIGHTREC_READ, server->conn.fd, SERVER, 0, n, 0);
+            metrics_count(METRIC_BYTES_READ, n);
             server->buf_used += n;
 
             int packet_start = 0;
@@ -340,8 +471,9 @@ int read_for_conn(conn_t *conn) {
                 }
                 if (server->buf[i] == '\n') {
                     server->buf[i] = '\0';
+                    PROBE3(packet, server->conn.fd, SERVER, i - packet_start);
                     // pass the packet to the next layer to handle
-                    if (handle_server_packet(server, &server->buf[packet_start]) == STOP_HANDLING) {
+                    if (handle_server_packet(server, &server->buf[packet_start], i - packet_start) == STOP_HANDLING) {
                         return 1;
                     }
                     packet_start = i + 1;
@@ -371,31 +503,44 @@ int read_for_conn(conn_t *conn) {
 }
 
 int network_send(conn_t *conn, const void *data, const size_t size) {
+    PROBE3(send_queued, conn->fd, conn->type, size + 1);
     size_t bytes_sent = 0;
+    uint32_t writes = 1;
     while (bytes_sent < size) {
-        int n = write(conn->fd, data, size);
+        int n = write(conn->fd, (const char*)data + bytes_sent, size - bytes_sent);
         if (n < 0) {
             // Note: this could also be caused by error EWOULDBLOCK or EAGAIN
             // if this happens very often, userland side send buffering could also be used
             // (or kernel side buffers increased)
             log_error("Failed to call write! Perhaps a kernel buffer is full? Error: %s\n", strerror(errno));
+            flightrec_add(FLIGHTREC_SEND_FAILED, conn->fd, conn->type, 0, size + 1, errno);
             conn_free(conn); 
             return -1;
         } else if (n == 0) {
+            flightrec_add(FLIGHTREC_SEND_FAILED, conn->fd, conn->type, 0, size + 1, 0);
             conn_free(conn); 
             return -1;
         }
+        if ((size_t)n < size - bytes_sent) {
+            metrics_count(METRIC_PARTIAL_WRITES, 1);
+        }
         bytes_sent += n;
+        writes++;
     }
     char newline = '\n';
     int n = write(conn->fd, &newline, 1);
     if (n < 0) {
         log_error("Failed to call write! Perhaps a kernel buffer is full? Error: %s\n", strerror(errno));
+        flightrec_add(FLIGHTREC_SEND_FAILED, conn->fd, conn->type, 0, size + 1, errno);
         conn_free(conn); 
         return -1;
     } else if (n == 0) {
         return -1;
     }
+    PROBE3(send_flushed, conn->fd, conn->type, size + 1);
+    flightrec_add(FLIGHTREC_SEND, conn->fd, conn->type, 0, size + 1, writes);
+    metrics_count(METRIC_BYTES_WRITTEN, size + 1);
+    metrics_record(METRIC_SEND_BYTES, size + 1);
     return 1;
 }
 
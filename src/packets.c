@@ -2,31 +2,62 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <time.h>
 #include <sys/socket.h>
 #include "packets.h"
+#include "packet_builder.h"
 #include "cfuhash.h"
+#include "symbols.h"
 #include "logging.h"
+#include "metrics.h"
+#include "probes.h"
+#include "flightrec.h"
 
-cfuhash_table_t *nicknames_hash; // *char (nickname) -> nickname_t
-cfuhash_table_t *channels_hash;  // *char (channel name) -> channel_t
-cfuhash_table_t *servers_hash;   // not actually a hash, just a server_t -> server_t mapping
+static inline uint64_t server_hash(server_t *server, uint64_t seed) {
+    return typed_hash_pointer(server, seed);
+}
+
+static inline int server_equal(server_t *a, server_t *b) {
+    return a == b;
+}
+
+// every packet looks up nicknames, so they get a table specialized for
+// their fixed size keys instead of going through cfuhash
+TYPED_HASH_DEFINE(nick_table, nick_key_t, nickname_t*, nick_key_hash, nick_key_equal)
+TYPED_HASH_DEFINE(server_table, server_t*, server_t*, server_hash, server_equal)
+
+nick_table_t nicknames_hash;    // nick_key_t (nickname) -> nickname_t
+cfuhash_table_t *channels_hash; // *char (channel name) -> channel_t
+server_table_t servers_hash;    // not actually a hash, just a server_t -> server_t mapping
+
+// kept up to date as they change, so the state can be read without walking
+// the tables
+static size_t local_nicknames = 0;
+static size_t channel_memory = 0; // channel_t, member tables and NAMES packets
 
 void init_packets() {
-    nicknames_hash = cfuhash_new_with_initial_size(1000); 
-    cfuhash_set_flag(nicknames_hash, CFUHASH_IGNORE_CASE); 
+    init_symbols();
+
+    int ok = nick_table_init(&nicknames_hash, 1000);
+    assert(ok);
 
     channels_hash = cfuhash_new_with_initial_size(1000); 
     cfuhash_set_flag(channels_hash, CFUHASH_IGNORE_CASE); 
+    cfuhash_set_flag(channels_hash, CFUHASH_OPEN_ADDRESSING);
+    cfuhash_set_flag(channels_hash, CFUHASH_INCREMENTAL_REHASH);
 
-    servers_hash = cfuhash_new();
-    // don't copy server pointers so that pointer comparison works
-    cfuhash_set_flag(servers_hash, CFUHASH_NOCOPY_KEYS); 
+    ok = server_table_init(&servers_hash, 0);
+    assert(ok);
 }
 
-void send_packet(conn_t *conn, char *packet) {
-    network_send(conn, packet, strlen(packet));
+void send_packet(conn_t *conn, const char *packet, size_t packet_len) {
+    metrics_count(METRIC_PACKETS_OUT + metrics_command_of(packet, packet_len), 1);
+    network_send(conn, packet, packet_len);
 }
 
+// sends a packet that is a string literal
+#define send_literal(conn, literal) send_packet((conn), (literal), sizeof(literal) - 1)
+
 // gets a connection for a nickname:
 // - actual client connection for a local nickname
 // - server connection for a remote nickname
@@ -40,26 +71,43 @@ conn_t *get_conn_for(nickname_t *nick) {
     }
 }
 
-channel_t *channel_create(char *channel_name) {
+channel_t *channel_create(char *channel_name, size_t channel_name_len) {
     channel_t *channel = malloc(sizeof(channel_t));
     if (channel == NULL)
         return NULL;
     log_debug("Created channel %s\n", channel_name);
-    strncpy(channel->name, channel_name, CHANNEL_LENGTH);
+    if (channel_name_len >= CHANNEL_LENGTH) {
+        channel_name_len = CHANNEL_LENGTH - 1;
+    }
+    memcpy(channel->name, channel_name, channel_name_len);
+    channel->name[channel_name_len] = '\0';
+    channel->name_len = channel_name_len;
+    channel->id = symbol_intern(channel->name, channel->name_len);
+    // keyed by the nickname ids, so the keys are plain integers
     channel->nicknames = cfuhash_new();
-    cfuhash_set_flag(channel->nicknames, CFUHASH_IGNORE_CASE); 
+    channel->names = NULL;
+    channel->names_count = 0;
+    channel->names_capacity = 0;
+    channel->names_valid = 0;
+    channel_memory += sizeof(channel_t) + cfuhash_memory(channel->nicknames);
+    metrics_gauge_add(METRIC_CHANNELS, 1);
     return channel;
 }
 
-channel_t *get_or_create_channel(char *channel_name) {
-    channel_t *channel = cfuhash_get(channels_hash, channel_name); 
-    if (channel == NULL) {
-        channel = channel_create(channel_name);
-        if (channel == NULL)
+channel_t *get_or_create_channel(char *channel_name, size_t channel_name_len) {
+    int inserted;
+    channel_t **slot = (channel_t**)cfuhash_find_or_insert(channels_hash, channel_name, channel_name_len + 1, &inserted);
+    if (slot == NULL) {
+        return NULL;
+    }
+    if (inserted) {
+        *slot = channel_create(channel_name, channel_name_len);
+        if (*slot == NULL) {
+            cfuhash_delete(channels_hash, channel_name);
             return NULL;
-        cfuhash_put(channels_hash, channel_name, channel);
+        }
     }
-    return channel;
+    return *slot;
 }
 
 void channel_destroy(channel_t *channel) {
@@ -67,70 +115,181 @@ void channel_destroy(channel_t *channel) {
     void *res = cfuhash_delete(channels_hash, channel->name);
     assert(res != NULL);
     assert(cfuhash_num_entries(channel->nicknames) == 0);
+    channel_memory -= sizeof(channel_t) + cfuhash_memory(channel->nicknames) +
+                      channel->names_capacity * sizeof(packet_builder_t);
     cfuhash_destroy(channel->nicknames);
+    symbol_release(channel->id);
+    free(channel->names);
     free(channel);
+    metrics_gauge_add(METRIC_CHANNELS, -1);
 }
 
-// broadcasts a packet to all the servers we a have a connection with
-void server_broadcast(char *packet) {
-    void *cur_key, *cur_data;
-    size_t key_len, data_len;
-    int more = cfuhash_each_data(servers_hash, &cur_key, &key_len, &cur_data, &data_len);
-    while (more) {
-        server_t *cur_server = (server_t*)cur_key;
-        send_packet((conn_t*)cur_server, packet);
-        more = cfuhash_next_data(servers_hash, &cur_key, &key_len, &cur_data, &data_len);
+// appends a nickname to the cached NAMES packets of a channel,
+// starting a new packet if the nickname doesn't fit the last one
+// returns 0 if memory for a new packet couldn't be allocated
+int channel_names_append(channel_t *channel, nickname_t *nick) {
+    packet_builder_t *packet = channel->names_count ? &channel->names[channel->names_count - 1] : NULL;
+    if (packet == NULL || packet->len + nick->nickname_len + 1 >= NETWORK_MAX_PACKET_SIZE) {
+        if (channel->names_count == channel->names_capacity) {
+            size_t capacity = channel->names_capacity ? channel->names_capacity * 2 : 1;
+            packet_builder_t *names = realloc(channel->names, capacity * sizeof(packet_builder_t));
+            if (names == NULL) {
+                return 0;
+            }
+            channel_memory += (capacity - channel->names_capacity) * sizeof(packet_builder_t);
+            channel->names = names;
+            channel->names_capacity = capacity;
+        }
+        packet = &channel->names[channel->names_count++];
+        packet_builder_init(packet);
+        packet_append_literal(packet, "NAMES ");
+        packet_append(packet, channel->name, channel->name_len);
     }
+    packet_append_char(packet, ' ');
+    packet_append(packet, nick->nickname, nick->nickname_len);
+    return 1;
+}
+
+// serializes the NAMES packets of a channel from its nicknames
+int channel_names_rebuild(channel_t *channel) {
+    channel->names_count = 0;
+    cfuhash_iter_t iter;
+    nickname_t *channel_nick;
+    cfuhash_iter_init(&iter, channel->nicknames);
+    while (cfuhash_iter_next(&iter, NULL, NULL, (void**)&channel_nick, NULL)) {
+        if (!channel_names_append(channel, channel_nick)) {
+            return 0;
+        }
+    }
+    channel->names_valid = 1;
+    return 1;
+}
+
+int channel_has_nickname(channel_t *channel, nickname_t *nick) {
+    return cfuhash_exists_data(channel->nicknames, &nick->id, sizeof(symbol_t));
+}
+
+// adds a nickname to a channel, returns 0 if it already was on the channel
+int channel_add_nickname(channel_t *channel, nickname_t *nick) {
+    int inserted;
+    size_t memory = cfuhash_memory(channel->nicknames);
+    void **slot = cfuhash_find_or_insert(channel->nicknames, &nick->id, sizeof(symbol_t), &inserted);
+    channel_memory += cfuhash_memory(channel->nicknames) - memory;
+    if (!inserted) {
+        return 0;
+    }
+    *slot = nick;
+    if (channel->names_valid && !channel_names_append(channel, nick)) {
+        channel->names_valid = 0;
+    }
+    return 1;
+}
+
+// removes a nickname from a channel, returns 0 if it wasn't on the channel
+int channel_remove_nickname(channel_t *channel, nickname_t *nick) {
+    size_t memory = cfuhash_memory(channel->nicknames);
+    void *removed = cfuhash_delete_data(channel->nicknames, &nick->id, sizeof(symbol_t));
+    channel_memory += cfuhash_memory(channel->nicknames) - memory;
+    if (removed == NULL) {
+        return 0;
+    }
+    channel->names_valid = 0;
+    return 1;
+}
+
+// sends a packet to all the servers except from, returns the number of servers
+static size_t send_to_servers(server_t *from, const char *packet, size_t packet_len) {
+    size_t pos = 0, sent = 0;
+    server_t *cur_server;
+    while (server_table_next(&servers_hash, &pos, &cur_server, NULL)) {
+        if (cur_server != from) {
+            send_packet((conn_t*)cur_server, packet, packet_len);
+            sent++;
+        }
+    }
+    return sent;
+}
+
+// relays a packet to all the servers except the one it came from
+// (from can be NULL to send to every server)
+void server_relay(server_t *from, const char *packet, size_t packet_len) {
+    metrics_record(METRIC_FANOUT, send_to_servers(from, packet, packet_len));
+}
+
+// broadcasts a packet to all the servers we a have a connection with
+void server_broadcast(const char *packet, size_t packet_len) {
+    server_relay(NULL, packet, packet_len);
 }
 
 // broadcast a packet to all the local clients on a channel
 // also can broadcast to servers with the parameter broadcast_servers
-void channel_broadcast(channel_t *channel, char *packet, int broadcast_servers) {
+void channel_broadcast(channel_t *channel, const char *packet, size_t packet_len, int broadcast_servers) {
+    size_t fanout = 0;
     if (broadcast_servers) {
-        server_broadcast(packet);
+        fanout = send_to_servers(NULL, packet, packet_len);
     }
-    char *key;
+    assert(cfuhash_num_entries(channel->nicknames) > 0);
+    cfuhash_iter_t iter;
     nickname_t *channel_nick;
-    int res = cfuhash_each(channel->nicknames, &key, (void**)&channel_nick);
-    assert(res != 0);
-    do {
+    cfuhash_iter_init(&iter, channel->nicknames);
+    while (cfuhash_iter_next(&iter, NULL, NULL, (void**)&channel_nick, NULL)) {
         if (channel_nick->type == LOCAL) {
-            send_packet((conn_t*)(((localnick_t*)channel_nick)->client), packet);
+            send_packet((conn_t*)(((localnick_t*)channel_nick)->client), packet, packet_len);
+            fanout++;
         }
-    } while (cfuhash_next(channel->nicknames, &key, (void**)&channel_nick));
+    }
+    metrics_record(METRIC_FANOUT, fanout);
+}
+
+// builds a "<command> <nickname> <channel>" packet, used for JOIN and LEAVE
+size_t build_membership_packet(packet_builder_t *packet, const char *command, size_t command_len,
+                               nickname_t *nick, channel_t *channel) {
+    packet_builder_init(packet);
+    packet_append(packet, command, command_len);
+    packet_append_char(packet, ' ');
+    packet_append(packet, nick->nickname, nick->nickname_len);
+    packet_append_char(packet, ' ');
+    packet_append(packet, channel->name, channel->name_len);
+    return packet_finish(packet);
+}
+
+// builds a "KILL <nickname> <reason>" packet
+size_t build_kill_packet(packet_builder_t *packet, const char *nickname, size_t nickname_len,
+                         const char *reason, size_t reason_len) {
+    packet_builder_init(packet);
+    packet_append_literal(packet, "KILL ");
+    packet_append(packet, nickname, nickname_len);
+    packet_append_char(packet, ' ');
+    packet_append(packet, reason, reason_len);
+    return packet_finish(packet);
 }
 
-// creates a NAMES packet or multiple NAMES packets for a certain client
+// sends the NAMES packet or multiple NAMES packets for a certain client
 // about nicknames on a channel
 // (multiple packets are generated if the nicknames don't fit in one)
 void send_channel_names(client_t *client, channel_t *channel) {
-    char packet[NETWORK_MAX_PACKET_SIZE];
-    memset(packet, 0, NETWORK_MAX_PACKET_SIZE); 
-    int packet_header_size = snprintf(packet, NETWORK_MAX_PACKET_SIZE, "NAMES %s", channel->name);
-    int current_start = packet_header_size;
-    char *nick;
-    nickname_t *channel_nick;
-    int res = cfuhash_each(channel->nicknames, &nick, (void**)&channel_nick);
-    assert(res != 0);
-    do {
-        int nicklen = strlen(nick);
-        // another nickname won't fit the packet
-        // send the packet and start from start
-        if (current_start + nicklen + 1 >= NETWORK_MAX_PACKET_SIZE) {
-            send_packet((conn_t*)client, packet);
-            current_start = packet_header_size;
-            packet[current_start] = '\0';
-        }
-        packet[current_start] = ' ';
-        strcpy(&packet[current_start + 1], nick);
-        current_start += nicklen + 1;
-    } while (cfuhash_next(channel->nicknames, &nick, (void**)&channel_nick));
-    // send the rest if left
-    if (current_start != packet_header_size) {
-        send_packet((conn_t*)client, packet);
+    if (!channel->names_valid && !channel_names_rebuild(channel)) {
+        log_warn("Failed to build NAMES for channel '%s', out of memory\n", channel->name);
+        return;
+    }
+    for (size_t i = 0; i < channel->names_count; i++) {
+        send_packet((conn_t*)client, channel->names[i].buf, channel->names[i].len);
     }
 }
 
+// finds the slot of a channel in the channels of a nickname
+// returns USER_MAX_CHANNELS if the nickname isn't on the channel
+int find_channel_slot(nickname_t *nick, const char *channel_name) {
+    symbol_t channel_id = symbol_lookup(channel_name, strlen(channel_name));
+    int i;
+    for (i = 0; i < USER_MAX_CHANNELS; i++) {
+        if (nick->channels[i] && nick->channels[i]->id == channel_id) {
+            break;
+        }
+    }
+    return i;
+}
+
 int handle_unregistered_packet(client_t *client, char *packet);
 int handle_registered_packet(client_t *client, char *packet);
 
@@ -138,14 +297,53 @@ int is_registered(client_t *client) {
     return client->nick->nick.nickname[0] != '\0';
 }
 
-int handle_client_packet(client_t *client, char *packet) {
+// returns the flood control class for a packet from a registered client
+flood_class get_flood_class(char *packet) {
+    if (strncmp(packet, "MSG ", strlen("MSG ")) == 0) {
+        return FLOOD_MSG;
+    } else if (strncmp(packet, "JOIN ", strlen("JOIN ")) == 0) {
+        return FLOOD_JOIN;
+    } else if (strncmp(packet, "NAMES ", strlen("NAMES ")) == 0) {
+        return FLOOD_NAMES;
+    }
+    return FLOOD_ALL;
+}
+
+static int dispatch_client_packet(client_t *client, char *packet) {
     if (is_registered(client)) {
+        if (!flood_allow(&client->flood, get_flood_class(packet))) {
+            // tell the client only once per burst of dropped packets
+            if (!client->flood.throttled) {
+                client->flood.throttled = 1;
+                log_info("User '%s' is flooding, dropping packets (%llu dropped so far)\n",
+                         client->nick->nick.nickname, (unsigned long long)client->flood.dropped);
+                send_literal((conn_t*)client, "CMDREPLY You are sending too fast, packet dropped");
+            }
+            return 0;
+        }
+        client->flood.throttled = 0;
         return handle_registered_packet(client, packet);        
     } else {
         return handle_unregistered_packet(client, packet);
     }
 }
 
+int handle_client_packet(client_t *client, char *packet, size_t packet_len) {
+    // the handler may free the client, so nothing of it is used afterwards
+    metrics_command command = metrics_command_of(packet, packet_len);
+    int fd = client->conn.fd;
+    PROBE3(dispatch, fd, command, metrics_command_name(command));
+    uint64_t start = metrics_now_ns();
+    int result = dispatch_client_packet(client, packet);
+    uint64_t elapsed = metrics_now_ns() - start;
+    metrics_record(METRIC_HANDLER_NS + command, elapsed);
+    network_note_packet(command, elapsed);
+    PROBE4(dispatch_end, fd, command, metrics_command_name(command), elapsed);
+    flightrec_add(FLIGHTREC_PACKET, fd, CLIENT, command, packet_len, elapsed / 1000);
+    metrics_count(METRIC_PACKETS_IN + command, 1);
+    return result;
+}
+
 int handle_unregistered_packet(client_t *client, char *packet) {
     char *command = strtok(packet, " ");
     if (command != NULL && strcmp(command, "NICK") == 0) {
@@ -153,36 +351,50 @@ int handle_unregistered_packet(client_t *client, char *packet) {
         char *nickname = strtok(NULL, " ");
         if (nickname == NULL) {
             log_debug("Unregistered user illegal nick, dropping\n");
-            send_packet((conn_t*)client, "CLOSE Illegal nickname");
+            send_literal((conn_t*)client, "CLOSE Illegal nickname");
             client_free(client);
         } else {
-            int nicklen = strlen(nickname);
+            size_t nicklen = strlen(nickname);
             if (nicklen > 0 && nicklen < NICKNAME_LENGTH && nickname[0] != '#') {
-                if (!cfuhash_exists(nicknames_hash, nickname)) {
-                    strncpy(client->nick->nick.nickname, nickname, NICKNAME_LENGTH);
+                int inserted;
+                nickname_t **slot = nick_table_insert(&nicknames_hash, nick_key(nickname, nicklen), &inserted);
+                if (slot == NULL) {
+                    log_error("Failed to register nickname '%s', out of memory\n", nickname);
+                    send_literal((conn_t*)client, "CLOSE Server memory full");
+                    client_free(client);
+                } else if (inserted) {
+                    *slot = (nickname_t*)client->nick;
+                    local_nicknames++;
+                    memcpy(client->nick->nick.nickname, nickname, nicklen + 1);
+                    client->nick->nick.nickname_len = nicklen;
+                    client->nick->nick.id = symbol_intern(nickname, nicklen);
                     log_info("Registered nickname: %s\n", nickname);
-                    char packet[NETWORK_MAX_PACKET_SIZE];
-                    snprintf(packet, NETWORK_MAX_PACKET_SIZE, "MOTD Welcome to da server, %s!", nickname);
-                    send_packet((conn_t*)client, packet);
-                    cfuhash_put(nicknames_hash, nickname, client->nick);
+                    packet_builder_t packet;
+                    packet_builder_init(&packet);
+                    packet_append_literal(&packet, "MOTD Welcome to da server, ");
+                    packet_append(&packet, nickname, nicklen);
+                    packet_append_char(&packet, '!');
+                    send_packet((conn_t*)client, packet.buf, packet_finish(&packet));
 
-                    snprintf(packet, NETWORK_MAX_PACKET_SIZE, "NICK %s", nickname);
-                    server_broadcast(packet);
+                    packet_builder_init(&packet);
+                    packet_append_literal(&packet, "NICK ");
+                    packet_append(&packet, nickname, nicklen);
+                    server_broadcast(packet.buf, packet_finish(&packet));
                     return 0;
                 } else {
                     log_debug("Unregistered user nickname taken '%s', dropping\n", nickname);
-                    send_packet((conn_t*)client, "CLOSE Nickname taken!");
+                    send_literal((conn_t*)client, "CLOSE Nickname taken!");
                     client_free(client);
                 }
             } else {
                 log_debug("Unregistered user illegal nick '%s', dropping\n", nickname);
-                send_packet((conn_t*)client, "CLOSE Illegal nickname");
+                send_literal((conn_t*)client, "CLOSE Illegal nickname");
                 client_free(client);
             }
         }
     } else {
         log_debug("Unregistered user didn't send NICK as first packet, dropping\n");
-        send_packet((conn_t*)client, "CLOSE Please send nickname with NICK");
+        send_literal((conn_t*)client, "CLOSE Please send nickname with NICK");
         client_free(client);
     }
     return STOP_HANDLING;
@@ -208,34 +420,47 @@ int handle_registered_packet(client_t *client, char *packet) {
             return 0;
         }
 
+        // strtok only split off the destination, so the message follows it directly
+        size_t destination_len = msg - destination - 1;
+        size_t msg_len = strlen(msg);
+
         log_info("Message from '%s' to '%s': %s\n", client->nick->nick.nickname, destination, msg);
-        char packet[NETWORK_MAX_PACKET_SIZE];
-        snprintf(packet, NETWORK_MAX_PACKET_SIZE, "MSG %s %s %s", client->nick->nick.nickname, destination, msg);
-        if (cfuhash_exists(nicknames_hash, destination)) {
-            send_packet(get_conn_for((nickname_t*)cfuhash_get(nicknames_hash, destination)), packet);
-        } else if (cfuhash_exists(channels_hash, destination)) {
-            channel_t *channel = cfuhash_get(channels_hash, destination);
-            if (!cfuhash_exists(channel->nicknames, client->nick->nick.nickname)) {
-                send_packet((conn_t*)client, "CMDREPLY You need to join the channel first");
+        packet_builder_t packet;
+        packet_builder_init(&packet);
+        packet_append_literal(&packet, "MSG ");
+        packet_append(&packet, client->nick->nick.nickname, client->nick->nick.nickname_len);
+        packet_append_char(&packet, ' ');
+        packet_append(&packet, destination, destination_len);
+        packet_append_char(&packet, ' ');
+        packet_append(&packet, msg, msg_len);
+        size_t packet_len = packet_finish(&packet);
+        nickname_t **target;
+        channel_t *channel;
+        if ((target = nick_table_get(&nicknames_hash, nick_key(destination, destination_len))) != NULL) {
+            send_packet(get_conn_for(*target), packet.buf, packet_len);
+        } else if (cfuhash_try_get(channels_hash, destination, (void**)&channel)) {
+            if (!channel_has_nickname(channel, (nickname_t*)client->nick)) {
+                send_literal((conn_t*)client, "CMDREPLY You need to join the channel first");
                 return 0;
             }
-            channel_broadcast(channel, packet, 1);
+            channel_broadcast(channel, packet.buf, packet_len, 1);
         } else {
-            send_packet((conn_t*)client, "CMDREPLY Nickname or channel not found");
+            send_literal((conn_t*)client, "CMDREPLY Nickname or channel not found");
         }
         return 0;
     } else if (strcmp(command, "JOIN") == 0) {
         // JOIN <channel>\n packet handler
         char *channel_name = strtok(NULL, " ");
-        if (channel_name == NULL || strlen(channel_name) < CHANNEL_MIN_LENGTH || strlen(channel_name) >= CHANNEL_LENGTH || channel_name[0] != '#') {
-            send_packet((conn_t*)client, "CMDREPLY Illegal channel name");
+        size_t channel_name_len = channel_name ? strlen(channel_name) : 0;
+        if (channel_name == NULL || channel_name_len < CHANNEL_MIN_LENGTH || channel_name_len >= CHANNEL_LENGTH || channel_name[0] != '#') {
+            send_literal((conn_t*)client, "CMDREPLY Illegal channel name");
             return 0;
         }
         // check if user has too many channels
         int i;
         for (i = 0; i <= USER_MAX_CHANNELS; i++) {
             if (i == USER_MAX_CHANNELS) {
-                send_packet((conn_t*)client, "CMDREPLY You have joined too many channels");
+                send_literal((conn_t*)client, "CMDREPLY You have joined too many channels");
                 return 0;
             }
             if (client->nick->nick.channels[i] == NULL) {
@@ -243,53 +468,47 @@ int handle_registered_packet(client_t *client, char *packet) {
             }
         }
         // channel slot i is free at this moment
-        channel_t *channel = get_or_create_channel(channel_name);
+        channel_t *channel = get_or_create_channel(channel_name, channel_name_len);
         if (channel == NULL) {
-            send_packet((conn_t*)client, "CMDREPLY Joining channel failed, server memory full");
+            send_literal((conn_t*)client, "CMDREPLY Joining channel failed, server memory full");
             log_info("User '%s' failed to join channel '%s', get_or_create_channel NULL\n", client->nick->nick.nickname, channel_name);
             return 0;
         }
-        if (cfuhash_exists(channel->nicknames, client->nick->nick.nickname)) {
-            send_packet((conn_t*)client, "CMDREPLY You have already joined!");
+        if (!channel_add_nickname(channel, (nickname_t*)client->nick)) {
+            send_literal((conn_t*)client, "CMDREPLY You have already joined!");
             return 0;
         }
         log_info("User '%s' joined channel '%s'\n", client->nick->nick.nickname, channel_name);
-        cfuhash_put(channel->nicknames, client->nick->nick.nickname, client->nick);
         client->nick->nick.channels[i] = channel;
         // send the join message to users on the channel
-        char packet[NETWORK_MAX_PACKET_SIZE];
-        snprintf(packet, NETWORK_MAX_PACKET_SIZE, "JOIN %s %s", client->nick->nick.nickname, channel->name);
-        channel_broadcast(channel, packet, 1);
+        packet_builder_t packet;
+        size_t packet_len = build_membership_packet(&packet, "JOIN", strlen("JOIN"), (nickname_t*)client->nick, channel);
+        channel_broadcast(channel, packet.buf, packet_len, 1);
         send_channel_names(client, channel);
         return 0;
     } else if (strcmp(command, "LEAVE") == 0) {
         // LEAVE <channel>\n packet handler
         char *channel_name = strtok(NULL, " ");
         if (channel_name == NULL) {
-            send_packet((conn_t*)client, "CMDREPLY Illegal channel name");
+            send_literal((conn_t*)client, "CMDREPLY Illegal channel name");
             return 0;
         }
-        int i;
-        for (i = 0; i <= USER_MAX_CHANNELS; i++) {
-            if (i == USER_MAX_CHANNELS) {
-                send_packet((conn_t*)client, "CMDREPLY You are not on that channel");
-                return 0;
-            }
-            if (client->nick->nick.channels[i] && strcasecmp(client->nick->nick.channels[i]->name, channel_name) == 0) {
-                break;
-            }
+        int i = find_channel_slot((nickname_t*)client->nick, channel_name);
+        if (i == USER_MAX_CHANNELS) {
+            send_literal((conn_t*)client, "CMDREPLY You are not on that channel");
+            return 0;
         }
         channel_t *channel = client->nick->nick.channels[i];
         client->nick->nick.channels[i] = NULL;
-        void *res = cfuhash_delete(channel->nicknames, client->nick->nick.nickname);
-        assert(res != NULL);
-        char packet[NETWORK_MAX_PACKET_SIZE];
-        snprintf(packet, NETWORK_MAX_PACKET_SIZE, "LEAVE %s %s", client->nick->nick.nickname, channel->name);
+        int removed = channel_remove_nickname(channel, (nickname_t*)client->nick);
+        assert(removed);
+        packet_builder_t packet;
+        size_t packet_len = build_membership_packet(&packet, "LEAVE", strlen("LEAVE"), (nickname_t*)client->nick, channel);
         if (cfuhash_num_entries(channel->nicknames) == 0) {
             channel_destroy(channel); 
-            server_broadcast(packet);
+            server_broadcast(packet.buf, packet_len);
         } else {
-            channel_broadcast(channel, packet, 1);
+            channel_broadcast(channel, packet.buf, packet_len, 1);
         }
         log_info("User '%s' left channel '%s'\n", client->nick->nick.nickname, channel_name);
         return 0;
@@ -297,18 +516,13 @@ int handle_registered_packet(client_t *client, char *packet) {
         // NAMES <channel>\n packet
         char *channel_name = strtok(NULL, " ");
         if (channel_name == NULL) {
-            send_packet((conn_t*)client, "CMDREPLY Illegal channel name");
+            send_literal((conn_t*)client, "CMDREPLY Illegal channel name");
             return 0;
         }
-        int i;
-        for (i = 0; i <= USER_MAX_CHANNELS; i++) {
-            if (i == USER_MAX_CHANNELS) {
-                send_packet((conn_t*)client, "CMDREPLY You are not on that channel");
-                return 0;
-            }
-            if (client->nick->nick.channels[i] && strcasecmp(client->nick->nick.channels[i]->name, channel_name) == 0) {
-                break;
-            }
+        int i = find_channel_slot((nickname_t*)client->nick, channel_name);
+        if (i == USER_MAX_CHANNELS) {
+            send_literal((conn_t*)client, "CMDREPLY You are not on that channel");
+            return 0;
         }
         channel_t *channel = client->nick->nick.channels[i];
         send_channel_names(client, channel);
@@ -322,36 +536,35 @@ int handle_registered_packet(client_t *client, char *packet) {
 // sends a single KILL message to local clients that are atleast on one
 // shared channel with the nickname
 // reason is broadcast across the network and finally the clients
-void remove_from_channels(nickname_t *nick, char *reason) {
+void remove_from_channels(nickname_t *nick, const char *reason, size_t reason_len) {
     // local nicknames that already know about the disconnect
     cfuhash_table_t *already_sent = cfuhash_new();
+    packet_builder_t packet;
+    size_t packet_len = build_kill_packet(&packet, nick->nickname, nick->nickname_len, reason, reason_len);
     for (int i = 0; i < USER_MAX_CHANNELS; i++) {
         if (nick->channels[i] != NULL) {
             channel_t *channel = nick->channels[i];
             // remove nickname from channel
-            void *res = cfuhash_delete(channel->nicknames, nick->nickname);
-            assert(res != NULL);
+            int removed = channel_remove_nickname(channel, nick);
+            assert(removed);
             if (cfuhash_num_entries(channel->nicknames) == 0) {
                 // delete channels as it's the last nickname on it
                 channel_destroy(channel); 
             } else {
                 // tell others on the channel about the nickname being killed
-                char *key;
+                cfuhash_iter_t iter;
                 nickname_t *channel_nick;
-                char packet[NETWORK_MAX_PACKET_SIZE];
-                snprintf(packet, NETWORK_MAX_PACKET_SIZE, "KILL %s %s", nick->nickname, reason);
-                int res = cfuhash_each(channel->nicknames, &key, (void**)&channel_nick);
-                assert(res != 0);
-                do {
+                cfuhash_iter_init(&iter, channel->nicknames);
+                while (cfuhash_iter_next(&iter, NULL, NULL, (void**)&channel_nick, NULL)) {
                     if (channel_nick->type == LOCAL) {
                         client_t *channel_client = ((localnick_t*)channel_nick)->client;
                         if (!cfuhash_exists_data(already_sent, channel_client, sizeof(client_t*))) {
                             // only send if the client doesn't already know about the disconnect
-                            send_packet((conn_t*)channel_client, packet);
+                            send_packet((conn_t*)channel_client, packet.buf, packet_len);
                             cfuhash_put_data(already_sent, channel_client, sizeof(client_t*), NULL, 0, NULL);
                         }
                     }
-                } while (cfuhash_next(channel->nicknames, &key, (void**)&channel_nick));
+                }
             }
         }
     }
@@ -360,54 +573,96 @@ void remove_from_channels(nickname_t *nick, char *reason) {
 
 void handle_client_disconnect(client_t *client) {
     if (is_registered(client)) {
-        void *res = cfuhash_delete(nicknames_hash, client->nick->nick.nickname);
-        assert(res != NULL);
-        remove_from_channels((nickname_t*)client->nick, "client disconnected");
+        int removed = nick_table_remove(&nicknames_hash, nick_key(client->nick->nick.nickname, client->nick->nick.nickname_len), NULL);
+        assert(removed);
+        local_nicknames--;
+        remove_from_channels((nickname_t*)client->nick, "client disconnected", strlen("client disconnected"));
         log_info("Registered user '%s' disconnected\n", client->nick->nick.nickname);
-        char packet[NETWORK_MAX_PACKET_SIZE];
-        snprintf(packet, NETWORK_MAX_PACKET_SIZE, "KILL %s client disconnected", client->nick->nick.nickname);
-        server_broadcast(packet);
+        packet_builder_t packet;
+        size_t packet_len = build_kill_packet(&packet, client->nick->nick.nickname, client->nick->nick.nickname_len,
+                                              "client disconnected", strlen("client disconnected"));
+        server_broadcast(packet.buf, packet_len);
+        symbol_release(client->nick->nick.id);
     } else {
         log_debug("Unregistered client disconnected\n");
     }
 }
 
+// frees a remote nickname
+void free_nickname(void *data) {
+    symbol_release(((nickname_t*)data)->id);
+    free(data);
+}
+
 // remove a nickname from all the data structures and finally tell local clients about it
 // also kill the tcp connection if the nickname is local
-void kill_nickname(char *nickname, char *reason) {
-    nickname_t *res = (nickname_t*)cfuhash_delete(nicknames_hash, nickname);
+void kill_nickname(char *nickname, const char *reason, size_t reason_len) {
+    nickname_t *res = NULL;
+    nick_table_remove(&nicknames_hash, nick_key(nickname, strlen(nickname)), &res);
     if (res) {
         if (res->type == LOCAL) {
             client_t *client = ((localnick_t*)res)->client;
-            remove_from_channels(res, reason);
+            local_nicknames--;
+            remove_from_channels(res, reason, reason_len);
             log_info("Nickname '%s' killed\n", client->nick->nick.nickname);
-            char packet[NETWORK_MAX_PACKET_SIZE];
-            snprintf(packet, NETWORK_MAX_PACKET_SIZE, "KILL %s %s", client->nick->nick.nickname, reason);
-            send_packet((conn_t*)client, packet);
+            packet_builder_t packet;
+            size_t packet_len = build_kill_packet(&packet, res->nickname, res->nickname_len, reason, reason_len);
+            send_packet((conn_t*)client, packet.buf, packet_len);
             shutdown(client->conn.fd, SHUT_WR);
+            symbol_release(res->id);
             client_close(client);
         } else if (res->type == REMOTE) {
-            remove_from_channels(res, reason);
+            remove_from_channels(res, reason, reason_len);
             log_info("Nickname '%s' killed\n", res->nickname);
-            free(res);
+            free_nickname(res);
         } else {
             assert(0);
         }
     }
 }
 
-int handle_server_packet(server_t *server, char *packet) {
+// MSG <sender> <destination> msg\n packet from another server
+// the wire format for local clients is the same as between servers, so the
+// received bytes are delivered as is. the packet is parsed without modifying it
+void relay_server_msg(char *packet, size_t packet_len) {
+    char *end = packet + packet_len;
+    char *sender = packet + strlen("MSG ");
+    char *sender_end = memchr(sender, ' ', end - sender);
+    if (sender_end == NULL || sender_end == sender) {
+        return;
+    }
+    char *destination = sender_end + 1;
+    char *destination_end = memchr(destination, ' ', end - destination);
+    if (destination_end == NULL || destination_end == destination || destination_end + 1 == end) {
+        // no destination or no message
+        return;
+    }
+    // the hash tables need a null-terminated key, copy just the destination
+    char destination_name[NETWORK_MAX_PACKET_SIZE];
+    size_t destination_len = destination_end - destination;
+    memcpy(destination_name, destination, destination_len);
+    destination_name[destination_len] = '\0';
+
+    nickname_t **target;
+    channel_t *channel;
+    if ((target = nick_table_get(&nicknames_hash, nick_key(destination, destination_len))) != NULL) {
+        // user -> user packet
+        if ((*target)->type == LOCAL) {
+            send_packet(get_conn_for(*target), packet, packet_len);
+        }
+    } else if (cfuhash_get_data(channels_hash, destination_name, destination_len + 1, (void**)&channel, NULL)) {
+        // user -> channel packet
+        channel_broadcast(channel, packet, packet_len, 0);
+    }
+}
+
+static int dispatch_server_packet(server_t *server, char *packet, size_t packet_len) {
     log_debug("Packet from another server [%d]: %s\n", server->conn.fd, packet);
     // broadcast the packet across rest of the network
-    void *cur_key, *cur_data;
-    size_t key_len, data_len;
-    int more = cfuhash_each_data(servers_hash, &cur_key, &key_len, &cur_data, &data_len);
-    while (more) {
-        server_t *cur_server = (server_t*)cur_key;
-        if (cur_server != server) {
-            send_packet((conn_t*)cur_server, packet);
-        }
-        more = cfuhash_next_data(servers_hash, &cur_key, &key_len, &cur_data, &data_len);
+    server_relay(server, packet, packet_len);
+    if (strncmp(packet, "MSG ", strlen("MSG ")) == 0) {
+        relay_server_msg(packet, packet_len);
+        return 0;
     }
     // handle the packet
     char *command = strtok(packet, " "); 
@@ -421,23 +676,37 @@ int handle_server_packet(server_t *server, char *packet) {
         if (nickname == NULL) {
             return 0;
         }
+        // the same rules as for local registration, so the key, the stored
+        // nickname and its symbol all cover the same characters
+        size_t nicklen = strlen(nickname);
+        if (nicklen == 0 || nicklen >= NICKNAME_LENGTH || nickname[0] == '#') {
+            log_warn("Received an illegal nickname '%s' from another server\n", nickname);
+            return 0;
+        }
         log_info("Nickname %s joined the network on another server\n", nickname);
-        if (cfuhash_exists(nicknames_hash, nickname)) {
+        int inserted;
+        nickname_t **slot = nick_table_insert(&nicknames_hash, nick_key(nickname, nicklen), &inserted);
+        if (slot == NULL) {
+            log_error("Failed to add remote nickname '%s', out of memory\n", nickname);
+        } else if (!inserted) {
             // we already know about this nickname! it's a nickname collision,
             // probably after a netslipt is over
             log_info("Nickname collision for '%s'!\n", nickname); 
-            char packet[NETWORK_MAX_PACKET_SIZE];
-            snprintf(packet, NETWORK_MAX_PACKET_SIZE, "KILL %s nickname collision", nickname);
-            server_broadcast(packet);
-            kill_nickname(nickname, "nickname collision");
+            packet_builder_t packet;
+            size_t packet_len = build_kill_packet(&packet, nickname, nicklen,
+                                                  "nickname collision", strlen("nickname collision"));
+            server_broadcast(packet.buf, packet_len);
+            kill_nickname(nickname, "nickname collision", strlen("nickname collision"));
         } else {
             // create a remote nickname structure
             remotenick_t *nick = malloc(sizeof(remotenick_t));
             nick->nick.type = REMOTE;
             nick->server = server;
-            strncpy(nick->nick.nickname, nickname, NICKNAME_LENGTH);
+            memcpy(nick->nick.nickname, nickname, nicklen + 1);
+            nick->nick.nickname_len = nicklen;
+            nick->nick.id = symbol_intern(nick->nick.nickname, nicklen);
             memset(&nick->nick.channels, 0, USER_MAX_CHANNELS * sizeof(channel_t*));
-            cfuhash_put(nicknames_hash, nickname, nick);
+            *slot = (nickname_t*)nick;
         }
     } else if (strcmp(command, "KILL") == 0) {
         // KILL <nickname> <reason>\n packet
@@ -446,39 +715,10 @@ int handle_server_packet(server_t *server, char *packet) {
             return 0;
         }
         char *reason = strtok(NULL, "\n");
-        if (nickname == NULL) {
+        if (reason == NULL) {
             return 0;
         }
-        kill_nickname(nickname, reason);
-    } else if (strcmp(command, "MSG") == 0) {
-        // MSG <sender> <destination> msg\n packet
-        char *sender = strtok(NULL, " ");
-        if (sender == NULL) {
-            return 0;
-        }
-        char *destination = strtok(NULL, " ");
-        if (destination == NULL) {
-            return 0;
-        }
-        char *msg = strtok(NULL, "\n");
-        if (msg == NULL) {
-            return 0;
-        }
-        if (cfuhash_exists(nicknames_hash, destination)) {
-            // user -> user packet
-            nickname_t *target = (nickname_t*)cfuhash_get(nicknames_hash, destination);
-            if (target->type == LOCAL) {
-                char packet[NETWORK_MAX_PACKET_SIZE];
-                snprintf(packet, NETWORK_MAX_PACKET_SIZE, "MSG %s %s %s", sender, destination, msg);
-                send_packet(get_conn_for(target), packet);
-            }
-        } else if (cfuhash_exists(channels_hash, destination)) {
-            // user -> channel packet
-            channel_t *channel = (channel_t*)cfuhash_get(channels_hash, destination);
-            char packet[NETWORK_MAX_PACKET_SIZE];
-            snprintf(packet, NETWORK_MAX_PACKET_SIZE, "MSG %s %s %s", sender, destination, msg);
-            channel_broadcast(channel, packet, 0);
-        }
+        kill_nickname(nickname, reason, strlen(reason));
     } else if (strcmp(command, "JOIN") == 0) {
         // JOIN <nickname> <channel>\n packet
         char *nickname = strtok(NULL, " ");
@@ -489,25 +729,36 @@ int handle_server_packet(server_t *server, char *packet) {
         if (channel_name == NULL) {
             return 0;
         }
-        nickname_t *nick = cfuhash_get(nicknames_hash, nickname);
+        nickname_t **found = nick_table_get(&nicknames_hash, nick_key(nickname, strlen(nickname)));
+        nickname_t *nick = found ? *found : NULL;
         if (nick && nick->type == REMOTE &&
             ((remotenick_t*)nick)->server == server) {
             // we should only get JOINs for remote nicknames. and the server should be the one
             // that told us about the nickname in the first place
-            channel_t *channel = get_or_create_channel(channel_name);
-            cfuhash_put(channel->nicknames, nick->nickname, nick);
-            char packet[NETWORK_MAX_PACKET_SIZE];
-            snprintf(packet, NETWORK_MAX_PACKET_SIZE, "JOIN %s %s", nick->nickname, channel->name);
-            channel_broadcast(channel, packet, 0);
-            int placed = 0;
-            for (int i = 0; i < USER_MAX_CHANNELS; i++) {
+            int i;
+            for (i = 0; i < USER_MAX_CHANNELS; i++) {
                 if (nick->channels[i] == NULL) {
-                    nick->channels[i] = channel;
-                    placed = 1; 
                     break;
                 }
             }
-            assert(placed);
+            if (i == USER_MAX_CHANNELS) {
+                log_warn("Remote nickname '%s' joined too many channels\n", nick->nickname);
+                return 0;
+            }
+            channel_t *channel = get_or_create_channel(channel_name, strlen(channel_name));
+            if (channel == NULL) {
+                log_error("Remote nickname '%s' failed to join channel '%s', out of memory\n",
+                          nick->nickname, channel_name);
+                return 0;
+            }
+            if (!channel_add_nickname(channel, nick)) {
+                // already on the channel, nothing changed
+                return 0;
+            }
+            nick->channels[i] = channel;
+            packet_builder_t packet;
+            size_t packet_len = build_membership_packet(&packet, "JOIN", strlen("JOIN"), nick, channel);
+            channel_broadcast(channel, packet.buf, packet_len, 0);
         } else {
             log_warn("Received a JOIN packet from another server for unknown nickname or for nickname that isn't originally from that server!\n");
             return 0;
@@ -522,13 +773,14 @@ int handle_server_packet(server_t *server, char *packet) {
         if (channel_name == NULL) {
             return 0;
         }
-        nickname_t *nick = cfuhash_get(nicknames_hash, nickname);
+        nickname_t **found = nick_table_get(&nicknames_hash, nick_key(nickname, strlen(nickname)));
+        nickname_t *nick = found ? *found : NULL;
         if (nick && nick->type == REMOTE &&
             ((remotenick_t*)nick)->server == server) {
             // we should only get LEAVEs for remote nicknames. and the server should be the one
             // that told us about the nickname in the first place
             channel_t *channel = cfuhash_get(channels_hash, channel_name);
-            if (channel && cfuhash_exists(channel->nicknames, nick->nickname)) {
+            if (channel && channel_has_nickname(channel, nick)) {
                 int removed = 0;
                 for (int i = 0; i < USER_MAX_CHANNELS; i++) {
                     if (nick->channels[i] == channel) {
@@ -540,13 +792,13 @@ int handle_server_packet(server_t *server, char *packet) {
                 if (!removed) {
                     log_warn("POSSIBLE CRITICAL FAILURE, channel_t thinks user is on channel but nickname_t doesn't!\n");
                 }
-                cfuhash_delete(channel->nicknames, nick->nickname); 
+                channel_remove_nickname(channel, nick);
                 if (cfuhash_num_entries(channel->nicknames) == 0) {
                     channel_destroy(channel);
                 } else {
-                    char packet[NETWORK_MAX_PACKET_SIZE];
-                    snprintf(packet, NETWORK_MAX_PACKET_SIZE, "LEAVE %s %s", nick->nickname, channel->name);
-                    channel_broadcast(channel, packet, 0);
+                    packet_builder_t packet;
+                    size_t packet_len = build_membership_packet(&packet, "LEAVE", strlen("LEAVE"), nick, channel);
+                    channel_broadcast(channel, packet.buf, packet_len, 0);
                 }
             }
         } else {
@@ -557,70 +809,213 @@ int handle_server_packet(server_t *server, char *packet) {
     return 0;
 }
 
+int handle_server_packet(server_t *server, char *packet, size_t packet_len) {
+    metrics_command command = metrics_command_of(packet, packet_len);
+    int fd = server->conn.fd;
+    PROBE3(dispatch, fd, command, metrics_command_name(command));
+    uint64_t start = metrics_now_ns();
+    int result = dispatch_server_packet(server, packet, packet_len);
+    uint64_t elapsed = metrics_now_ns() - start;
+    metrics_record(METRIC_HANDLER_NS + command, elapsed);
+    network_note_packet(command, elapsed);
+    PROBE4(dispatch_end, fd, command, metrics_command_name(command), elapsed);
+    flightrec_add(FLIGHTREC_PACKET, fd, SERVER, command, packet_len, elapsed / 1000);
+    metrics_count(METRIC_PACKETS_IN + command, 1);
+    return result;
+}
+
 void handle_server_connect(server_t *server) {
     // tell the server about all the nicknames we know of 
-    char *nickname;
+    size_t pos = 0;
     nickname_t *nickname_struct;
-    int res = cfuhash_each(nicknames_hash, &nickname, (void**)&nickname_struct);
-    char packet[NETWORK_MAX_PACKET_SIZE];
-    while (res != 0) {
-        snprintf(packet, NETWORK_MAX_PACKET_SIZE, "NICK %s", nickname);
-        send_packet((conn_t*)server, packet);
+    packet_builder_t packet;
+    while (nick_table_next(&nicknames_hash, &pos, NULL, &nickname_struct)) {
+        packet_builder_init(&packet);
+        packet_append_literal(&packet, "NICK ");
+        packet_append(&packet, nickname_struct->nickname, nickname_struct->nickname_len);
+        send_packet((conn_t*)server, packet.buf, packet_finish(&packet));
         // send the channels for the nickname
         for (int i = 0; i < USER_MAX_CHANNELS; i++) {
             if (nickname_struct->channels[i] != NULL) {
                 channel_t *channel = nickname_struct->channels[i];
-                snprintf(packet, NETWORK_MAX_PACKET_SIZE, "JOIN %s %s", nickname, channel->name);
-                send_packet((conn_t*)server, packet);
+                size_t packet_len = build_membership_packet(&packet, "JOIN", strlen("JOIN"), nickname_struct, channel);
+                send_packet((conn_t*)server, packet.buf, packet_len);
             }
         }
-        res = cfuhash_next(nicknames_hash, &nickname, (void**)&nickname_struct);
-    }
-    cfuhash_put_data(servers_hash, server, sizeof(server), server, sizeof(server), NULL);
-}
-
-int remove_from_server(void *key, size_t key_size, void *data, size_t data_size, void *arg) {
-    key = key; // skip unused warnings. we don't really need those parameters
-    key_size = key_size;
-    data_size = data_size;
-    // return true to remove from nicknames_hash
-    nickname_t *nick = (nickname_t*)data;
-    if (nick->type != REMOTE) {
-        return 0;
     }
-    remotenick_t *remotenick = (remotenick_t*)nick;
-    if (remotenick->server == (server_t*)arg) {
-        return 1;
-    } else {
-        return 0;
+    int inserted;
+    server_t **slot = server_table_insert(&servers_hash, server, &inserted);
+    if (slot == NULL) {
+        log_error("Failed to add server %d, out of memory\n", server->conn.fd);
+        return;
     }
-}
-
-void free_nickname(void *data) {
-    free(data);
+    *slot = server;
 }
 
 void handle_server_disconnect(server_t *server) {
     log_info("Server %d disconnected\n", server->conn.fd);
-    void *data = cfuhash_delete_data(servers_hash, server, sizeof(server));
-    assert(data != NULL);
+    int removed = server_table_remove(&servers_hash, server, NULL);
+    assert(removed);
     // kill all the nicknames associated with this server
-    char packet[NETWORK_MAX_PACKET_SIZE];
-    char *nickname;
+    packet_builder_t packet;
+    size_t pos = 0;
+    nick_key_t key;
     nickname_t *nickname_struct;
-    int res = cfuhash_each(nicknames_hash, &nickname, (void**)&nickname_struct);
-    while (res != 0) {
+    while (nick_table_next(&nicknames_hash, &pos, &key, &nickname_struct)) {
         if (nickname_struct->type == REMOTE) {
             remotenick_t *remotenick = (remotenick_t*)nickname_struct;
             if (remotenick->server == server) {
-                snprintf(packet, NETWORK_MAX_PACKET_SIZE, "KILL %s netsplit", nickname);
-                server_broadcast(packet);
-                remove_from_channels(nickname_struct, "netsplit");
+                size_t packet_len = build_kill_packet(&packet, nickname_struct->nickname, nickname_struct->nickname_len,
+                                                      "netsplit", strlen("netsplit"));
+                server_broadcast(packet.buf, packet_len);
+                remove_from_channels(nickname_struct, "netsplit", strlen("netsplit"));
+                // removing doesn't move the other entries, so the iteration can go on
+                nick_table_remove(&nicknames_hash, key, NULL);
+                free_nickname(nickname_struct);
             }
         }
-        res = cfuhash_next(nicknames_hash, &nickname, (void**)&nickname_struct);
     }
-    // finally remove from the nicknames from the hashtable
-    cfuhash_foreach_remove(nicknames_hash, &remove_from_server, &free_nickname, server);
 }
 
+static int stats_interval = 0;
+static time_t stats_logged = 0;
+
+void set_stats_interval(int interval) {
+    stats_interval = interval;
+}
+
+static void log_cfuhash_stats(const char *name, cfuhash_stats_t *stats) {
+    char histogram[CFUHASH_STATS_HISTOGRAM_SIZE * 21];
+    size_t len = 0;
+    for (int i = 0; i < CFUHASH_STATS_HISTOGRAM_SIZE; i++) {
+        len += snprintf(&histogram[len], sizeof(histogram) - len, i ? " %zu" : "%zu", stats->histogram[i]);
+    }
+    log_info("Table %s: entries %zu buckets %zu (old %zu) used %zu load %.2f probes avg %.2f max %zu histogram [%s] rehashes %u (%.3f ms)\n",
+             name, stats->entries, stats->buckets, stats->old_buckets, stats->buckets_used, stats->load_factor,
+             stats->avg_probe, stats->max_probe, histogram, stats->rehash_count, stats->rehash_ns / 1e6);
+}
+
+// logs the statistics of the shared tables, and the member table of the biggest channel
+void log_table_stats() {
+    typed_hash_stats_t nick_stats;
+    nick_table_get_stats(&nicknames_hash, &nick_stats);
+    log_info("Table nicknames: entries %zu slots %zu (old %zu) tombstones %zu load %.2f probes avg %.2f max %zu rebuilds %u\n",
+             nick_stats.count, nick_stats.capacity, nick_stats.old_capacity, nick_stats.tombstones,
+             (double)nick_stats.count / nick_stats.capacity, nick_stats.avg_probe, nick_stats.max_probe,
+             nick_stats.rebuilds);
+
+    cfuhash_stats_t stats;
+    cfuhash_get_stats(channels_hash, &stats);
+    log_cfuhash_stats("channels", &stats);
+    symbols_get_stats(&stats);
+    log_cfuhash_stats("symbols", &stats);
+
+    cfuhash_iter_t iter;
+    channel_t *channel, *biggest = NULL;
+    cfuhash_iter_init(&iter, channels_hash);
+    while (cfuhash_iter_next(&iter, NULL, NULL, (void**)&channel, NULL)) {
+        if (biggest == NULL || cfuhash_num_entries(channel->nicknames) > cfuhash_num_entries(biggest->nicknames)) {
+            biggest = channel;
+        }
+    }
+    if (biggest != NULL) {
+        char name[CHANNEL_LENGTH + 16];
+        snprintf(name, sizeof(name), "%s members", biggest->name);
+        cfuhash_get_stats(biggest->nicknames, &stats);
+        log_cfuhash_stats(name, &stats);
+    }
+}
+
+// logs the traffic, and the packet counts and handling times per command
+void log_metrics() {
+    metrics_snapshot_t metrics;
+    metrics_snapshot(&metrics);
+    log_info("Metrics: clients %lld servers %lld channels %lld read %llu bytes written %llu bytes partial writes %llu\n",
+             (long long)metrics.gauges[METRIC_CLIENTS], (long long)metrics.gauges[METRIC_SERVERS],
+             (long long)metrics.gauges[METRIC_CHANNELS],
+             (unsigned long long)metrics.counters[METRIC_BYTES_READ],
+             (unsigned long long)metrics.counters[METRIC_BYTES_WRITTEN],
+             (unsigned long long)metrics.counters[METRIC_PARTIAL_WRITES]);
+    metrics_histogram_t *fanout = &metrics.histograms[METRIC_FANOUT];
+    log_info("Metrics fanout: broadcasts %llu p50 %llu p99 %llu\n", (unsigned long long)fanout->count,
+             (unsigned long long)metrics_percentile(fanout, 0.5),
+             (unsigned long long)metrics_percentile(fanout, 0.99));
+    metrics_histogram_t *busy = &metrics.histograms[METRIC_LOOP_BUSY_NS];
+    metrics_histogram_t *events = &metrics.histograms[METRIC_LOOP_EVENTS];
+    log_info("Metrics loop: wakeups %llu events p50 %llu p99 %llu busy p50 %.1f us p99 %.1f us stalls %llu\n",
+             (unsigned long long)busy->count, (unsigned long long)metrics_percentile(events, 0.5),
+             (unsigned long long)metrics_percentile(events, 0.99),
+             metrics_percentile(busy, 0.5) / 1e3, metrics_percentile(busy, 0.99) / 1e3,
+             (unsigned long long)metrics.counters[METRIC_LOOP_STALLS]);
+    for (int i = 0; i < METRICS_COMMANDS; i++) {
+        uint64_t in = metrics.counters[METRIC_PACKETS_IN + i];
+        uint64_t out = metrics.counters[METRIC_PACKETS_OUT + i];
+        if (in == 0 && out == 0) {
+            continue;
+        }
+        metrics_histogram_t *handler = &metrics.histograms[METRIC_HANDLER_NS + i];
+        log_info("Metrics %s: in %llu out %llu handler p50 %.1f us p99 %.1f us\n", metrics_command_name(i),
+                 (unsigned long long)in, (unsigned long long)out,
+                 metrics_percentile(handler, 0.5) / 1e3, metrics_percentile(handler, 0.99) / 1e3);
+    }
+}
+
+void packets_get_state(packets_state_t *state) {
+    memset(state, 0, sizeof(packets_state_t));
+    state->nicknames = nick_table_count(&nicknames_hash);
+    state->local_nicknames = local_nicknames;
+    state->channels = cfuhash_num_entries(channels_hash);
+    state->servers = server_table_count(&servers_hash);
+
+    state->nick_table_memory = nick_table_memory(&nicknames_hash);
+    state->channel_table_memory = cfuhash_memory(channels_hash);
+    state->channel_memory = channel_memory;
+    state->symbol_memory = symbols_memory();
+    state->nickname_memory = local_nicknames * sizeof(localnick_t) +
+                             (state->nicknames - local_nicknames) * sizeof(remotenick_t);
+    state->server_memory = state->servers * sizeof(server_t);
+}
+
+void packets_foreach_server(void (*fn)(conn_t *conn, void *arg), void *arg) {
+    size_t pos = 0;
+    server_t *server;
+    while (server_table_next(&servers_hash, &pos, &server, NULL)) {
+        fn((conn_t*)server, arg);
+    }
+}
+
+int packets_walk_links(packets_link_cursor_t *cursor, size_t max, void (*fn)(conn_t *conn, void *arg), void *arg) {
+    size_t walked = 0;
+    if (!cursor->clients) {
+        server_t *server;
+        while (walked < max && server_table_next(&servers_hash, &cursor->pos, &server, NULL)) {
+            fn((conn_t*)server, arg);
+            walked++;
+        }
+        if (walked == max) {
+            return 1;
+        }
+        cursor->clients = 1;
+        cursor->pos = 0;
+    }
+    nickname_t *nick;
+    while (walked < max && nick_table_next(&nicknames_hash, &cursor->pos, NULL, &nick)) {
+        if (nick->type == LOCAL) {
+            fn((conn_t*)((localnick_t*)nick)->client, arg);
+            walked++;
+        }
+    }
+    return walked == max;
+}
+
+void handle_timer() {
+    if (stats_interval > 0) {
+        time_t now = time(NULL);
+        if (now - stats_logged >= stats_interval) {
+            stats_logged = now;
+            log_table_stats();
+            log_metrics();
+            log_tcpstats();
+        }
+    }
+}
@@ -12,6 +12,9 @@
 #include "cfuconf.h"
 #include "logging.h"
 #include "daemon.h"
+#include "admin.h"
+#include "flightrec.h"
+#include "tcpstats.h"
 
 int get_and_set_port(char *port_str, uint16_t *port) {
     char *endptr;
@@ -25,6 +28,25 @@ int get_and_set_port(char *port_str, uint16_t *port) {
     return 1;
 }
 
+// parses a "<directive> <rate> <burst>" flood limit from the config
+// returns 0 if the directive exists but its values are invalid
+int parse_flood_limit(cfuconf_t *config, char *directive, flood_class class) {
+    char *rate_str, *burst_str;
+    if (cfuconf_get_directive_two_args(config, directive, &rate_str, &burst_str) < 0) {
+        printf("Flood limit can be defined with '%s <packets per second> <burst>'\n", directive);
+        return 1;
+    }
+    char *rate_end, *burst_end;
+    long rate = strtol(rate_str, &rate_end, 10);
+    long burst = strtol(burst_str, &burst_end, 10);
+    if (rate_end == rate_str || *rate_end != '\0' || burst_end == burst_str || *burst_end != '\0' ||
+        rate < 0 || burst < 1 || rate > UINT16_MAX || burst > UINT16_MAX) {
+        return 0;
+    }
+    flood_set_limit(class, (uint32_t)rate, (uint32_t)burst);
+    return 1;
+}
+
 int parse_log_level(char *log_level_str, log_level *log_level) {
     if (strcasecmp(log_level_str, "debug") == 0) {
         *log_level = DEBUG;
@@ -142,6 +164,17 @@ int main(int argc, char **argv) {
         printf("The log file can be defined with 'log_file'\n");
     }
 
+    int log_binary = 0;
+    char *log_format_str;
+    if (cfuconf_get_directive_one_arg(config, "log_format", &log_format_str) == 0) {
+        if (strcasecmp(log_format_str, "binary") == 0) {
+            log_binary = 1;
+        } else if (strcasecmp(log_format_str, "text") != 0) {
+            printf("Invalid value for 'log_format'! Possible values are: text, binary\n");
+            return 2;
+        }
+    }
+
     int daemonize = 0;
     char *daemonize_str;
     if (cfuconf_get_directive_one_arg(config, "daemonize", &daemonize_str) < 0) {
@@ -150,6 +183,66 @@ int main(int argc, char **argv) {
         daemonize = 1;
     }
 
+    if (!parse_flood_limit(config, "flood_limit", FLOOD_ALL) ||
+        !parse_flood_limit(config, "flood_limit_msg", FLOOD_MSG) ||
+        !parse_flood_limit(config, "flood_limit_join", FLOOD_JOIN) ||
+        !parse_flood_limit(config, "flood_limit_names", FLOOD_NAMES)) {
+        printf("Invalid value for a flood limit!\n");
+        return 2;
+    }
+
+    char *admin_listen;
+    if (cfuconf_get_directive_one_arg(config, "admin_listen", &admin_listen) == 0) {
+        admin_set_listen(admin_listen);
+    }
+
+    char *stats_interval_str;
+    if (cfuconf_get_directive_one_arg(config, "stats_interval", &stats_interval_str) == 0) {
+        char *endptr;
+        long stats_interval = strtol(stats_interval_str, &endptr, 10);
+        if (endptr == stats_interval_str || *endptr != '\0' || stats_interval < 0 || stats_interval > INT32_MAX) {
+            printf("Invalid value for 'stats_interval'!\n");
+            return 2;
+        }
+        set_stats_interval((int)stats_interval);
+    }
+
+    // the flight recorder dumps next to the log file unless told otherwise,
+    // without either there is nowhere safe to dump it
+    char *flight_recorder_file = NULL;
+    char flight_recorder_default[FLIGHTREC_PATH_LENGTH];
+    if (cfuconf_get_directive_one_arg(config, "flight_recorder_file", &flight_recorder_file) < 0 && log_filename) {
+        snprintf(flight_recorder_default, sizeof(flight_recorder_default), "%s.flight", log_filename);
+        flight_recorder_file = flight_recorder_default;
+    }
+    if (flight_recorder_file && !flightrec_install(flight_recorder_file)) {
+        printf("Failed to set up the flight recorder, is 'flight_recorder_file' too long?\n");
+        return 2;
+    }
+
+    char *tcp_sample_interval_str;
+    if (cfuconf_get_directive_one_arg(config, "tcp_sample_interval", &tcp_sample_interval_str) == 0) {
+        char *endptr;
+        long tcp_sample_interval = strtol(tcp_sample_interval_str, &endptr, 10);
+        if (endptr == tcp_sample_interval_str || *endptr != '\0' || tcp_sample_interval < 0 ||
+            tcp_sample_interval > INT32_MAX) {
+            printf("Invalid value for 'tcp_sample_interval'!\n");
+            return 2;
+        }
+        tcpstats_set_interval((int)tcp_sample_interval);
+    }
+
+    char *stall_threshold_str;
+    if (cfuconf_get_directive_one_arg(config, "stall_threshold", &stall_threshold_str) == 0) {
+        char *endptr;
+        long stall_threshold = strtol(stall_threshold_str, &endptr, 10);
+        if (endptr == stall_threshold_str || *endptr != '\0' || stall_threshold < 0 || stall_threshold > INT32_MAX) {
+            printf("Invalid value for 'stall_threshold'!\n");
+            return 2;
+        }
+        network_set_stall_threshold((int)stall_threshold);
+    }
+
     if (client_port == server_port) {
         printf("Client and server communication ports can't be the same!\n");
         return 2;
@@ -160,6 +253,11 @@ int main(int argc, char **argv) {
         return 2;
     }
 
+    if (log_binary && !log_filename) {
+        printf("Log file name must be specified for the binary log format!\n");
+        return 2;
+    }
+
     if (daemonize && pid_file_exists()) {
         printf("A pid file at %s already exists!\n", PID_FILE_PATH);
         return 4;
@@ -169,6 +267,11 @@ int main(int argc, char **argv) {
         return 3; 
     }
 
+    if (log_binary && !log_use_binary()) {
+        printf("Failed to switch the log to the binary format!\n");
+        return 3;
+    }
+
     cfuconf_destroy(config);
 
     log_info("Using port %d for client connections\n", client_port);
@@ -187,6 +290,11 @@ int main(int argc, char **argv) {
         init_daemon();
     }
 
+    // threads don't survive the forks of daemonizing, so start it only now
+    if (!log_start_writer()) {
+        log_warn("Failed to start the log writer thread, logging synchronously\n");
+    }
+
     log_info("Server starting...\n");
     init_packets();
     return network_start(client_port, socket_domain, socket_protocol, server_addr, server_addr_size, server_port);
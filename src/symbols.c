@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <ctype.h>
+#include "symbols.h"
+#include "cfuhash.h"
+#include "logging.h"
+
+typedef struct {
+    uint32_t refcount;
+    symbol_t next_free; // next unused id when refcount is 0
+    char *name;         // case-folded name, also used as the key in symbols_hash
+    size_t name_len;
+} symbol_entry_t;
+
+cfuhash_table_t *symbols_hash; // case-folded name -> symbol_t
+symbol_entry_t *symbol_entries; // symbol_t -> symbol_entry_t
+size_t symbol_entries_size = 0;
+symbol_t symbol_free_list = SYMBOL_NONE;
+
+void init_symbols() {
+    symbols_hash = cfuhash_new_with_initial_size(1000);
+    // the keys are owned by symbol_entries
+    cfuhash_set_flag(symbols_hash, CFUHASH_NOCOPY_KEYS);
+    // id 0 is SYMBOL_NONE and never handed out
+    symbol_entries_size = 1;
+    symbol_entries = calloc(symbol_entries_size, sizeof(symbol_entry_t));
+    assert(symbol_entries != NULL);
+}
+
+// writes the canonical (lower case) form of name to folded
+// returns the length of the folded name
+static size_t symbol_fold(const char *name, size_t name_len, char *folded) {
+    if (name_len > SYMBOL_MAX_LENGTH) {
+        name_len = SYMBOL_MAX_LENGTH;
+    }
+    for (size_t i = 0; i < name_len; i++) {
+        folded[i] = tolower((unsigned char)name[i]);
+    }
+    return name_len;
+}
+
+symbol_t symbol_lookup(const char *name, size_t name_len) {
+    char folded[SYMBOL_MAX_LENGTH];
+    size_t folded_len = symbol_fold(name, name_len, folded);
+    void *data;
+    if (cfuhash_get_data(symbols_hash, folded, folded_len, &data, NULL)) {
+        return (symbol_t)(uintptr_t)data;
+    }
+    return SYMBOL_NONE;
+}
+
+static symbol_t symbol_allocate() {
+    if (symbol_free_list != SYMBOL_NONE) {
+        symbol_t symbol = symbol_free_list;
+        symbol_free_list = symbol_entries[symbol].next_free;
+        return symbol;
+    }
+    symbol_entry_t *entries = realloc(symbol_entries, symbol_entries_size * 2 * sizeof(symbol_entry_t));
+    if (entries == NULL) {
+        return SYMBOL_NONE;
+    }
+    symbol_entries = entries;
+    // chain the new ids to the free list, except the first one which is returned
+    symbol_t first = symbol_entries_size;
+    for (size_t i = first + 1; i < symbol_entries_size * 2; i++) {
+        symbol_entries[i].refcount = 0;
+        symbol_entries[i].next_free = i + 1 < symbol_entries_size * 2 ? i + 1 : SYMBOL_NONE;
+    }
+    symbol_free_list = first + 1 < symbol_entries_size * 2 ? first + 1 : SYMBOL_NONE;
+    symbol_entries_size *= 2;
+    return first;
+}
+
+symbol_t symbol_intern(const char *name, size_t name_len) {
+    char folded[SYMBOL_MAX_LENGTH];
+    size_t folded_len = symbol_fold(name, name_len, folded);
+    void *data;
+    symbol_t symbol;
+    if (cfuhash_get_data(symbols_hash, folded, folded_len, &data, NULL)) {
+        symbol = (symbol_t)(uintptr_t)data;
+    } else {
+        char *canonical = malloc(folded_len);
+        symbol = canonical ? symbol_allocate() : SYMBOL_NONE;
+        if (symbol == SYMBOL_NONE) {
+            log_error("Failed to intern '%.*s', out of memory\n", (int)name_len, name);
+            free(canonical);
+            return SYMBOL_NONE;
+        }
+        memcpy(canonical, folded, folded_len);
+        symbol_entries[symbol].refcount = 0;
+        symbol_entries[symbol].name = canonical;
+        symbol_entries[symbol].name_len = folded_len;
+        cfuhash_put_data(symbols_hash, canonical, folded_len, (void*)(uintptr_t)symbol, 0, NULL);
+    }
+    symbol_entries[symbol].refcount++;
+    return symbol;
+}
+
+void symbols_get_stats(cfuhash_stats_t *stats) {
+    cfuhash_get_stats(symbols_hash, stats);
+}
+
+size_t symbols_memory() {
+    return cfuhash_memory(symbols_hash);
+}
+
+void symbol_release(symbol_t symbol) {
+    if (symbol == SYMBOL_NONE) {
+        return;
+    }
+    assert(symbol < symbol_entries_size && symbol_entries[symbol].refcount > 0);
+    symbol_entries[symbol].refcount--;
+    if (symbol_entries[symbol].refcount == 0) {
+        symbol_entry_t *entry = &symbol_entries[symbol];
+        cfuhash_delete_data(symbols_hash, entry->name, entry->name_len);
+        free(entry->name);
+        entry->name = NULL;
+        symbol_entries[symbol].next_free = symbol_free_list;
+        symbol_free_list = symbol;
+    }
+}
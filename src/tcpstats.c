@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "tcpstats.h"
+#include "network.h"
+#include "packets.h"
+#include "metrics.h"
+#include "logging.h"
+
+static int sample_interval = TCPSTATS_DEFAULT_INTERVAL;
+// when the current round started (0 if there's none going on), where it is
+// and how many links it has sampled
+static time_t round_started = 0;
+static time_t round_ended = 0;
+static packets_link_cursor_t cursor;
+static size_t round_sampled = 0;
+
+// the worst offenders of the last round, the most queued first. copied, as
+// the connections may be gone by the time they're looked at
+static tcpstats_link_t worst[TCPSTATS_WORST];
+static int worst_count = 0;
+// the round being sampled
+static tcpstats_link_t round_worst[TCPSTATS_WORST];
+static int round_worst_count = 0;
+
+// the client send queues of the last round and the round being sampled
+static tcpstats_queues_t client_queues;
+static tcpstats_queues_t round_client_queues;
+
+void tcpstats_set_interval(int seconds) {
+    sample_interval = seconds;
+}
+
+// the connection ranks above the other if it has more queued on average,
+// or the same and a longer round trip
+static int is_worse(const tcp_sample_t *sample, const tcp_sample_t *other) {
+    if (sample->send_queue_avg != other->send_queue_avg) {
+        return sample->send_queue_avg > other->send_queue_avg;
+    }
+    return sample->rtt_us > other->rtt_us;
+}
+
+static void rank_link(conn_t *conn, const tcp_sample_t *sample) {
+    int pos = round_worst_count;
+    while (pos > 0 && is_worse(sample, &round_worst[pos - 1].sample)) {
+        pos--;
+    }
+    if (pos >= TCPSTATS_WORST) {
+        return;
+    }
+    int last = round_worst_count < TCPSTATS_WORST ? round_worst_count : TCPSTATS_WORST - 1;
+    memmove(&round_worst[pos + 1], &round_worst[pos], (last - pos) * sizeof(tcpstats_link_t));
+    if (round_worst_count < TCPSTATS_WORST) {
+        round_worst_count++;
+    }
+
+    tcpstats_link_t *link = &round_worst[pos];
+    link->fd = conn->fd;
+    link->type = conn->type;
+    link->nickname[0] = '\0';
+    if (conn->type == CLIENT) {
+        nickname_t *nick = &((client_t*)conn)->nick->nick;
+        snprintf(link->nickname, sizeof(link->nickname), "%.*s", (int)nick->nickname_len, nick->nickname);
+    }
+    link->sample = *sample;
+}
+
+static void sample_link(conn_t *conn, void *arg) {
+    (void)arg;
+    round_sampled++;
+    tcp_sample_t *sample = conn->type == CLIENT ? &((client_t*)conn)->tcp : &((server_t*)conn)->tcp;
+    int queued;
+    if (ioctl(conn->fd, SIOCOUTQ, &queued) < 0) {
+        return;
+    }
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    if (getsockopt(conn->fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) < 0) {
+        return;
+    }
+
+    sample->send_queue = queued;
+    if (sample->samples == 0) {
+        sample->send_queue_avg = queued;
+    } else {
+        sample->send_queue_avg = (3ull * sample->send_queue_avg + (uint32_t)queued) / 4;
+    }
+    if (sample->send_queue > sample->send_queue_max) {
+        sample->send_queue_max = sample->send_queue;
+    }
+    if (conn->type == CLIENT) {
+        round_client_queues.clients++;
+        round_client_queues.send_queue_total += queued;
+        if ((size_t)queued > round_client_queues.send_queue_max) {
+            round_client_queues.send_queue_max = queued;
+        }
+    }
+    sample->rtt_us = info.tcpi_rtt;
+    sample->cwnd = info.tcpi_snd_cwnd;
+    sample->unacked = info.tcpi_unacked;
+    sample->retransmits_new = sample->samples > 0 ? info.tcpi_total_retrans - sample->retransmits : 0;
+    sample->retransmits = info.tcpi_total_retrans;
+    sample->samples++;
+
+    metrics_record(METRIC_TCP_RTT_US, sample->rtt_us);
+    metrics_record(METRIC_TCP_SEND_QUEUE, sample->send_queue);
+    metrics_count(METRIC_TCP_RETRANSMITS, sample->retransmits_new);
+    rank_link(conn, sample);
+}
+
+void tcpstats_timer() {
+    if (sample_interval <= 0) {
+        return;
+    }
+    time_t now = time(NULL);
+    if (!round_started) {
+        if (now - round_ended < sample_interval) {
+            return;
+        }
+        round_started = now;
+        round_worst_count = 0;
+        memset(&round_client_queues, 0, sizeof(round_client_queues));
+        round_sampled = 0;
+        memset(&cursor, 0, sizeof(cursor));
+    }
+    // two system calls per connection, so a round is spread evenly over the
+    // interval, and no more than TCPSTATS_BATCH links are sampled per wakeup
+    // to keep the event loop responsive. with few wakeups and many links a
+    // round takes longer than the interval
+    size_t links = metrics_gauges[METRIC_CLIENTS] + metrics_gauges[METRIC_SERVERS];
+    size_t due = links * (now - round_started + 1) / sample_interval + 1;
+    if (due <= round_sampled) {
+        return;
+    }
+    size_t batch = due - round_sampled < TCPSTATS_BATCH ? due - round_sampled : TCPSTATS_BATCH;
+    if (packets_walk_links(&cursor, batch, sample_link, NULL)) {
+        return;
+    }
+    memcpy(worst, round_worst, round_worst_count * sizeof(tcpstats_link_t));
+    worst_count = round_worst_count;
+    client_queues = round_client_queues;
+    round_started = 0;
+    round_ended = now;
+}
+
+int tcpstats_worst(const tcpstats_link_t **links) {
+    *links = worst;
+    return worst_count;
+}
+
+const tcpstats_queues_t *tcpstats_client_queues() {
+    return &client_queues;
+}
+
+void log_tcpstats() {
+    for (int i = 0; i < worst_count; i++) {
+        const tcpstats_link_t *link = &worst[i];
+        log_info("TCP worst %d: %s %s fd %d queued %u avg %u max %u rtt %.1f ms cwnd %u unacked %u retransmits %u\n",
+                 i + 1, link->type == CLIENT ? "client" : "server", link->nickname, link->fd,
+                 link->sample.send_queue, link->sample.send_queue_avg, link->sample.send_queue_max,
+                 link->sample.rtt_us / 1e3, link->sample.cwnd, link->sample.unacked, link->sample.retransmits);
+    }
+}
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include "timecache.h"
+
+typedef struct {
+    time_t seconds;
+    char hms[TIMECACHE_HMS_LENGTH + 1];
+} timecache_t;
+
+static __thread timecache_t timecache = { -1, "" };
+
+time_t timecache_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return now.tv_sec;
+}
+
+const char *timecache_hms(time_t seconds) {
+    if (seconds == timecache.seconds) {
+        return timecache.hms;
+    }
+    // timezone offsets are whole minutes, so within the same minute only
+    // the seconds digits change
+    if (timecache.seconds >= 0 && seconds / 60 == timecache.seconds / 60) {
+        int sec = seconds % 60;
+        timecache.hms[6] = '0' + sec / 10;
+        timecache.hms[7] = '0' + sec % 10;
+    } else {
+        struct tm tm;
+        localtime_r(&seconds, &tm);
+        snprintf(timecache.hms, sizeof(timecache.hms), "%.2d:%.2d:%.2d", tm.tm_hour, tm.tm_min, tm.tm_sec);
+    }
+    timecache.seconds = seconds;
+    return timecache.hms;
+}